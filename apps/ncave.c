@@ -10,8 +10,8 @@
  * Description: NCAVE targets averaging very large ensemble dumps. Compared to
  *              NCEA/NCRA it (1) conserves memory by averaging on layer-by-layer
  *              basis, and (2) when run on multiple CPUs processes layers in
- *              parallel. Note that for optimal efficiency the input dumps must
- *              be chunked by layers.
+ *              parallel. For variables chunked by several layers the fields
+ *              are slabs of layers aligned with the chunks, of limited size.
  *
  *****************************************************************************/
 
@@ -19,26 +19,24 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
 #include <math.h>
 #include <stdint.h>
-#include <dirent.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <ftw.h>
+#include <float.h>
+#include <limits.h>
 #include <unistd.h>
-#include <libgen.h>
 #if defined(MPI)
 #include  <mpi.h>
 #endif
 #include "ncw.h"
 #include "ncutils.h"
 #include "version.h"
-#include "distribute.h"
 #include "utils.h"
+#include "profile.h"
 
 #define PROGRAM_NAME "ncave"
-#define PROGRAM_VERSION "0.01"
+#define PROGRAM_VERSION "0.12"
 
 #define ALIGN __attribute__((aligned(32)))
 
@@ -47,25 +45,82 @@
 #define NFIELD_INC 100
 #define BIGNUM 1.0e+20
 #define TMPVARNAME "ncave.tmpname"
+/*
+ * maximal size of the ensemble block and of the field buffers (bytes)
+ */
+#define ENSBLOCK_MAX 268435456
+
+#define TAG_TASK 1
+#define TAG_DATA 2
+
+#define NSTAT 5
+#define STAT_MEAN 0
+#define STAT_SD 1
+#define STAT_MIN 2
+#define STAT_MAX 3
+#define STAT_COUNT 4
 
 int verbose = 0;
 int force = 0;
+int maxopen = 0;
+int pipeline = 0;
+
+/*
+ * ensemble statistics; the mean is always calculated, other statistics are
+ * written to variables with names <var><suffix>
+ */
+static char* statnames[NSTAT] = { "mean", "sd", "min", "max", "count" };
+static char* statsuffixes[NSTAT] = { "", "_sd", "_min", "_max", "_count" };
+static char* statdescs[NSTAT] = { "ensemble mean", "ensemble standard deviation", "ensemble minimum", "ensemble maximum", "number of valid members" };
+int nstat = 1;
+int stats[NSTAT] = { STAT_MEAN };
+
+/*
+ * member weights (NULL = equal weights)
+ */
+int nweight = 0;
+double* weights = NULL;
 
 int nprocesses = 1;
 int rank = 0;
 
-char tmpdirname[MAXSTRLEN] = ".";
-
 typedef struct {
     int fid;
     char* varname;
     int ni, nj, nk;
     int k;
-    size_t start[4];
-    size_t count[4];
+    int nlayer;                 /* number of layers (starting from k) */
     size_t n;
 } field;
 
+/*
+ * input file
+ */
+typedef struct {
+    char* fname;
+    int ncid;                   /* -1 if closed */
+    ncu_field* handle;          /* descriptor of the current variable */
+    char* handle_varname;
+} member;
+
+/*
+ * input files kept open by a process
+ */
+typedef struct {
+    int n;
+    member* members;
+    int nopen;
+    int last;                   /* the most recently used member */
+    int nreopen;
+
+    /*
+     * all members open, used unless the number of open files is limited
+     */
+    ncu_ensemble* ens;
+    size_t nblock;
+    float* block;               /* [n][field size] */
+} memberset;
+
 /**
  */
 static void printlog(const char* format, ...)
@@ -80,73 +135,34 @@ static void printlog(const char* format, ...)
     }
 }
 
-/**
- */
-static int dir_exists(char dirname[])
-{
-    DIR* d;
-
-    d = opendir(dirname);
-    if (d == NULL)
-        return 0;
-    closedir(d);
-    return 1;
-}
-
-/**
- */
-static int dir_createifabsent(char dirname[])
-{
-    int status;
-
-    if (dir_exists(dirname))
-        return 1;
-    status = mkdir(dirname, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-    if (status == 0)
-        return 1;
-    else {
-        int errno_saved = errno;
-
-        quit("could not create directory \"%s\": %s", dirname, strerror(errno_saved));
-    }
-    return 0;
-}
-
-/**
- */
-static int rmentry(const char* entry, const struct stat* sb, int typeflag, struct FTW* ftwbuf)
-{
-    return remove(entry);
-}
-
-/**
- */
-static void dir_rmallifexists(char dirname[])
-{
-    int status;
-
-    if (!dir_exists(dirname))
-        return;
-    status = nftw(dirname, rmentry, 64, FTW_DEPTH | FTW_PHYS);
-    if (status != 0) {
-        int errno_saved = errno;
-
-        quit("dir_rmallifexists(): \"%s\": %s", dirname, strerror(errno_saved));
-    }
-}
-
 /**
  */
 static void usage(int exitstatus)
 {
-    printf("  Usage: ncave [-v <var>] [...] [-c <var>] [...] [-V] [-f] {<src> [...] <dst>}\n");
+    printf("  Usage: ncave [-v <var>] [...] [-c <var>] [...] [-M <maxopen>] [-s <stat> [...]] [-w <weight> [...]] [-z <policy>] [-p] [-P] [-V] [-f] {<src> [...] <dst>}\n");
     printf("         ncave -v\n");
     printf("  Parameters:\n");
     printf("    -v <var>            -- variable to be averaged over all input files\n");
     printf("                           (default: all variables with 2 or more dimensions)\n");
     printf("    -c <var>            -- variable to be copied from the first input file\n");
     printf("    {<src> [...] <dst>} -- list of input files followed by the output  file\n");
+    printf("    -M <maxopen>        -- maximal number of input files open at a time by\n");
+    printf("                           a process (default: no limit -- then each field\n");
+    printf("                           is read from all members into a single buffer\n");
+    printf("                           of up to 256 MB)\n");
+    printf("    -s <stat> [...]     -- also calculate ensemble statistics (sd, min, max,\n");
+    printf("                           count) and write them to variables <var>_<stat>;\n");
+    printf("                           the members are read once for all statistics\n");
+    printf("    -w <weight> [...]   -- weights of the input files (default: equal)\n");
+    printf("    -z <policy>         -- output policy: comma-separated list of\n");
+    printf("                           deflate=<level>, shuffle=<0|1>, chunk=<layers|N>,\n");
+    printf("                           cache=<MB>, filter=<zstd|bzip2>[:<level>]\n");
+    printf("    -p                  -- read the next input file while decoding (or, with\n");
+    printf("                           \"-M\", accumulating) the current one (requires\n");
+    printf("                           OpenMP)\n");
     printf("    -f                  -- overwrite destination if exists\n");
+    printf("    -P                  -- report time and bytes spent in I/O, decoding and\n");
+    printf("                           averaging at exit (summed over all processes)\n");
     printf("    -V                  -- verbose\n");
     printf("    -v                  -- print version and exit\n");
     exit(exitstatus);
@@ -173,9 +189,63 @@ static void parse_commandline(int argc, char* argv[], int* nsrc, char*** srcs, i
             if (argv[i][1] == 'V') {
                 verbose = 1;
                 i++;
+            } else if (argv[i][1] == 'p') {
+                pipeline = 1;
+                i++;
             } else if (argv[i][1] == 'f') {
                 force = 1;
                 i++;
+            } else if (argv[i][1] == 'P') {
+                prof_enable();
+                i++;
+            } else if (argv[i][1] == 's') {
+                i++;
+                if (i >= argc || argv[i][0] == '-')
+                    quit("no statistic specified after \"-s\"\n");
+                while (i < argc && argv[i][0] != '-') {
+                    int s, ss;
+
+                    for (s = 1; s < NSTAT; ++s)
+                        if (strcmp(argv[i], statnames[s]) == 0)
+                            break;
+                    if (s == NSTAT)
+                        quit("unknown statistic \"%s\"", argv[i]);
+                    for (ss = 0; ss < nstat; ++ss)
+                        if (stats[ss] == s)
+                            break;
+                    if (ss == nstat)
+                        stats[nstat++] = s;
+                    i++;
+                }
+            } else if (argv[i][1] == 'w') {
+                i++;
+                if (i >= argc || argv[i][0] == '-')
+                    quit("no weight specified after \"-w\"\n");
+                while (i < argc && argv[i][0] != '-') {
+                    double w;
+
+                    if (!str2double(argv[i], &w))
+                        break;
+                    if (w < 0.0)
+                        quit("negative weight %s", argv[i]);
+                    if (nweight % NSRC_INC == 0)
+                        weights = realloc(weights, (nweight + NSRC_INC) * sizeof(double));
+                    weights[nweight++] = w;
+                    i++;
+                }
+            } else if (argv[i][1] == 'z') {
+                i++;
+                if (i >= argc)
+                    quit("no output policy specified after \"-z\"\n");
+                ncw_set_outpolicy(argv[i]);
+                i++;
+            } else if (argv[i][1] == 'M') {
+                i++;
+                if (i >= argc)
+                    quit("no number specified after \"-M\"\n");
+                if (!str2int(argv[i], &maxopen) || maxopen < 1)
+                    quit("could not convert \"%s\" to a positive number of files", argv[i]);
+                i++;
             } else if (argv[i][1] == 'v') {
                 i++;
                 if (i >= argc)
@@ -216,6 +286,8 @@ static void parse_commandline(int argc, char* argv[], int* nsrc, char*** srcs, i
         quit("no input specified");
     if (*nsrc == 1)
         quit("no output specified");
+    if (nweight > 0 && nweight != *nsrc - 1)
+        quit("%d weight(s) specified for %d input file(s)", nweight, *nsrc - 1);
     if (*nvar > 0 && *ncvar > 0) {
         for (i = 0; i < *nvar; ++i) {
             int j;
@@ -300,6 +372,7 @@ static void getfields(char* fname, int nvar, char** vars, int* nfield, field** f
             f = &(*fields)[*nfield];
             f->fid = *nfield;
             f->varname = vars[v];
+            f->nlayer = 1;
             if (nd < 2) {
                 f->nj = -1;
                 f->ni = -1;
@@ -313,14 +386,31 @@ static void getfields(char* fname, int nvar, char** vars, int* nfield, field** f
                 f->k = 0;
                 f->n = f->ni * f->nj;
             }
-            for (i = 0; i < ndim; ++i)
-                f->count[i] = dimlen[i];
             (*nfield)++;
         } else {
             field* f;
+            int storage;
+            size_t chunksizes[NC_MAX_VAR_DIMS];
+            int nlayer = 1;
             int k;
 
-            for (k = 0; k < dimlen[i]; ++k) {
+            /*
+             * for variables chunked by several layers each field is a slab
+             * of layers aligned with the chunks, so that each chunk is read
+             * once; the number of layers is reduced to a divisor of the chunk
+             * size (down to single layers) if the field buffers (2 input
+             * floats, 4 work doubles and nstat output floats per element)
+             * would exceed ENSBLOCK_MAX bytes
+             */
+            ncw_inq_var_chunking(ncid, varid, &storage, chunksizes);
+            if (storage == NC_CHUNKED && chunksizes[i] > 1) {
+                size_t nbytes = dimlen[i + 1] * dimlen[i + 2] * (2 * sizeof(float) + 4 * sizeof(double) + nstat * sizeof(float));
+
+                for (nlayer = (int) chunksizes[i]; nlayer > 1; --nlayer)
+                    if (chunksizes[i] % nlayer == 0 && nbytes * nlayer <= ENSBLOCK_MAX)
+                        break;
+            }
+            for (k = 0; k < dimlen[i]; k += nlayer) {
                 if (*nfield % NFIELD_INC == 0)
                     *fields = realloc(*fields, (*nfield + NFIELD_INC) * sizeof(field));
                 f = &(*fields)[*nfield];
@@ -330,14 +420,8 @@ static void getfields(char* fname, int nvar, char** vars, int* nfield, field** f
                 f->nj = dimlen[i + 1];
                 f->ni = dimlen[i + 2];
                 f->k = k;
-                f->n = f->ni * f->nj;
-                if (i == 1)
-                    f->count[0] = 1;
-                f->count[i] = dimlen[i];
-                f->start[i] = k;
-                f->count[i] = 1;
-                f->count[i + 1] = f->nj;
-                f->count[i + 2] = f->ni;
+                f->nlayer = (k + nlayer <= dimlen[i]) ? nlayer : dimlen[i] - k;
+                f->n = f->ni * f->nj * f->nlayer;
                 (*nfield)++;
             }
         }
@@ -347,18 +431,324 @@ static void getfields(char* fname, int nvar, char** vars, int* nfield, field** f
 
 /**
  */
-static void gettilename(field* f, char* dst, char** tilename)
+static void memberset_init(memberset* ms, int n, char* fnames[])
+{
+    int j;
+
+    ms->n = n;
+    ms->members = malloc(n * sizeof(member));
+    for (j = 0; j < n; ++j) {
+        ms->members[j].fname = fnames[j];
+        ms->members[j].ncid = -1;
+        ms->members[j].handle = NULL;
+        ms->members[j].handle_varname = NULL;
+    }
+    ms->nopen = 0;
+    ms->last = -1;
+    ms->nreopen = 0;
+    ms->ens = NULL;
+    ms->nblock = 0;
+    ms->block = NULL;
+}
+
+/**
+ */
+static void member_close(memberset* ms, int j)
+{
+    member* m = &ms->members[j];
+
+    if (m->ncid < 0)
+        return;
+    if (m->handle != NULL) {
+        ncu_field_close(m->handle);
+        m->handle = NULL;
+        m->handle_varname = NULL;
+    }
+    ncw_close(m->ncid);
+    m->ncid = -1;
+    ms->nopen--;
+}
+
+/** Gets descriptor of a field in a member file, opening the file if
+ ** necessary. If the number of open files reaches `maxopen' then the most
+ ** recently used file is closed: as members are read in cycle, this keeps
+ ** maxopen - 1 of them open for good (closing the least recently used file
+ ** would require reopening each file for each field).
+ */
+static ncu_field* member_getfield(memberset* ms, int j, field* f)
+{
+    member* m = &ms->members[j];
+
+    if (m->ncid < 0) {
+        if (maxopen > 0 && ms->nopen >= maxopen && ms->last >= 0 && ms->last != j)
+            member_close(ms, ms->last);
+        if (maxopen > 0 && ms->nopen >= maxopen) {
+            int jj;
+
+            for (jj = 0; jj < ms->n; ++jj)
+                if (ms->members[jj].ncid >= 0) {
+                    member_close(ms, jj);
+                    break;
+                }
+        }
+        ncw_open(m->fname, NC_NOWRITE, &m->ncid);
+        ms->nopen++;
+        ms->nreopen++;
+    }
+    ms->last = j;
+    /*
+     * fields of the same variable are consecutive, so that the descriptor
+     * only needs to be updated when the variable changes
+     */
+    if (m->handle != NULL && strcmp(m->handle_varname, f->varname) != 0) {
+        ncu_field_close(m->handle);
+        m->handle = NULL;
+    }
+    if (m->handle == NULL) {
+        m->handle = ncu_field_attach(m->ncid, f->varname, f->ni, f->nj, f->nk);
+        m->handle_varname = f->varname;
+        if (f->nk > 0)
+            ncu_field_setcache(m->handle, f->nlayer);
+    }
+
+    return m->handle;
+}
+
+/**
+ */
+static void memberset_free(memberset* ms)
 {
-    char path[MAXSTRLEN];
-    char* bname;
-    size_t len;
-
-    strncpy(path, dst, MAXSTRLEN - 1);
-    path[MAXSTRLEN - 1] = 0;
-    bname = basename(path);
-    len = strlen(tmpdirname) + strlen(bname) + strlen(f->varname) + 10 + 1;
-    *tilename = malloc(len);
-    snprintf(*tilename, len, "%s/%s-%s-%03d.tmp", tmpdirname, bname, f->varname, (f->k >= 0) ? f->k : 0);
+    int j;
+
+    for (j = 0; j < ms->n; ++j)
+        member_close(ms, j);
+    free(ms->members);
+    if (ms->ens != NULL)
+        ncu_ensemble_close(ms->ens);
+    if (ms->block != NULL)
+        free(ms->block);
+}
+
+/**
+ */
+static int cmp_fieldsize(const void* p1, const void* p2)
+{
+    field* f1 = *(field**) p1;
+    field* f2 = *(field**) p2;
+
+    if (f1->n > f2->n)
+        return -1;
+    if (f1->n < f2->n)
+        return 1;
+    return (f1->fid > f2->fid) - (f1->fid < f2->fid);
+}
+
+/** Orders the fields for handing out to processes: largest first (longest
+ ** processing time first), keeping the original order for fields of the
+ ** same size, so that layers of a variable stay together.
+ */
+static void getorder(int nfield, field fields[], int order[])
+{
+    field** ff = malloc(nfield * sizeof(field*));
+    int i;
+
+    for (i = 0; i < nfield; ++i)
+        ff[i] = &fields[i];
+    qsort(ff, nfield, sizeof(field*), cmp_fieldsize);
+    for (i = 0; i < nfield; ++i)
+        order[i] = ff[i]->fid;
+    free(ff);
+}
+
+/** Adds values of a member to the running statistics. Non-finite values
+ ** (e.g. masked points) are skipped. The weighted mean and variance are
+ ** updated with West's (weighted Welford's) algorithm in double precision.
+ ** The loops have no branches (invalid values get zero weight, and the
+ ** division by the zero sum of weights is avoided arithmetically) and are
+ ** marked for vectorisation with "omp simd" (gcc vectorises them at -O2 when
+ ** compiled with -fopenmp, or at -O3).
+ */
+static void accumulate(size_t n, float v[], double w, double mean[], double m2[], double wsum[], double count[], float vmin[], float vmax[])
+{
+    double t0 = prof_start();
+    size_t ii;
+
+#if defined(_OPENMP)
+#pragma omp simd
+#endif
+    for (ii = 0; ii < n; ++ii) {
+        double vv = v[ii];
+        double valid = (fabs(vv) <= DBL_MAX) ? 1.0 : 0.0;
+        double x = (fabs(vv) <= DBL_MAX) ? vv : 0.0;
+        double wx = (fabs(vv) <= DBL_MAX) ? w : 0.0;
+        double d = x - mean[ii];
+        double ws = wsum[ii] + wx;
+        double mm = mean[ii] + wx / (ws + (ws == 0.0)) * d;
+
+        wsum[ii] = ws;
+        count[ii] += valid;
+        mean[ii] = mm;
+        m2[ii] += wx * d * (x - mm);
+    }
+    if (vmin != NULL) {
+#if defined(_OPENMP)
+#pragma omp simd
+#endif
+        for (ii = 0; ii < n; ++ii)
+            vmin[ii] = (v[ii] < vmin[ii]) ? v[ii] : vmin[ii];
+    }
+    if (vmax != NULL) {
+#if defined(_OPENMP)
+#pragma omp simd
+#endif
+        for (ii = 0; ii < n; ++ii)
+            vmax[ii] = (v[ii] > vmax[ii]) ? v[ii] : vmax[ii];
+    }
+    prof_stop(PROF_COMPUTE, t0, n * sizeof(float));
+}
+
+/** Calculates ensemble statistics of a field in one pass over members.
+ ** Points without valid members are set to NaN. Unless the number of open
+ ** files is limited ("-M"), the field is read from all members into a single
+ ** block by the ensemble reader of ncutils (with "-p" the next member is read
+ ** while the current one is decoded), and the members are then accumulated
+ ** from the block. A slab of layers whose block would exceed ENSBLOCK_MAX
+ ** bytes is read in portions of layers. Otherwise, or if even one layer
+ ** exceeds the limit, the members are read one at a time (with "-p" the next
+ ** member is read while the current one is accumulated).
+ * @param ms - members
+ * @param f - field
+ * @param vin - work arrays [2][f->n]
+ * @param work - work array [4 * f->n]
+ * @param vout - statistics [nstat * f->n], in the order of stats[]
+ */
+static void average(memberset* ms, field* f, float* vin[2], double work[], float vout[])
+{
+    double* mean = work;
+    double* m2 = &work[f->n];
+    double* wsum = &work[2 * f->n];
+    double* count = &work[3 * f->n];
+    float* vmin = NULL;
+    float* vmax = NULL;
+    size_t nij = f->n / f->nlayer;
+    int nl = 0;
+    int ij, j, k, s;
+
+    for (s = 0; s < nstat; ++s) {
+        if (stats[s] == STAT_MIN)
+            vmin = &vout[s * f->n];
+        else if (stats[s] == STAT_MAX)
+            vmax = &vout[s * f->n];
+    }
+    memset(work, 0, 4 * f->n * sizeof(double));
+    if (vmin != NULL)
+        for (ij = 0; ij < f->n; ++ij)
+            vmin[ij] = FLT_MAX;
+    if (vmax != NULL)
+        for (ij = 0; ij < f->n; ++ij)
+            vmax[ij] = -FLT_MAX;
+
+    /*
+     * the slab is read from all members in portions of `nl' layers, so that
+     * the block does not exceed ENSBLOCK_MAX bytes
+     */
+    if (maxopen == 0 && nij > 0) {
+        nl = (int) (ENSBLOCK_MAX / (nij * ms->n * sizeof(float)));
+        if (nl > f->nlayer)
+            nl = f->nlayer;
+    }
+
+    if (nl > 0) {
+        if (ms->ens == NULL) {
+            char** fnames = malloc(ms->n * sizeof(char*));
+
+            for (j = 0; j < ms->n; ++j)
+                fnames[j] = ms->members[j].fname;
+            ms->ens = ncu_ensemble_open(ms->n, fnames, pipeline);
+            free(fnames);
+        }
+        if (ms->nblock < nij * nl * ms->n) {
+            ms->block = realloc(ms->block, nij * nl * ms->n * sizeof(float));
+            ms->nblock = nij * nl * ms->n;
+        }
+        ncu_ensemble_setvar(ms->ens, f->varname, f->ni, f->nj, f->nk);
+        for (k = 0; k < f->nlayer; k += nl) {
+            int nk = (k + nl <= f->nlayer) ? nl : f->nlayer - k;
+            size_t n = nij * nk;
+            size_t o = nij * k;
+
+            ncu_ensemble_reada(ms->ens, (f->k < 0) ? f->k : f->k + k, nk, ms->block);
+            for (j = 0; j < ms->n; ++j)
+                accumulate(n, &ms->block[j * n], (weights != NULL) ? weights[j] : 1.0, &mean[o], &m2[o], &wsum[o], &count[o], (vmin != NULL) ? &vmin[o] : NULL, (vmax != NULL) ? &vmax[o] : NULL);
+        }
+    } else {
+        /*
+         * Member j is accumulated while member j + 1 is read. (At j = -1 the
+         * first member is read.)
+         */
+        for (j = -1; j < ms->n; ++j) {
+#if defined(_OPENMP)
+#pragma omp parallel sections num_threads(2) if(pipeline)
+#endif
+            {
+#if defined(_OPENMP)
+#pragma omp section
+#endif
+                if (j + 1 < ms->n)
+                    ncu_field_reada(member_getfield(ms, j + 1, f), f->k, f->nlayer, vin[(j + 1) % 2]);
+#if defined(_OPENMP)
+#pragma omp section
+#endif
+                if (j >= 0)
+                    accumulate(f->n, vin[j % 2], (weights != NULL) ? weights[j] : 1.0, mean, m2, wsum, count, vmin, vmax);
+            }
+        }
+    }
+    for (s = 0; s < nstat; ++s) {
+        float* v = &vout[s * f->n];
+
+        if (stats[s] == STAT_MEAN)
+            for (ij = 0; ij < f->n; ++ij)
+                v[ij] = (wsum[ij] > 0.0) ? (float) mean[ij] : NAN;
+        else if (stats[s] == STAT_SD)
+            /*
+             * (for equal weights this reduces to the unbiased estimate with
+             * n - 1 in the denominator)
+             */
+            for (ij = 0; ij < f->n; ++ij)
+                v[ij] = (wsum[ij] > 0.0 && count[ij] > 1.0) ? (float) sqrt(m2[ij] / wsum[ij] * count[ij] / (count[ij] - 1.0)) : (wsum[ij] > 0.0) ? 0.0f : NAN;
+        else if (stats[s] == STAT_MIN || stats[s] == STAT_MAX)
+            for (ij = 0; ij < f->n; ++ij)
+                v[ij] = (count[ij] > 0.0) ? v[ij] : NAN;
+        else if (stats[s] == STAT_COUNT)
+            for (ij = 0; ij < f->n; ++ij)
+                v[ij] = (float) count[ij];
+    }
+}
+
+/** Writes ensemble statistics of a field to the destination. The fields can
+ ** come in any order; the descriptors are kept for each variable and
+ ** statistic.
+ */
+static void writefield(int ncid, int nvar, char* vars[], ncu_field* handles[], field* f, float v[])
+{
+    int vi, s;
+
+    for (vi = 0; vi < nvar; ++vi)
+        if (vars[vi] == f->varname)
+            break;
+    assert(vi < nvar);
+    for (s = 0; s < nstat; ++s) {
+        ncu_field** h = &handles[vi * NSTAT + stats[s]];
+
+        if (*h == NULL) {
+            char varname[NC_MAX_NAME];
+
+            snprintf(varname, NC_MAX_NAME, "%s%s", f->varname, statsuffixes[stats[s]]);
+            *h = ncu_field_attach(ncid, varname, f->ni, f->nj, f->nk);
+        }
+        ncu_field_writea(*h, f->k, f->nlayer, &v[s * f->n]);
+    }
 }
 
 /**
@@ -382,6 +772,8 @@ int main(int argc, char* argv[])
     char** cvars = NULL;
     int nfield = 0;
     field* fields = NULL;
+    char dst_tmp[MAXSTRLEN];
+    int ncid_dst = -1;
     int i;
 
     parse_commandline(argc, argv, &nsrc, &srcs, &nvar, &vars, &ncvar, &cvars);
@@ -392,7 +784,18 @@ int main(int argc, char* argv[])
         quit("destination \"%s\" exists", dst);
 
 #if defined(MPI)
+#if defined(_OPENMP)
+    {
+        int provided;
+
+        /*
+         * (only the master thread calls MPI)
+         */
+        MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    }
+#else
     MPI_Init(&argc, &argv);
+#endif
     MPI_Comm_size(MPI_COMM_WORLD, &nprocesses);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 #endif
@@ -400,6 +803,10 @@ int main(int argc, char* argv[])
         printlog("  ncave v%s\n", VERSION);
         printlog("  MPI: initialised %d process(es)\n", nprocesses);
     }
+#if !defined(_OPENMP)
+    if (pipeline)
+        printlog("  warning: %s has been compiled without OpenMP; ignoring \"-p\"\n", PROGRAM_NAME);
+#endif
 #if defined(DEBUG)
     if (verbose)
         printlog("  master PID = %3d\n", getpid());
@@ -427,6 +834,12 @@ int main(int argc, char* argv[])
             printlog(" %s", vars[i]);
         printlog("\n");
     }
+    if (nstat > 1 && verbose) {
+        printlog("  statistics:");
+        for (i = 0; i < nstat; ++i)
+            printlog(" %s", statnames[stats[i]]);
+        printlog("\n");
+    }
     if (ncvar > 0 && verbose) {
         printlog("  copying %d variable(s):", ncvar);
         for (i = 0; i < ncvar; ++i)
@@ -439,80 +852,10 @@ int main(int argc, char* argv[])
         printlog("  %d field(s)\n", nfield);
 
     /*
-     * create temporary directory for tiles
-     */
-    {
-        char path[MAXSTRLEN];
-        char* bname;
-
-        strncpy(path, dst, MAXSTRLEN - 1);
-        path[MAXSTRLEN - 1] = 0;
-        bname = basename(path);
-        if (snprintf(tmpdirname, MAXSTRLEN, ".%s.ncave.tmp", bname) < 0)
-            quit("temporary directory name too long (> 2048)");
-        if (rank == 0)
-            dir_createifabsent(tmpdirname);
-#if defined(MPI)
-        MPI_Barrier(MPI_COMM_WORLD);
-#endif
-    }
-
-    /*
-     * calculate average fields and write them to tiles
+     * create destination (rank 0)
      */
-    if (nfield > 0) {
-        distribute_iterations(0, nfield - 1, nprocesses, nprocesses, rank);
-        if (verbose)
-            printlog("  writing tiles:");
-        for (i = my_first_iteration; i <= my_last_iteration; ++i) {
-            field* f = &fields[i];
-            float* vin = malloc(f->n * sizeof(float));
-            float* vout = calloc(f->n, sizeof(float));
-            int j, ij;
-
-            for (j = 0; j < nsrc; ++j) {
-                ncu_readfield(srcs[j], f->varname, f->k, f->ni, f->nj, f->nk, vin);
-                for (ij = 0; ij < f->n; ++ij)
-                    vout[ij] += vin[ij];
-            }
-            for (ij = 0; ij < f->n; ++ij)
-                vout[ij] /= (float) nsrc;
-
-            {
-                char* tilename = NULL;
-                int ncid, dimid, varid;
-
-                gettilename(f, dst, &tilename);
-                ncw_create(tilename, NC_NOWRITE, &ncid);
-                ncw_def_dim(ncid, "n", f->n, &dimid);
-                ncw_def_var(ncid, f->varname, NC_FLOAT, 1, &dimid, &varid);
-                ncw_enddef(ncid);
-                ncw_put_var_float(ncid, varid, vout);
-                ncw_close(ncid);
-                if (verbose > 0) {
-                    printf(".");
-                    fflush(stdout);
-                }
-                free(tilename);
-            }
-            free(vin);
-            free(vout);
-        }
-#if defined(MPI)
-        MPI_Barrier(MPI_COMM_WORLD);
-#endif
-        if (verbose)
-            printlog("\n");
-    }
-
-    /*
-     * assemble tiles
-     */
-    if (verbose)
-        printlog("  assembling:");
     if (rank == 0) {
-        char dst_tmp[MAXSTRLEN];
-        int ncid_src, ncid_dst;
+        int ncid_src, s;
 
         /*
          * set the temporary destination
@@ -532,6 +875,26 @@ int main(int argc, char* argv[])
 
             ncw_inq_varid(ncid_src, vars[i], &varid_src);
             ncw_copy_vardef(ncid_src, varid_src, ncid_dst);
+            for (s = 1; s < nstat; ++s) {
+                char varname[NC_MAX_NAME];
+                int varid_dst;
+
+                snprintf(varname, NC_MAX_NAME, "%s%s", vars[i], statsuffixes[stats[s]]);
+                if (ncw_var_exists(ncid_dst, varname))
+                    quit("%s: can not write %s of \"%s\": variable \"%s\" already defined", dst, statnames[stats[s]], vars[i], varname);
+                if (stats[s] == STAT_COUNT) {
+                    int varid, ndims;
+                    int dimids[NC_MAX_DIMS];
+
+                    ncw_inq_varid(ncid_dst, vars[i], &varid);
+                    ncw_inq_var(ncid_dst, varid, NULL, NULL, &ndims, dimids, NULL);
+                    ncw_def_var(ncid_dst, varname, NC_SHORT, ndims, dimids, &varid_dst);
+                } else {
+                    ncw_def_var_as(ncid_dst, vars[i], varname);
+                    ncw_inq_varid(ncid_dst, varname, &varid_dst);
+                }
+                ncw_put_att_text(ncid_dst, varid_dst, "ensemble_statistic", statdescs[stats[s]]);
+            }
         }
         for (i = 0; i < ncvar; ++i) {
             int varid_src;
@@ -552,6 +915,7 @@ int main(int argc, char* argv[])
                 ncw_put_att_text(ncid_dst, NC_GLOBAL, attname, cwd);
             }
         }
+        ncw_def_outpolicy(ncid_dst);
         ncw_enddef(ncid_dst);
 
         for (i = 0; i < ncvar; ++i) {
@@ -562,32 +926,171 @@ int main(int argc, char* argv[])
         }
 
         ncw_close(ncid_src);
-        ncw_close(ncid_dst);
+    }
 
-        for (i = 0; i < nfield; ++i) {
-            field* f = &fields[i];
-            float* v = malloc(f->n * sizeof(float));
-            char* tilename = NULL;
-            int ncid_tile;
+    /*
+     * Calculate average fields. With MPI, rank 0 hands out the fields to the
+     * other processes one at a time, largest first, and writes them to the
+     * destination as they are received.
+     */
+    if (nfield > 0) {
+        memberset ms;
+        ncu_field** handles = NULL;
+        int* order = malloc(nfield * sizeof(int));
+        float* vin[2] = { NULL, NULL };
+        double* work = NULL;
+        float* vout = NULL;
+        size_t nmax = 0;
+        int nfield_done = 0;
+        double time_start = get_walltime();
+        double time_busy = 0.0;
 
-            gettilename(f, dst, &tilename);
-            ncw_open(tilename, NC_NOWRITE, &ncid_tile);
-            ncw_get_var_float(ncid_tile, 0, v);
-            ncw_close(ncid_tile);
+        if (verbose)
+            printlog("  averaging:");
+        memberset_init(&ms, nsrc, srcs);
+        /*
+         * the buffers are shared by all fields
+         */
+        for (i = 0; i < nfield; ++i)
+            if (fields[i].n > nmax)
+                nmax = fields[i].n;
+#if defined(MPI)
+        if (nprocesses > 1 && nmax * nstat > INT_MAX)
+            quit("a field with %zu elements is too large to be sent by MPI", nmax);
+#endif
+        vin[0] = malloc(nmax * sizeof(float));
+        vin[1] = malloc(nmax * sizeof(float));
+        work = malloc(nmax * 4 * sizeof(double));
+        vout = malloc(nmax * nstat * sizeof(float));
+        if (rank == 0)
+            handles = calloc(nvar * NSTAT, sizeof(ncu_field*));
 
-            ncu_writefield(dst_tmp, f->varname, f->k, f->ni, f->nj, f->nk, v);
-            if (verbose)
-                printlog(".");
+        if (nprocesses == 1)
+            for (i = 0; i < nfield; ++i)
+                order[i] = i;
+        else
+            getorder(nfield, fields, order);
+
+        if (nprocesses == 1) {
+            for (i = 0; i < nfield; ++i) {
+                double t0 = get_walltime();
+
+                average(&ms, &fields[i], vin, work, vout);
+                writefield(ncid_dst, nvar, vars, handles, &fields[i], vout);
+                time_busy += get_walltime() - t0;
+                nfield_done++;
+                if (verbose)
+                    printlog(".");
+            }
+        }
+#if defined(MPI)
+        else if (rank == 0) {
+            int* assigned = malloc(nprocesses * sizeof(int));
+            int next = 0, nactive = 0;
+            int p;
+
+            for (p = 1; p < nprocesses; ++p) {
+                assigned[p] = (next < nfield) ? order[next++] : -1;
+                MPI_Send(&assigned[p], 1, MPI_INT, p, TAG_TASK, MPI_COMM_WORLD);
+                if (assigned[p] >= 0)
+                    nactive++;
+            }
+            while (nactive > 0) {
+                MPI_Status status;
+                field* f;
+                double t0;
+
+                MPI_Probe(MPI_ANY_SOURCE, TAG_DATA, MPI_COMM_WORLD, &status);
+                p = status.MPI_SOURCE;
+                f = &fields[assigned[p]];
+                MPI_Recv(vout, f->n * nstat, MPI_FLOAT, p, TAG_DATA, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                /*
+                 * give the next field before writing this one
+                 */
+                assigned[p] = (next < nfield) ? order[next++] : -1;
+                MPI_Send(&assigned[p], 1, MPI_INT, p, TAG_TASK, MPI_COMM_WORLD);
+                if (assigned[p] < 0)
+                    nactive--;
+                t0 = get_walltime();
+                writefield(ncid_dst, nvar, vars, handles, f, vout);
+                time_busy += get_walltime() - t0;
+                nfield_done++;
+                if (verbose)
+                    printlog(".");
+            }
+            free(assigned);
+        } else {
+            while (1) {
+                int fid;
+                double t0;
+
+                MPI_Recv(&fid, 1, MPI_INT, 0, TAG_TASK, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                if (fid < 0)
+                    break;
+                t0 = get_walltime();
+                average(&ms, &fields[fid], vin, work, vout);
+                time_busy += get_walltime() - t0;
+                nfield_done++;
+                MPI_Send(vout, fields[fid].n * nstat, MPI_FLOAT, 0, TAG_DATA, MPI_COMM_WORLD);
+            }
+        }
+#endif
+        if (verbose)
+            printlog("\n");
 
-            free(v);
-            free(tilename);
+        /*
+         * timing summary
+         */
+        if (verbose) {
+            double mytiming[3] = { (double) nfield_done, time_busy, get_walltime() - time_start };
+            double* timing = NULL;
+
+            if (rank == 0)
+                timing = malloc(nprocesses * 3 * sizeof(double));
+#if defined(MPI)
+            MPI_Gather(mytiming, 3, MPI_DOUBLE, timing, 3, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+#else
+            memcpy(timing, mytiming, 3 * sizeof(double));
+#endif
+            if (rank == 0) {
+                double busy_max = 0.0, busy_sum = 0.0;
+                int p;
+
+                printlog("  timing (%s):\n", (nprocesses == 1) ? "averaging and writing" : "rank 0 writing, other ranks averaging");
+                printlog("    rank  #fields  busy (s)  total (s)\n");
+                for (p = 0; p < nprocesses; ++p) {
+                    printlog("    %4d  %7d  %8.2f  %9.2f\n", p, (int) timing[p * 3], timing[p * 3 + 1], timing[p * 3 + 2]);
+                    if (p > 0 || nprocesses == 1) {
+                        busy_sum += timing[p * 3 + 1];
+                        if (timing[p * 3 + 1] > busy_max)
+                            busy_max = timing[p * 3 + 1];
+                    }
+                }
+                if (nprocesses > 1 && busy_sum > 0.0)
+                    printlog("    imbalance (max / mean busy time of averaging ranks) = %.2f\n", busy_max * (double) (nprocesses - 1) / busy_sum);
+                free(timing);
+            }
+        }
+        if (verbose && maxopen > 0 && ms.nreopen > nsrc)
+            printf("  rank %d: %d file opening(s)\n", rank, ms.nreopen);
+
+        if (handles != NULL) {
+            for (i = 0; i < nvar * NSTAT; ++i)
+                if (handles[i] != NULL)
+                    ncu_field_close(handles[i]);
+            free(handles);
         }
+        memberset_free(&ms);
+        free(order);
+        free(vin[0]);
+        free(vin[1]);
+        free(work);
+        free(vout);
+    }
 
+    if (rank == 0) {
+        ncw_close(ncid_dst);
         file_rename(dst_tmp, dst);
-        dir_rmallifexists(tmpdirname);
-
-        if (verbose)
-            printlog("\n");
     }
 
     /*
@@ -599,11 +1102,14 @@ int main(int argc, char* argv[])
     for (i = 0; i < nsrc; ++i)
         free(srcs[i]);
     free(srcs);
+    if (weights != NULL)
+        free(weights);
     if (nvar > 0) {
         for (i = 0; i < nvar; ++i)
             free(vars[i]);
         free(vars);
     }
+    prof_report();
 #if defined(MPI)
     MPI_Barrier(MPI_COMM_WORLD);
 #endif
@@ -21,25 +21,51 @@
 #include <assert.h>
 #include "ncw.h"
 #include "utils.h"
+#include "profile.h"
 #include "version.h"
 
 #define PROGRAM_NAME "nccat"
-#define PROGRAM_VERSION "0.00"
+#define PROGRAM_VERSION "0.06"
 
 #define NINC 10
 #define VERBOSE 0
+#define MAXSIZE_DEF 268435456   /* 256 MiB */
+
+/** Destination variable layout, worked out in the define pass and used in
+ ** the copy pass.
+ */
+typedef struct {
+    char* name;
+    int ndim;
+    size_t** dimlens_src;       /* [nsrc][ndim] */
+    int did_merge;              /* -1 if the variable is just copied */
+    int varid_dst;
+    size_t typesize;
+    char* tunits0;              /* time units of the first source if the
+                                 * variable is time being merged; NULL
+                                 * otherwise */
+    size_t* chunksizes;         /* [ndim]; NULL if contiguous */
+} catvar;
 
 /**
  */
 static void usage(int status)
 {
-    printf("  Usage: nccat [-v <var> [...]] [-d <dim> [...]] -i <src> [...] -o <dst> [-V <level>] \n");
+    printf("  Usage: nccat [-v <var> [...]] [-d <dim> [...]] -i <src> [...] -o <dst> [-a] [-M <size>] [-z <policy>] [-P] [-V <level>] \n");
     printf("         nccat -v\n");
     printf("  Options:\n");
     printf("    -v <var> [...] - variables to be concatenated (default: all)\n");
     printf("    -d <dim> [...] - dimensions to concatenate (default: those of different length)\n");
     printf("    -i <src> [...] - source files\n");
     printf("    -o <dst>       - destination file\n");
+    printf("    -a             - append records of the sources to existing destination\n");
+    printf("                     along its unlimited dimension\n");
+    printf("    -M <size>      - maximal size of the data buffer in bytes (default: %d);\n", MAXSIZE_DEF);
+    printf("                     the variables are copied by slabs of up to this size\n");
+    printf("    -z <policy>    - output policy: comma-separated list of deflate=<level>,\n");
+    printf("                     shuffle=<0|1>, chunk=<layers|N>, cache=<MB>,\n");
+    printf("                     filter=<zstd|bzip2>[:<level>]\n");
+    printf("    -P             - report time and bytes spent in I/O at exit\n");
     printf("    -V <level>     - verbosity level (0 to 2)\n");
     printf("    -v             - print version and exit\n");
     exit(status);
@@ -47,7 +73,7 @@ static void usage(int status)
 
 /**
  */
-static void parse_commandline(int argc, char* argv[], int* nvar, char*** vars, int* ndim, char*** dims, int* nsrc, char*** srcs, char** dst, int* verbose)
+static void parse_commandline(int argc, char* argv[], int* nvar, char*** vars, int* ndim, char*** dims, int* nsrc, char*** srcs, char** dst, int* append, size_t* maxsize, int* verbose)
 {
     int i;
 
@@ -95,6 +121,26 @@ static void parse_commandline(int argc, char* argv[], int* nvar, char*** vars, i
             i++;
             *dst = argv[i];
             i++;
+        } else if (argv[i][1] == 'a') {
+            *append = 1;
+            i++;
+        } else if (argv[i][1] == 'P') {
+            prof_enable();
+            i++;
+        } else if (argv[i][1] == 'M') {
+            double size;
+
+            i++;
+            if (i == argc || !str2double(argv[i], &size) || size < 1.0)
+                quit("could not convert \"%s\" to a positive buffer size", (i < argc) ? argv[i] : "");
+            *maxsize = (size_t) size;
+            i++;
+        } else if (argv[i][1] == 'z') {
+            i++;
+            if (i == argc)
+                quit("no output policy specified after \"-z\"");
+            ncw_set_outpolicy(argv[i]);
+            i++;
         } else if (argv[i][1] == 'V') {
             i++;
             if (!str2int(argv[i], verbose))
@@ -106,10 +152,12 @@ static void parse_commandline(int argc, char* argv[], int* nvar, char*** vars, i
 
     if (*nsrc == 0)
         quit("no input files specified");
-    if (*nsrc == 1)
+    if (*nsrc == 1 && !*append)
         quit("only one input file specified; nothing to do");
     if (*dst == NULL)
         quit("no output file specified");
+    if (*append && *ndim > 0)
+        quit("\"-d\" can not be used with \"-a\": the records are appended along the unlimited dimension");
 }
 
 /**
@@ -151,6 +199,186 @@ static void adjusttime(char* tunits0, int ncid, int varid, size_t vlen, void* v)
         quit("time variable can not be adjusted for data types other than NC_FLOAT or NC_DOUBLE");
 }
 
+/** Copies a variable from source to destination by slabs of at most
+ ** `maxsize' bytes (or one element, if larger). The slabs are split along the
+ ** outermost dimension(s) possible. If the destination is chunked, the slabs
+ ** along the split dimension end at the destination chunk boundaries where
+ ** possible, so that each chunk is written (and compressed) once.
+ * @param ncid_src - source file
+ * @param varid_src - source variable
+ * @param ncid_dst - destination file
+ * @param varid_dst - destination variable
+ * @param ndim - number of dimensions
+ * @param dimlen - dimensions of the source variable
+ * @param did_merge - dimension to merge (-1 if none)
+ * @param offset - offset of the source data in the merged dimension
+ * @param typesize - size of the variable type
+ * @param maxsize - maximal slab size in bytes
+ * @param tunits0 - units of time to convert to (NULL if not involved)
+ * @param chunksizes - chunk sizes of the destination variable (NULL if
+ *                     contiguous)
+ * @param buf - buffer of size maxsize or more
+ */
+static void copy_slabs(int ncid_src, int varid_src, int ncid_dst, int varid_dst, int ndim, size_t dimlen[], int did_merge, size_t offset, size_t typesize, size_t maxsize, char* tunits0, size_t chunksizes[], void* buf)
+{
+    size_t start[NC_MAX_DIMS], count[NC_MAX_DIMS], start_dst[NC_MAX_DIMS];
+    size_t rowlen = 1, nmax;
+    int s, i;
+
+    if (ndim == 0) {
+        ncw_get_var(ncid_src, varid_src, buf);
+        ncw_put_var(ncid_dst, varid_dst, buf);
+        return;
+    }
+    for (i = 0; i < ndim; ++i)
+        if (dimlen[i] == 0)
+            return;
+
+    /*
+     * the slab consists of (up to nmax) "rows" of the split dimension s
+     */
+    s = ndim - 1;
+    while (s > 0 && rowlen * dimlen[s] * typesize <= maxsize) {
+        rowlen *= dimlen[s];
+        s--;
+    }
+    nmax = maxsize / (rowlen * typesize);
+    if (nmax < 1)
+        nmax = 1;
+    for (i = 0; i < ndim; ++i) {
+        start[i] = 0;
+        count[i] = (i < s) ? 1 : dimlen[i];
+    }
+
+    while (1) {
+        count[s] = (start[s] + nmax <= dimlen[s]) ? nmax : dimlen[s] - start[s];
+        if (chunksizes != NULL && start[s] + count[s] < dimlen[s]) {
+            size_t end = start[s] + count[s] + ((s == did_merge) ? offset : 0);
+            size_t rem = end % chunksizes[s];
+
+            if (rem < count[s])
+                count[s] -= rem;
+        }
+        ncw_get_vara(ncid_src, varid_src, start, count, buf);
+        if (tunits0 != NULL)
+            adjusttime(tunits0, ncid_src, varid_src, rowlen * count[s], buf);
+        for (i = 0; i < ndim; ++i)
+            start_dst[i] = start[i];
+        if (did_merge >= 0)
+            start_dst[did_merge] += offset;
+        ncw_put_vara(ncid_dst, varid_dst, start_dst, count, buf);
+
+        start[s] += count[s];
+        if (start[s] < dimlen[s])
+            continue;
+        start[s] = 0;
+        for (i = s - 1; i >= 0; --i) {
+            start[i]++;
+            if (start[i] < dimlen[i])
+                break;
+            start[i] = 0;
+        }
+        if (i < 0)
+            break;
+    }
+}
+
+/** Appends records of variables in the sources to an existing destination
+ ** along its unlimited dimension. The other dimensions of the appended
+ ** variables must match those of the destination; variables with no unlimited
+ ** dimension are only checked for consistency.
+ */
+static void append_vars(int nvar, char** vars, int nsrc, int* ncids_src, int ncid_dst, size_t maxsize, int verbose)
+{
+    int* varids_src = malloc(nsrc * sizeof(int));
+    size_t bufsize = maxsize;
+    void* buf = malloc(bufsize);
+    int unlimdimid;
+    size_t offset0;
+    int vid, sid;
+
+    ncw_inq_unlimdim(ncid_dst, &unlimdimid);
+    if (unlimdimid < 0)
+        quit("%s: no unlimited dimension to append along", ncw_get_path(ncid_dst));
+    ncw_inq_dimlen(ncid_dst, unlimdimid, &offset0);
+    if (verbose > 1) {
+        char dimname[NC_MAX_NAME];
+
+        ncw_inq_dimname(ncid_dst, unlimdimid, dimname);
+        printf("    appending along \"%s\" from record %zu\n", dimname, offset0);
+    }
+
+    for (vid = 0; vid < nvar; ++vid) {
+        int varid_dst, ndim, did, did_merge;
+        int dimids_dst[NC_MAX_DIMS];
+        size_t dimlen[NC_MAX_DIMS];
+        size_t chunksizes[NC_MAX_DIMS];
+        char tunits0[MAXSTRLEN];
+        int storage, istime;
+        nc_type nctype;
+        size_t typesize, offset;
+
+        if (!ncw_var_exists(ncid_dst, vars[vid]))
+            quit("%s: no variable \"%s\" to append to", ncw_get_path(ncid_dst), vars[vid]);
+        ncw_inq_varid(ncid_dst, vars[vid], &varid_dst);
+        ncw_inq_varndims(ncid_dst, varid_dst, &ndim);
+        ncw_inq_vardimid(ncid_dst, varid_dst, dimids_dst);
+        for (did = 0, did_merge = -1; did < ndim; ++did)
+            if (dimids_dst[did] == unlimdimid)
+                did_merge = did;
+
+        /*
+         * check the other dimensions
+         */
+        for (sid = 0; sid < nsrc; ++sid) {
+            ncw_inq_varid(ncids_src[sid], vars[vid], &varids_src[sid]);
+            ncw_check_varndims(ncids_src[sid], varids_src[sid], ndim);
+            ncw_inq_vardims(ncids_src[sid], varids_src[sid], ndim, NULL, dimlen);
+            for (did = 0; did < ndim; ++did) {
+                char dimname[NC_MAX_NAME];
+
+                if (did == did_merge)
+                    continue;
+                ncw_inq_dimname(ncid_dst, dimids_dst[did], dimname);
+                ncw_check_dimlen(ncid_dst, dimname, dimlen[did]);
+            }
+        }
+
+        if (verbose > 0)
+            printf("  %s%s - %s\n", (verbose > 1) ? "  " : "", vars[vid], (did_merge >= 0) ? "appended" : "not a record variable, skipped");
+        if (did_merge < 0)
+            continue;
+
+        ncw_inq_vartype(ncid_dst, varid_dst, &nctype);
+        typesize = ncw_sizeof(nctype);
+        if (typesize > bufsize) {
+            bufsize = typesize;
+            buf = realloc(buf, bufsize);
+        }
+        ncw_inq_var_chunking(ncid_dst, varid_dst, &storage, chunksizes);
+        istime = varistime(ncid_dst, varid_dst);
+        if (istime) {
+            size_t attlen;
+
+            ncw_inq_attlen(ncid_dst, varid_dst, "units", &attlen);
+            assert(attlen < MAXSTRLEN);
+            memset(tunits0, 0, MAXSTRLEN);
+            ncw_get_att_text(ncid_dst, varid_dst, "units", tunits0);
+        }
+
+        for (sid = 0, offset = offset0; sid < nsrc; ++sid) {
+            int adjust = (istime && time_units_changed(tunits0, ncids_src[sid], varids_src[sid]));
+
+            ncw_inq_vardims(ncids_src[sid], varids_src[sid], ndim, NULL, dimlen);
+            copy_slabs(ncids_src[sid], varids_src[sid], ncid_dst, varid_dst, ndim, dimlen, did_merge, offset, typesize, maxsize, (adjust) ? tunits0 : NULL, (storage == NC_CHUNKED) ? chunksizes : NULL, buf);
+            offset += dimlen[did_merge];
+        }
+    }
+
+    free(buf);
+    free(varids_src);
+}
+
 /**
  */
 int main(int argc, char** argv)
@@ -162,7 +390,14 @@ int main(int argc, char** argv)
     int nsrc = 0;
     char** srcs = NULL;
     char* dst = NULL;
+    int append = 0;
+    size_t maxsize = MAXSIZE_DEF;
     int verbose = VERBOSE;
+    catvar* catvars = NULL;
+    int unlimdimid_src, unlimdimid_dst = -1;
+    size_t unlimlen_dst = 0;
+    size_t bufsize;
+    void* buf = NULL;
 
     int* ncids_src = NULL;
     int* varids_src = NULL;
@@ -172,7 +407,7 @@ int main(int argc, char** argv)
     int ncid_dst;
     int i;
 
-    parse_commandline(argc, argv, &nvar, &vars, &ndim_force, &dims_force, &nsrc, &srcs, &dst, &verbose);
+    parse_commandline(argc, argv, &nvar, &vars, &ndim_force, &dims_force, &nsrc, &srcs, &dst, &append, &maxsize, &verbose);
 
     if (verbose > 1) {
         printf("  %s v%s\n", PROGRAM_NAME, PROGRAM_VERSION);
@@ -199,6 +434,17 @@ int main(int argc, char** argv)
         }
     }
 
+    if (append) {
+        if (!file_exists(dst))
+            quit("%s: no such file to append to", dst);
+        ncw_open(dst, NC_WRITE, &ncid_dst);
+        append_vars(nvar, vars, nsrc, ncids_src, ncid_dst, maxsize, verbose);
+        ncw_close(ncid_dst);
+        for (vid = 0; vid < nvar; ++vid)
+            free(vars[vid]);
+        goto finish;
+    }
+
     tmpdst = malloc(strlen(dst) + 32);
     snprintf(tmpdst, strlen(dst) + 32, "%s.pid%zu.nccat.tmp", dst, (size_t) getpid());
     ncw_create(tmpdst, NC_CLOBBER | NC_NETCDF4, &ncid_dst);
@@ -217,46 +463,40 @@ int main(int argc, char** argv)
     }
 
     /*
-     * main cycle
+     * main cycle (1): define all variables in a single define mode pass
      */
     varids_src = malloc(nsrc * sizeof(int));
+    bufsize = maxsize;
+    ncw_inq_unlimdim(ncids_src[0], &unlimdimid_src);
+    catvars = calloc(nvar, sizeof(catvar));
     for (vid = 0; vid < nvar; ++vid) {
-        int ndim;
-        size_t** dimlens_src = NULL;
+        catvar* v = &catvars[vid];
         size_t dimlens_dst[NC_MAX_DIMS];
         int dimids_src[NC_MAX_DIMS];
         int dimids_dst[NC_MAX_DIMS];
         nc_type nctype;
-        int varid_dst;
-        int did_merge;
         int did;
-        void* v_dst = NULL;
-        void** v_src = NULL;
-        size_t typesize, vlen_dst, slicesize;
-        size_t offset_dst;
-        size_t* offsets_src = NULL;
-        int istime = 0;
-        char tunits0[MAXSTRLEN];
-        int i, ni;
+        int i;
 
+        v->name = vars[vid];
         for (sid = 0; sid < nsrc; ++sid) {
             ncw_inq_varid(ncids_src[sid], vars[vid], &varids_src[sid]);
             if (sid == 0)
-                ncw_inq_varndims(ncids_src[sid], varids_src[sid], &ndim);
+                ncw_inq_varndims(ncids_src[sid], varids_src[sid], &v->ndim);
             else
-                ncw_check_varndims(ncids_src[sid], varids_src[sid], ndim);
+                ncw_check_varndims(ncids_src[sid], varids_src[sid], v->ndim);
         }
 
-        dimlens_src = alloc2d(nsrc, ndim, sizeof(size_t));
+        v->dimlens_src = alloc2d(nsrc, (v->ndim > 0) ? v->ndim : 1, sizeof(size_t));
         for (sid = 0; sid < nsrc; ++sid)
-            ncw_inq_vardims(ncids_src[sid], varids_src[sid], ndim, NULL, dimlens_src[sid]);
-        did_merge = -1;
-        for (did = 0; did < ndim; ++did) {
+            ncw_inq_vardims(ncids_src[sid], varids_src[sid], v->ndim, NULL, v->dimlens_src[sid]);
+        v->did_merge = -1;
+        for (did = 0; did < v->ndim; ++did) {
             for (sid = 1; sid < nsrc; ++sid) {
-                if (dimlens_src[sid][did] != dimlens_src[0][did]) {
-                    if (did_merge < 0)
-                        did_merge = did;
-                    else if (did != did_merge)
+                if (v->dimlens_src[sid][did] != v->dimlens_src[0][did]) {
+                    if (v->did_merge < 0)
+                        v->did_merge = did;
+                    else if (did != v->did_merge)
                         quit("can not concatenate variable \"%s\": dimension sizes in source files are different for more than one dimension", vars[vid]);
                 }
             }
@@ -267,15 +507,15 @@ int main(int argc, char** argv)
             int dimid_force;
 
             ncw_inq_dimid(ncids_src[0], dims_force[i], &dimid_force);
-            for (did = 0; did < ndim; ++did) {
+            for (did = 0; did < v->ndim; ++did) {
                 if (dimid_force == dimids_src[did]) {
-                    if (did_merge < 0)
-                        did_merge = did;
+                    if (v->did_merge < 0)
+                        v->did_merge = did;
                     else {
-                        if (did != did_merge) {
+                        if (did != v->did_merge) {
                             char dimname[NC_MAX_NAME];
 
-                            ncw_inq_dimname(ncids_src[0], dimids_src[did_merge], dimname);
+                            ncw_inq_dimname(ncids_src[0], dimids_src[v->did_merge], dimname);
                             quit("can not merge variable \"%s\" on more than one dimension (\"%s\" and \"%s\")", dims_force[i], dimname);
                         }
                     }
@@ -286,38 +526,49 @@ int main(int argc, char** argv)
         /*
          * set dimensions
          */
-        for (did = 0; did < ndim; ++did)
-            dimlens_dst[did] = dimlens_src[0][did];
-        if (did_merge >= 0)
+        for (did = 0; did < v->ndim; ++did)
+            dimlens_dst[did] = v->dimlens_src[0][did];
+        if (v->did_merge >= 0)
             for (sid = 1; sid < nsrc; ++sid)
-                dimlens_dst[did_merge] += dimlens_src[sid][did_merge];
-        for (did = 0; did < ndim; ++did) {
+                dimlens_dst[v->did_merge] += v->dimlens_src[sid][v->did_merge];
+        for (did = 0; did < v->ndim; ++did) {
             char dimname[NC_MAX_NAME];
 
             ncw_inq_dimname(ncids_src[0], dimids_src[did], dimname);
             if (ncw_dim_exists(ncid_dst, dimname)) {
-                ncw_check_dimlen(ncid_dst, dimname, dimlens_dst[did]);
                 ncw_inq_dimid(ncid_dst, dimname, &dimids_dst[did]);
+                if (dimids_dst[did] != unlimdimid_dst)
+                    ncw_check_dimlen(ncid_dst, dimname, dimlens_dst[did]);
+                else if (dimlens_dst[did] != unlimlen_dst)
+                    quit("\"%s\": unlimited dimension \"%s\" is supposed to have length %zu; the actual length is %zu", vars[vid], dimname, unlimlen_dst, dimlens_dst[did]);
+            } else if (dimids_src[did] == unlimdimid_src && unlimdimid_dst < 0) {
+                /*
+                 * keep the record dimension unlimited so that the
+                 * destination can be appended to with "-a"
+                 */
+                ncw_def_dim(ncid_dst, dimname, NC_UNLIMITED, &dimids_dst[did]);
+                unlimdimid_dst = dimids_dst[did];
+                unlimlen_dst = dimlens_dst[did];
             } else
                 ncw_def_dim(ncid_dst, dimname, dimlens_dst[did], &dimids_dst[did]);
         }
 
         if (verbose > 0) {
             printf("  %s%s", (verbose > 1) ? "  " : "", vars[vid]);
-            for (did = 0; did < ndim; ++did) {
+            for (did = 0; did < v->ndim; ++did) {
                 char dimname[NC_MAX_NAME];
 
                 ncw_inq_dimname(ncids_src[0], dimids_src[did], dimname);
-                printf("%s%s%s", (did == 0) ? "(" : ", ", dimname, (did == ndim - 1) ? ")" : "");
+                printf("%s%s%s", (did == 0) ? "(" : ", ", dimname, (did == v->ndim - 1) ? ")" : "");
             }
-            if (did_merge >= 0) {
+            if (v->did_merge >= 0) {
                 char dimname[NC_MAX_NAME];
 
-                ncw_inq_dimname(ncids_src[0], dimids_src[did_merge], dimname);
+                ncw_inq_dimname(ncids_src[0], dimids_src[v->did_merge], dimname);
                 printf(" - merged by \"%s\"", dimname);
                 if (verbose > 1) {
                     for (sid = 0; sid < nsrc; ++sid)
-                        printf("%s%zu%s", (sid == 0) ? " (" : " + ", dimlens_src[sid][did_merge], (sid == nsrc - 1) ? ")" : "");
+                        printf("%s%zu%s", (sid == 0) ? " (" : " + ", v->dimlens_src[sid][v->did_merge], (sid == nsrc - 1) ? ")" : "");
                 }
                 printf("\n");
             } else
@@ -325,105 +576,106 @@ int main(int argc, char** argv)
         }
 
         /*
-         * (1) copy variable definition
+         * copy variable definition
          */
         ncw_inq_vartype(ncids_src[0], varids_src[0], &nctype);
-        ncw_def_var(ncid_dst, vars[vid], nctype, ndim, dimids_dst, &varid_dst);
-        ncw_copy_atts(ncids_src[0], varids_src[0], ncid_dst, varid_dst);
-        ncw_enddef(ncid_dst);
+        ncw_def_var(ncid_dst, vars[vid], nctype, v->ndim, dimids_dst, &v->varid_dst);
+        ncw_copy_atts(ncids_src[0], varids_src[0], ncid_dst, v->varid_dst);
 
         /*
-         * (2) copy variable data
+         * keep the chunking and compression of the first source
          */
-        typesize = ncw_sizeof(nctype);
-        vlen_dst = dimlens_dst[0];
-        for (did = 1; did < ndim; ++did)
-            vlen_dst *= dimlens_dst[did];
-
-        v_dst = malloc(vlen_dst * typesize);
-        /*
-         * check if merging is needed for this variable
-         */
-        if (did_merge < 0) {
-            /*
-             * no merging  -- just copy the data from the first source
-             */
-            ncw_get_var(ncids_src[0], varids_src[0], v_dst);
-            ncw_put_var(ncid_dst, varid_dst, v_dst);
-            ncw_redef(ncid_dst);
-
-            goto nextvar;
+        if (v->ndim > 0) {
+            size_t chunksizes[NC_MAX_DIMS];
+            int storage;
+
+            ncw_inq_var_chunking(ncids_src[0], varids_src[0], &storage, chunksizes);
+            if (storage == NC_CHUNKED) {
+                int shuffle, deflate, deflate_level;
+
+                /*
+                 * (chunks of unlimited source dimensions may exceed their
+                 * length)
+                 */
+                for (did = 0; did < v->ndim; ++did)
+                    if (chunksizes[did] > dimlens_dst[did])
+                        chunksizes[did] = (dimlens_dst[did] > 0) ? dimlens_dst[did] : 1;
+                ncw_def_var_chunking(ncid_dst, v->varid_dst, NC_CHUNKED, chunksizes);
+                ncw_inq_var_deflate(ncids_src[0], varids_src[0], &shuffle, &deflate, &deflate_level);
+                if (deflate || shuffle)
+                    ncw_def_var_deflate(ncid_dst, v->varid_dst, shuffle, deflate, deflate_level);
+                v->chunksizes = malloc(v->ndim * sizeof(size_t));
+                memcpy(v->chunksizes, chunksizes, v->ndim * sizeof(size_t));
+            }
         }
+        v->typesize = ncw_sizeof(nctype);
+        if (v->typesize > bufsize)
+            bufsize = v->typesize;
 
-        istime = varistime(ncids_src[0], vid);
-        if (istime) {
+        if (v->did_merge >= 0 && varistime(ncids_src[0], varids_src[0])) {
             size_t attlen;
 
             ncw_inq_attlen(ncids_src[0], varids_src[0], "units", &attlen);
             assert(attlen < MAXSTRLEN);
-            ncw_get_att_text(ncids_src[0], varids_src[0], "units", tunits0);
+            v->tunits0 = calloc(attlen + 1, 1);
+            ncw_get_att_text(ncids_src[0], varids_src[0], "units", v->tunits0);
         }
+    }
+    ncw_def_outpolicy(ncid_dst);
+    ncw_enddef(ncid_dst);
 
-        /*
-         * read data
-         */
-        v_src = malloc(nsrc * sizeof(void*));
-        for (sid = 0; sid < nsrc; ++sid) {
-            size_t vlen_src = vlen_dst / dimlens_dst[did_merge] * dimlens_src[sid][did_merge];
+    /*
+     * main cycle (2): copy variable data
+     */
+    if (verbose > 1)
+        printf("  copying:\n");
+    buf = malloc(bufsize);
+    for (vid = 0; vid < nvar; ++vid) {
+        catvar* v = &catvars[vid];
+        size_t offset_dst;
 
-            v_src[sid] = malloc(vlen_src * typesize);
-            ncw_get_var(ncids_src[sid], varids_src[sid], v_src[sid]);
-            if (sid > 0 && istime && time_units_changed(tunits0, ncids_src[sid], varids_src[sid]))
-                adjusttime(tunits0, ncids_src[sid], varids_src[sid], vlen_src, v_src[sid]);
+        if (verbose > 1) {
+            printf("    %s", v->name);
+            fflush(stdout);
         }
+        for (sid = 0; sid < nsrc; ++sid)
+            ncw_inq_varid(ncids_src[sid], v->name, &varids_src[sid]);
 
-        slicesize = 1;
-        for (did = did_merge + 1; did < ndim; ++did)
-            slicesize *= dimlens_dst[did];
+        if (v->did_merge < 0)
+            /*
+             * no merging  -- just copy the data from the first source
+             */
+            copy_slabs(ncids_src[0], varids_src[0], ncid_dst, v->varid_dst, v->ndim, v->dimlens_src[0], -1, 0, v->typesize, maxsize, NULL, v->chunksizes, buf);
+        else {
+            /*
+             * copy each source to its place in the merged dimension
+             */
+            for (sid = 0, offset_dst = 0; sid < nsrc; ++sid) {
+                int adjust = (sid > 0 && v->tunits0 != NULL && time_units_changed(v->tunits0, ncids_src[sid], varids_src[sid]));
 
-        /*
-         * merge source data into destination array 
-         */
-        ni = 1;
-        for (did = 0; did < did_merge; ++did)
-            ni *= dimlens_dst[did];
-        offset_dst = 0;
-        offsets_src = calloc(nsrc, sizeof(size_t));
-        for (i = 0; i < ni; ++i) {
-            for (sid = 0; sid < nsrc; ++sid) {
-                size_t size = slicesize * dimlens_src[sid][did] * typesize;
-
-                memcpy(&((char*) v_dst)[offset_dst], &((char*) v_src[sid])[offsets_src[sid]], size);
-                offset_dst += size;
-                offsets_src[sid] += size;
+                copy_slabs(ncids_src[sid], varids_src[sid], ncid_dst, v->varid_dst, v->ndim, v->dimlens_src[sid], v->did_merge, offset_dst, v->typesize, maxsize, (adjust) ? v->tunits0 : NULL, v->chunksizes, buf);
+                offset_dst += v->dimlens_src[sid][v->did_merge];
             }
         }
-
-        /*
-         * write
-         */
-        ncw_put_var(ncid_dst, varid_dst, v_dst);
-        ncw_redef(ncid_dst);
-
-        /*
-         * free memory
-         */
-        free(offsets_src);
-        for (sid = 0; sid < nsrc; ++sid)
-            free(v_src[sid]);
-        free(v_src);
-      nextvar:
-        free(v_dst);
-        free(dimlens_src);
-        free(vars[vid]);
+        if (verbose > 1)
+            printf("\n");
+
+        free(v->dimlens_src);
+        if (v->tunits0 != NULL)
+            free(v->tunits0);
+        if (v->chunksizes != NULL)
+            free(v->chunksizes);
+        free(v->name);
     }
+    free(catvars);
 
-    ncw_enddef(ncid_dst);
     ncw_close(ncid_dst);
     file_rename(tmpdst, dst);
     free(tmpdst);
 
+  finish:
     free(varids_src);
+    free(buf);
     for (sid = 0; sid < nsrc; ++sid)
         ncw_close(ncids_src[sid]);
     free(ncids_src);
@@ -431,6 +683,7 @@ int main(int argc, char** argv)
     free(vars);
     if (dims_force != NULL)
         free(dims_force);
+    prof_report();
 
     return 0;
 }
@@ -20,21 +20,27 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <math.h>
+#include <float.h>
+#include <stdint.h>
 #include "version.h"
 #include "ncw.h"
 #include "ncutils.h"
 #include "utils.h"
+#include "profile.h"
 #include "stringtable.h"
 
 #define PROGRAM_NAME "ncd2f"
-#define PROGRAM_VERSION "0.06"
+#define PROGRAM_VERSION "0.11"
 
 #define VERBOSE_DEF 1
 
 #define DIMNAME_NTRIES 10
 #define NVAR_INC 100
-#define MAXSIZE (1024 * 1024 * 256)
+#define SLABSIZE (1024 * 1024 * 8)    /* in elements */
 #define TEMPVARSUF "_d2f_tmp"
+#define NSB_MAX 22
+#define PACK_MAX 32766
 
 int verbose = VERBOSE_DEF;
 
@@ -42,7 +48,7 @@ int verbose = VERBOSE_DEF;
  */
 static void usage(int status)
 {
-    printf("  Usage: %s -i <src> -o <dst> [{-v <var> [...] | -x <var> [...]}] [-O] [-N]\n", PROGRAM_NAME);
+    printf("  Usage: %s -i <src> -o <dst> [{-v <var> [...] | -x <var> [...]}] [-O] [-N] [{-b <nsb> | -s}] [-z <policy>] [-P]\n", PROGRAM_NAME);
     printf("         %s -v\n", PROGRAM_NAME);
     printf("  Options:\n");
     printf("    -i <src>       -- source file\n");
@@ -52,13 +58,21 @@ static void usage(int status)
     printf("    -x <var> [...] -- exclude these variables\n");
     printf("    -O             -- clobber destination (default: append but do not overwrite existing variables)\n");
     printf("    -N             -- copy dimensions in the original order (for rebuilding NEMO)\n");
+    printf("    -b <nsb>       -- keep only <nsb> (1 to %d) mantissa bits of the converted values\n", NSB_MAX);
+    printf("                      (bit rounding; lossy, improves compression)\n");
+    printf("    -s             -- pack the converted variables to short using scale_factor and\n");
+    printf("                      add_offset calculated from the range of each variable (lossy)\n");
+    printf("    -z <policy>    -- output policy for the converted variables: comma-separated\n");
+    printf("                      list of deflate=<level>, shuffle=<0|1>, chunk=<layers|N>,\n");
+    printf("                      cache=<MB>, filter=<zstd|bzip2>[:<level>] (default: deflate=1)\n");
+    printf("    -P             -- report time and bytes spent in I/O and conversion at exit\n");
     printf("    -v             -- print version and exit\n");
     exit(status);
 }
 
 /**
  */
-static void parse_commandline(int argc, char* argv[], char** fname_src, char** fname_dst, int* nvar, char*** vars, int* nvar_ex, char*** vars_ex, int* clobber, int* orig)
+static void parse_commandline(int argc, char* argv[], char** fname_src, char** fname_dst, int* nvar, char*** vars, int* nvar_ex, char*** vars_ex, int* clobber, int* orig, int* nsb, int* pack)
 {
     int i;
 
@@ -113,14 +127,46 @@ static void parse_commandline(int argc, char* argv[], char** fname_src, char** f
         } else if (strcmp(argv[i], "-N") == 0) {
             *orig = 1;
             i++;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            i++;
+            if (i == argc || !str2int(argv[i], nsb) || *nsb < 1 || *nsb > NSB_MAX)
+                quit("could not convert \"%s\" to the number of mantissa bits (1 to %d)", (i < argc) ? argv[i] : "", NSB_MAX);
+            i++;
+        } else if (strcmp(argv[i], "-z") == 0) {
+            i++;
+            if (i == argc)
+                quit("no output policy specified after \"-z\"");
+            ncw_set_outpolicy(argv[i]);
+            i++;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            *pack = 1;
+            i++;
+        } else if (strcmp(argv[i], "-P") == 0) {
+            prof_enable();
+            i++;
         } else
             quit("unknown option \"%s\"", argv[i]);
     }
 }
 
+/** Checks whether an attribute describes values of a variable in a way that
+ ** becomes invalid after packing.
+ */
+static int ispackingatt(char attname[])
+{
+    char* attnames[] = { "_FillValue", "missing_value", "valid_min", "valid_max", "valid_range", "scale_factor", "add_offset" };
+    int i;
+
+    for (i = 0; i < (int) (sizeof(attnames) / sizeof(attnames[0])); ++i)
+        if (strcmp(attname, attnames[i]) == 0)
+            return 1;
+
+    return 0;
+}
+
 /**
  */
-static int copy_vardef_newtype(int ncid_src, int varid_src, int ncid_dst, char* varname_dst, nc_type newtype)
+static int copy_vardef_newtype(int ncid_src, int varid_src, int ncid_dst, char* varname_dst, nc_type newtype, float* packing, int shuffle)
 {
     int unlimdimid_src = -1;
     char varname[NC_MAX_NAME];
@@ -247,13 +293,315 @@ static int copy_vardef_newtype(int ncid_src, int varid_src, int ncid_dst, char*
     ndims = ii;
 
     ncw_def_var(ncid_dst, varname_dst, newtype, ndims, dimids_dst, &varid_dst);
-    ncw_copy_atts(ncid_src, varid_src, ncid_dst, varid_dst);
-    ncw_def_var_deflate(ncid_dst, varid_dst, 0, 1, 1);
+    for (i = 0; i < natts; ++i) {
+        char attname[NC_MAX_NAME];
+
+        ncw_inq_attname(ncid_src, varid_src, i, attname);
+        /*
+         * (with packing these attributes are replaced)
+         */
+        if (packing != NULL && ispackingatt(attname))
+            continue;
+        /*
+         * (NetCDF-4 requires _FillValue of the type of the variable)
+         */
+        if (newtype == NC_FLOAT && (strcmp(attname, "_FillValue") == 0 || strcmp(attname, "missing_value") == 0)) {
+            nc_type atttype;
+            size_t len;
+
+            ncw_inq_att(ncid_src, varid_src, attname, &atttype, &len);
+            if (atttype == NC_DOUBLE) {
+                double* vd = malloc(len * sizeof(double));
+                float* vf = malloc(len * sizeof(float));
+                size_t j;
+
+                ncw_get_att_double(ncid_src, varid_src, attname, vd);
+                for (j = 0; j < len; ++j)
+                    vf[j] = (vd[j] >= -FLT_MAX && vd[j] <= FLT_MAX) ? (float) vd[j] : NAN;
+                ncw_put_att_float(ncid_dst, varid_dst, attname, len, vf);
+                free(vd);
+                free(vf);
+                continue;
+            }
+        }
+        ncw_copy_att(ncid_src, varid_src, attname, ncid_dst, varid_dst);
+    }
+    if (packing != NULL) {
+        short int fill = NC_FILL_SHORT;
+
+        ncw_put_att_short(ncid_dst, varid_dst, "_FillValue", 1, &fill);
+        ncw_put_att_float(ncid_dst, varid_dst, "scale_factor", 1, &packing[0]);
+        ncw_put_att_float(ncid_dst, varid_dst, "add_offset", 1, &packing[1]);
+    }
+    ncw_def_var_deflate(ncid_dst, varid_dst, shuffle, 1, 1);
+    ncw_def_var_outpolicy(ncid_dst, varid_dst);
     nc_enddef(ncid_dst);
 
     return varid_dst;
 }
 
+/** Casts double values to float. Values that are not finite or are outside
+ ** the float range are set to NaN (as in ncw_get_var_float_fixerange()).
+ */
+static void d2f(size_t n, const double* restrict in, float* restrict out)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        double x = in[i];
+
+        out[i] = (x >= -FLT_MAX && x <= FLT_MAX) ? (float) x : NAN;
+    }
+}
+
+/** Keeps `nsb' mantissa bits of float values, rounding to nearest (ties to
+ ** even). NaNs and infinities are left intact.
+ */
+static void bitround(size_t n, float* v, int nsb)
+{
+    uint32_t mask = ~(uint32_t) 0 << (23 - nsb);
+    uint32_t half = (uint32_t) 1 << (22 - nsb);
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        uint32_t u, r;
+
+        memcpy(&u, &v[i], sizeof(uint32_t));
+        if ((u & 0x7f800000) == 0x7f800000)
+            continue;
+        r = (u + half - 1 + ((u >> (23 - nsb)) & 1)) & mask;
+        if ((r & 0x7f800000) == 0x7f800000)
+            r = u & mask;       /* (do not round up to infinity) */
+        memcpy(&v[i], &r, sizeof(uint32_t));
+    }
+}
+
+/** Packs double values to short as (x - add_offset) / scale_factor. Missing
+ ** values (NaN, infinity, or any of the `nmissing' source missing values)
+ ** are set to NC_FILL_SHORT.
+ */
+static void d2s(size_t n, const double* restrict in, short int* restrict out, float* packing, int nmissing, double missing[])
+{
+    double scale = packing[0], offset = packing[1];
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        double x = in[i];
+
+        if (!isfinite(x) || (nmissing > 0 && x == missing[0]) || (nmissing > 1 && x == missing[1]))
+            out[i] = NC_FILL_SHORT;
+        else {
+            x = round((x - offset) / scale);
+            out[i] = (short int) ((x > PACK_MAX) ? PACK_MAX : ((x < -PACK_MAX) ? -PACK_MAX : x));
+        }
+    }
+}
+
+/** Gets _FillValue and missing_value of a (source) variable.
+ * @return - number of the missing values found
+ */
+static int getmissing(int ncid, int varid, double missing[2])
+{
+    int n = 0;
+
+    if (ncw_att_exists(ncid, varid, "_FillValue"))
+        ncw_get_att_double(ncid, varid, "_FillValue", &missing[n++]);
+    if (ncw_att_exists(ncid, varid, "missing_value"))
+        ncw_get_att_double(ncid, varid, "missing_value", &missing[n++]);
+
+    return n;
+}
+
+/** Divides a variable into slabs of at most SLABSIZE elements split along
+ ** the outermost dimension(s) possible.
+ * @param ndim - number of dimensions
+ * @param dimlen - dimensions
+ * @param s - split dimension (output)
+ * @param nmax - maximal count along the split dimension (output)
+ * @return - number of slabs
+ */
+static size_t getnslab(int ndim, size_t dimlen[], int* s, size_t* nmax)
+{
+    size_t rowlen = 1, nslab;
+    int i;
+
+    if (ndim == 0) {
+        *s = -1;
+        *nmax = 1;
+        return 1;
+    }
+    for (i = 0; i < ndim; ++i)
+        if (dimlen[i] == 0)
+            return 0;
+
+    *s = ndim - 1;
+    while (*s > 0 && rowlen * dimlen[*s] <= SLABSIZE) {
+        rowlen *= dimlen[*s];
+        (*s)--;
+    }
+    *nmax = SLABSIZE / rowlen;
+    if (*nmax < 1)
+        *nmax = 1;
+    nslab = (dimlen[*s] + *nmax - 1) / *nmax;
+    for (i = 0; i < *s; ++i)
+        nslab *= dimlen[i];
+
+    return nslab;
+}
+
+/** Calculates the hyperslab for slab j.
+ * @return - number of elements in the slab
+ */
+static size_t getslab(int ndim, size_t dimlen[], int s, size_t nmax, size_t j, size_t start[], size_t count[])
+{
+    size_t nq, n;
+    int i;
+
+    if (ndim == 0)
+        return 1;
+
+    nq = (dimlen[s] + nmax - 1) / nmax;
+    start[s] = (j % nq) * nmax;
+    count[s] = (start[s] + nmax <= dimlen[s]) ? nmax : dimlen[s] - start[s];
+    j /= nq;
+    for (i = s - 1; i >= 0; --i) {
+        start[i] = j % dimlen[i];
+        count[i] = 1;
+        j /= dimlen[i];
+    }
+    for (i = s + 1; i < ndim; ++i) {
+        start[i] = 0;
+        count[i] = dimlen[i];
+    }
+    for (i = 0, n = 1; i < ndim; ++i)
+        n *= count[i];
+
+    return n;
+}
+
+/** Calculates packing parameters (scale_factor and add_offset) from the range
+ ** of valid values of a variable.
+ * @param vd - buffer of size SLABSIZE
+ * @param packing - packing parameters (output)
+ */
+static void getpacking(int ncid, int varid, double* vd, float packing[2])
+{
+    size_t dimlen[NC_MAX_DIMS];
+    size_t start[NC_MAX_DIMS], count[NC_MAX_DIMS];
+    double missing[2];
+    int nmissing = getmissing(ncid, varid, missing);
+    double min = DBL_MAX, max = -DBL_MAX;
+    size_t nmax, nslab, j, i;
+    int ndim, s;
+
+    ncw_inq_vardims(ncid, varid, NC_MAX_DIMS, &ndim, dimlen);
+    nslab = getnslab(ndim, dimlen, &s, &nmax);
+    for (j = 0; j < nslab; ++j) {
+        size_t n = getslab(ndim, dimlen, s, nmax, j, start, count);
+
+        ncw_get_vara_double(ncid, varid, start, count, vd);
+        for (i = 0; i < n; ++i) {
+            double x = vd[i];
+
+            if (!isfinite(x) || (nmissing > 0 && x == missing[0]) || (nmissing > 1 && x == missing[1]))
+                continue;
+            if (x < min)
+                min = x;
+            if (x > max)
+                max = x;
+        }
+    }
+    if (min > max)
+        min = max = 0.0;        /* (no valid values) */
+
+    packing[0] = (float) ((max > min) ? (max - min) / (2.0 * PACK_MAX) : 1.0);
+    packing[1] = (float) ((max + min) / 2.0);
+    /*
+     * (make sure that the range is still covered with the rounded scale)
+     */
+    while ((double) packing[0] * PACK_MAX < (max - min) / 2.0)
+        packing[0] = nextafterf(packing[0], FLT_MAX);
+}
+
+/** Converts a variable to float by slabs through open source and destination
+ ** files. When compiled with OpenMP, reading and writing of the slabs
+ ** (always done by one thread) are overlapped with the conversion.
+ * @param nsb - number of mantissa bits to keep (0 = all)
+ * @param packing - if not NULL: pack to short with these scale_factor and
+ *                  add_offset
+ * @param vd - double buffers of size SLABSIZE
+ * @param vf - float buffers of size SLABSIZE
+ */
+static void convert_var(int ncid_src, int varid_src, int ncid_dst, int varid_dst, int nsb, float* packing, double* vd[2], float* vf[2])
+{
+    double missing[2];
+    int nmissing = (packing != NULL) ? getmissing(ncid_src, varid_src, missing) : 0;
+    size_t dimlen[NC_MAX_DIMS];
+    size_t start[2][NC_MAX_DIMS], count[2][NC_MAX_DIMS];
+    size_t n[2] = { 0, 0 };
+    size_t nmax, nslab;
+    long j;
+    int ndim, s;
+
+    ncw_inq_vardims(ncid_src, varid_src, NC_MAX_DIMS, &ndim, dimlen);
+    nslab = getnslab(ndim, dimlen, &s, &nmax);
+
+    for (j = -1; j <= (long) nslab; ++j) {
+#if defined(_OPENMP)
+#pragma omp parallel sections num_threads(2) if(nslab > 1)
+#endif
+        {
+#if defined(_OPENMP)
+#pragma omp section
+#endif
+            {
+                /*
+                 * I/O: write slab j - 1, read slab j + 1
+                 */
+                if (j >= 1) {
+                    int b = (j - 1) % 2;
+
+                    if (packing != NULL)
+                        ncw_put_vara_short(ncid_dst, varid_dst, start[b], count[b], (short int*) vf[b]);
+                    else
+                        ncw_put_vara_float(ncid_dst, varid_dst, start[b], count[b], vf[b]);
+                    if (verbose) {
+                        printf(".");
+                        fflush(stdout);
+                    }
+                }
+                if (j + 1 < (long) nslab) {
+                    int b = (j + 1) % 2;
+
+                    n[b] = getslab(ndim, dimlen, s, nmax, j + 1, start[b], count[b]);
+                    ncw_get_vara_double(ncid_src, varid_src, start[b], count[b], vd[b]);
+                }
+            }
+#if defined(_OPENMP)
+#pragma omp section
+#endif
+            {
+                /*
+                 * conversion of slab j
+                 */
+                if (j >= 0 && j < (long) nslab) {
+                    int b = j % 2;
+                    double t0 = prof_start();
+
+                    if (packing != NULL)
+                        d2s(n[b], vd[b], (short int*) vf[b], packing, nmissing, missing);
+                    else {
+                        d2f(n[b], vd[b], vf[b]);
+                        if (nsb > 0)
+                            bitround(n[b], vf[b], nsb);
+                    }
+                    prof_stop(PROF_COMPUTE, t0, n[b] * sizeof(double));
+                }
+            }
+        }
+    }
+}
+
 /**
  */
 int main(int argc, char* argv[])
@@ -266,6 +614,9 @@ int main(int argc, char* argv[])
     char** varnames_ex = NULL;
     int clobber = 0;
     int orig = 0;
+    int nsb = 0;
+    int pack = 0;
+    float packing[2];
 
     stringtable* exclude = NULL;
 
@@ -273,11 +624,13 @@ int main(int argc, char* argv[])
     char** varnames_cp = NULL;
 
     char** varnames_dst = NULL;
+    double* vd[2] = { NULL, NULL };
+    float* vf[2] = { NULL, NULL };
     char* fname_dst_tmp = NULL;
     int ncid_src, ncid_dst;
     int vid;
 
-    parse_commandline(argc, argv, &fname_src, &fname_dst, &nvar, &varnames_src, &nvar_ex, &varnames_ex, &clobber, &orig);
+    parse_commandline(argc, argv, &fname_src, &fname_dst, &nvar, &varnames_src, &nvar_ex, &varnames_ex, &clobber, &orig, &nsb, &pack);
 
     if (fname_src == NULL)
         quit("no input file specified");
@@ -287,6 +640,8 @@ int main(int argc, char* argv[])
         quit("source and destination files must be different");
     if (nvar != 0 && nvar_ex != 0)
         quit("can not use both \"-v\" and \"-x\"");
+    if (nsb > 0 && pack)
+        quit("can not use both \"-b\" and \"-s\"");
 
     ncw_set_quitfn(quit);
     ncu_set_quitfn(quit);
@@ -316,7 +671,7 @@ int main(int argc, char* argv[])
             if (exclude != NULL && st_findindexbystring(exclude, name) >= 0)
                 continue;
             ncw_inq_var_deflate(ncid_src, vid, NULL, &deflate, &dlevel);
-            if ((type != NC_DOUBLE && type != NC_FLOAT) || ncu_getnfields(fname_src, name) == 0 || (type == NC_FLOAT && deflate && dlevel != 0)) {
+            if ((type != NC_DOUBLE && type != NC_FLOAT) || ncu_inq_nfields(ncid_src, vid) == 0 || (type == NC_FLOAT && deflate && dlevel != 0)) {
                 if (nvar_cp % NVAR_INC == 0)
                     varnames_cp = realloc(varnames_cp, (nvar_cp + NVAR_INC) * sizeof(void*));
                 varnames_cp[nvar_cp] = strdup(name);
@@ -414,8 +769,6 @@ int main(int argc, char* argv[])
      */
     for (vid = 0; vid < nvar; ++vid) {
         int varid_src, varid_dst;
-        size_t size;
-        float* v;
 
         if (ncw_var_exists(ncid_dst, varnames_src[vid]))
             quit("%s: variable \"%s\" already exists", fname_dst, varnames_src[vid]);
@@ -424,10 +777,23 @@ int main(int argc, char* argv[])
             fflush(stdout);
         }
         ncw_inq_varid(ncid_src, varnames_src[vid], &varid_src);
-        if (!ncw_var_exists(ncid_dst, varnames_dst[vid]))
-            varid_dst = copy_vardef_newtype(ncid_src, varid_src, ncid_dst, varnames_dst[vid], NC_FLOAT);
-        else
+        if (vd[0] == NULL) {
+            vd[0] = malloc(SLABSIZE * sizeof(double));
+            vd[1] = malloc(SLABSIZE * sizeof(double));
+            vf[0] = malloc(SLABSIZE * sizeof(float));
+            vf[1] = malloc(SLABSIZE * sizeof(float));
+        }
+        if (!ncw_var_exists(ncid_dst, varnames_dst[vid])) {
+            if (pack)
+                getpacking(ncid_src, varid_src, vd[0], packing);
+            varid_dst = copy_vardef_newtype(ncid_src, varid_src, ncid_dst, varnames_dst[vid], (pack) ? NC_SHORT : NC_FLOAT, (pack) ? packing : NULL, nsb > 0 || pack);
+        } else {
             ncw_inq_varid(ncid_dst, varnames_dst[vid], &varid_dst);
+            if (pack) {
+                ncw_get_att_float(ncid_dst, varid_dst, "scale_factor", &packing[0]);
+                ncw_get_att_float(ncid_dst, varid_dst, "add_offset", &packing[1]);
+            }
+        }
 #if 0
         {
             int natt, i;
@@ -446,55 +812,7 @@ int main(int argc, char* argv[])
         }
 #endif
 
-        size = ncw_get_varsize(ncid_src, varid_src);
-        if (size <= MAXSIZE) {
-            int use_putvara = 0;
-
-            v = malloc(size * ncw_sizeof(NC_FLOAT));
-            ncu_readvarfloat(ncid_src, varid_src, size, v);
-
-            if (ncw_var_hasunlimdim(ncid_dst, varid_dst)) {
-                int nr_src = ncw_inq_nrecords(ncid_src);
-                int nr_dst = ncw_inq_nrecords(ncid_dst);
-
-                if (nr_src > nr_dst)
-                    use_putvara = 1;
-            }
-
-            if (!use_putvara)
-                ncw_put_var_float(ncid_dst, varid_dst, v);
-            else {
-                int ndims;
-                size_t dimlen[NC_MAX_VAR_DIMS];
-                size_t start[NC_MAX_VAR_DIMS];
-                int i;
-
-                ncw_inq_vardims(ncid_src, varid_src, NC_MAX_DIMS, &ndims, dimlen);
-                for (i = 0; i < ndims; ++i)
-                    start[i] = 0;
-                ncw_put_vara_float(ncid_dst, varid_dst, start, dimlen, v);
-            }
-            if (verbose) {
-                printf(".");
-                fflush(stdout);
-            }
-            free(v);
-        } else {
-            int nk = ncu_getnfields(fname_src, varnames_src[vid]);
-            int k;
-
-            assert(nk > 0);
-            v = malloc(size / nk * ncw_sizeof(NC_FLOAT));
-            for (k = 0; k < nk; ++k) {
-                ncu_readfield(fname_src, varnames_src[vid], k, -1, -1, nk, v);
-                ncu_writefield((fname_dst_tmp == NULL) ? fname_dst : fname_dst_tmp, varnames_dst[vid], k, -1, -1, nk, v);
-                if (verbose) {
-                    printf(".");
-                    fflush(stdout);
-                }
-            }
-            free(v);
-        }
+        convert_var(ncid_src, varid_src, ncid_dst, varid_dst, nsb, (pack) ? packing : NULL, vd, vf);
         ncw_sync(ncid_dst);
         ncw_redef(ncid_dst);
         if (verbose)
@@ -511,6 +829,12 @@ int main(int argc, char* argv[])
     if (fname_dst_tmp != NULL)
         file_rename(fname_dst_tmp, fname_dst);
 
+    if (vd[0] != NULL) {
+        free(vd[0]);
+        free(vd[1]);
+        free(vf[0]);
+        free(vf[1]);
+    }
     if (exclude != NULL)
         st_destroy(exclude);
     if (varnames_dst != varnames_src) {
@@ -528,6 +852,7 @@ int main(int argc, char* argv[])
             free(varnames_cp[vid]);
         free(varnames_cp);
     }
+    prof_report();
     if (verbose)
         printf("  finished\n");
 
@@ -16,10 +16,26 @@
  *              grids can be either structured ([j][i]) or unstructured ([i]).
  *              The vertical layers are interpolated sequentially.
  *
+ *              For a given set of valid source nodes the interpolation is
+ *              represented by a sparse matrix ("stencil") with up to three
+ *              source nodes (vertices of the enclosing Delaunay triangle) and
+ *              the corresponding barycentric weights for each destination
+ *              node. The stencils can be saved to a weights file and applied
+ *              later without the grids and triangulation.
+ *
+ *              With "-c" the fields are remapped conservatively (first
+ *              order) instead. The cells of structured grids are centred at
+ *              the nodes and bounded by great circle arcs; their overlaps on
+ *              sphere are calculated once per grid pair, and the stencil for
+ *              a given set of valid source nodes contains the overlapping
+ *              valid source cells with weights proportional to the overlap
+ *              areas. These stencils go to the weights file in the same
+ *              format.
+ *
  *              The data is assumed to be in NetCDF format.
- *             
+ *
  * Dependence:  For triangulation related matters the code uses nn library
- *              available from https://github.com/sakov/nn-c.       
+ *              available from https://github.com/sakov/nn-c.
  *
  * Revisions:
  *
@@ -37,13 +53,20 @@
 #include <unistd.h>
 #include <nn.h>
 #include <delaunay.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+#if defined(MPI)
+#include <mpi.h>
+#endif
 #include "version.h"
 #include "ncw.h"
 #include "ncutils.h"
 #include "utils.h"
+#include "profile.h"
 
 #define PROGRAM_NAME "regrid_ll"
-#define PROGRAM_VERSION "0.03"
+#define PROGRAM_VERSION "0.16"
 
 #define VERBOSE_DEF 1
 #define DEG2RAD (M_PI / 180.0)
@@ -55,31 +78,210 @@
 
 #define POLAR_EPS 1.0e-10
 
+#define NVAR_INC 10
+#define NSTENCILCACHE 4
+#define NPOINT_CHUNK 1024
+#define HILBERT_ORDER 16
+#define NPOLY_MAX 32
+#define NOVERLAP_INC 4096
+#define NCAND_INC 64
+#define CELL_RMAX 1.0
+#define NBOX_MAX (1 << 20)
+#define OVERLAP_EPS 1.0e-12
+
+#define TAG_FIELD 1
+
+int nprocesses = 1;
+int rank = 0;
+
+/*
+ * timing of stencil building
+ */
+static double time_triangulate = 0.0;
+static double time_locate = 0.0;
+static size_t nlocated = 0;
+static double time_overlap = 0.0;
+static size_t noverlap = 0;
+
+/*
+ * horizontal grid
+ */
+typedef struct {
+    int type;
+    size_t ni;
+    size_t nj;
+    size_t n;
+    float* lon;                 /* [ni] for GRIDTYPE_RECT, [n] otherwise */
+    float* lat;                 /* [nj] for GRIDTYPE_RECT, [n] otherwise */
+    int* nk;                    /* number of valid layers (optional) */
+
+    /*
+     * stereographic projections from the south pole (used for the northern
+     * hemisphere) and from the north pole (used for the southern hemisphere);
+     * use grid_getxy() for access
+     */
+    float* x_south;
+    float* y_south;
+    float* x_north;
+    float* y_north;
+    /*
+     * for GRIDTYPE_RECT the projections are separable and are calculated on
+     * the fly as x = r[j] * sin(lon[i]), y = r[j] * cos(lon[i])
+     */
+    float* sinlon;              /* [ni] */
+    float* coslon;              /* [ni] */
+    float* r_south;             /* [nj] */
+    float* r_north;             /* [nj] */
+    /*
+     * maximal distance from the centre of the projection of the nodes used
+     * in triangulation (HUGE_VAL = all nodes)
+     */
+    double rmax;
+    /*
+     * node indices sorted along Hilbert curve in the projections (optional)
+     */
+    int* order;
+    /*
+     * cell corners on the unit sphere, [(nj + 1) * (ni + 1) * 3] (structured
+     * grids, conservative remapping only)
+     */
+    double* corners;
+} grid;
+
+/*
+ * interpolation matrix in CSR format; an empty row means that the destination
+ * node is not interpolated
+ */
+typedef struct {
+    size_t n;                   /* number of destination nodes */
+    size_t nnz;
+    size_t* rowstart;           /* [n + 1] */
+    int* ids;                   /* [nnz] */
+    double* w;                  /* [nnz] */
+    int k;                      /* layer the stencil has been built for */
+} stencil;
+
+/*
+ * weights file opened for reading
+ */
+typedef struct {
+    int ncid;
+    int ni_src;
+    int nj_src;
+    int ni_dst;
+    int nj_dst;
+    int nlayer;
+    int* layer2stencil;         /* [nlayer] */
+    int nstencil;
+    int* nkdst;                 /* number of valid destination layers
+                                 * (optional) */
+    int varid_rowstart;
+    int varid_ids;
+    int varid_w;
+    /*
+     * the two most recently read stencils (so that the next stencil can be
+     * read while the previous one is in use)
+     */
+    int current[2];
+    stencil* st[2];
+    int last;                   /* slot returned last */
+} weights;
+
+/*
+ * variable to be interpolated
+ */
+typedef struct {
+    char* varname;
+    int varid_src;
+    int varid_dst;
+    int ndims;
+    int nk;                     /* number of layers */
+    int nr;                     /* number of records */
+    ncu_field* field_src;
+    ncu_field* field_dst;
+    float** vdst_last;          /* [nr][nij_dst] (with "-n") */
+} variable;
+
+/*
+ * stencils built for the most recent distinct masks of valid source nodes
+ */
+typedef struct {
+    int n;
+    int next;                   /* entry to be replaced next */
+    stencil* st[NSTENCILCACHE];
+    unsigned char* mask[NSTENCILCACHE];
+} stencilcache;
+
+/*
+ * field (a layer of a record of a variable) to be interpolated
+ */
+typedef struct {
+    int k;
+    int vi;
+    int r;
+    stencil* st;
+    int npoint;
+    int npoint_dst;
+    int npoint_filled;
+} task;
+
 /**
  */
 static void usage(int status)
 {
-    printf("  Usage: %s -i <src> -o <dst> -v <varname> -gi <src grid> <lon> <lat> [<numlayers>] -go <dst grid> <lon> <lat> [<numlayers>] [-d <level>] [-m] [-n] [-s] [-V <verblevel>]\n", PROGRAM_NAME);
+    printf("  Usage: %s -i <src> -o <dst> [-v <var> [...]] -gi <src grid> <lon> <lat> [<numlayers>] -go <dst grid> <lon> <lat> [<numlayers>] [-c] [-d <level>] [-z <policy>] [-e <band>] [-m] [-n] [-p] [-s] [-t <nthreads>] [-wo <weights>] [-P] [-V <verblevel>]\n", PROGRAM_NAME);
+    printf("         %s -gi <src grid> <lon> <lat> [<numlayers>] -go <dst grid> <lon> <lat> [<numlayers>] -wo <weights> [-c] [-e <band>] [-s] [-t <nthreads>] [-P] [-V <verblevel>]\n", PROGRAM_NAME);
+    printf("         %s -i <src> -o <dst> [-v <var> [...]] -wi <weights> [-d <level>] [-z <policy>] [-m] [-n] [-p] [-t <nthreads>] [-P] [-V <verblevel>]\n", PROGRAM_NAME);
     printf("         %s -v\n", PROGRAM_NAME);
     printf("  Options:\n");
     printf("    -i <src> -- source file\n");
     printf("    -o <dst> -- destination file (clobbed)\n");
-    printf("    -v <varname> -- variable to interpolate\n");
+    printf("    -v <var> [...] -- variables to interpolate (default = all variables defined\n");
+    printf("          on the source grid, except geographic coordinates)\n");
     printf("    -gi <src grid> <lon> <lat> [<numlayers>] -- source grid\n");
     printf("    -go <dst grid> <lon> <lat> [<numlayers>] -- destination grid\n");
+    printf("    -c -- flag: remap conservatively (first order, structured grids only)\n");
+    printf("          instead of linear interpolation\n");
     printf("    -d <level> -- deflation level\n");
+    printf("    -z <policy> -- output policy: comma-separated list of deflate=<level>,\n");
+    printf("          shuffle=<0|1>, chunk=<layers|N>, cache=<MB>, filter=<zstd|bzip2>[:<level>]\n");
+    printf("    -e <band> -- triangulate each hemisphere using source nodes from this\n");
+    printf("          hemisphere and from a band of <band> degrees of latitude beyond\n");
+    printf("          the equator only (default = use all nodes in both triangulations)\n");
     printf("    -m -- flag: use NaN for filling (default = use zero)\n");
     printf("    -n -- flag: use the deepest valid value for filling the rest of the column\n");
+    printf("    -p -- flag: pipeline: read the next field and write the previous one\n");
+    printf("          while interpolating the current one (requires OpenMP)\n");
     printf("    -s -- flag: do not use the first and last columns of the source field\n");
     printf("          (e.g. with NEMO on ORCA grids)\n");
+    printf("    -t <nthreads> -- number of OpenMP threads (default = OMP_NUM_THREADS or\n");
+    printf("          number of cores); the results do not depend on the number of threads\n");
+    printf("    -wi <weights> -- interpolate using precalculated weights (grids are not\n");
+    printf("          needed)\n");
+    printf("    -wo <weights> -- calculate interpolation weights and save them; if source\n");
+    printf("          is specified then interpolate it using these weights\n");
+    printf("    -P -- flag: report time and bytes spent in I/O, decoding, triangulation\n");
+    printf("          and computations at exit\n");
     printf("    -V <level> -- set verbosity to 0, 1, or 2 (default = 1)\n");
     printf("    -v -- print version and exit\n");
+    printf("  Notes:\n");
+    printf("    When interpolating with weights the valid source nodes are defined by\n");
+    printf("    the grids only (that is, by <numlayers> and \"-s\"); non-finite source\n");
+    printf("    values in these nodes make the dependent destination nodes filled.\n");
+    printf("    With \"-c\" the cells are centred at the grid nodes; the value in a\n");
+    printf("    destination cell is the area-weighted average over the overlapping\n");
+    printf("    valid source cells (the integral is conserved for fully covered cells).\n");
+    printf("    All records of the variables are interpolated; 1D variables with the\n");
+    printf("    unlimited dimension (such as \"time\") are copied to the destination.\n");
+    printf("    When compiled with MPI, rank 0 writes the output and the layers (or,\n");
+    printf("    if there are fewer layers than ranks, the fields) are distributed\n");
+    printf("    between the other ranks.\n");
     exit(status);
 }
 
 /**
  */
-static void parse_commandline(int argc, char* argv[], char** fname_src, char** fname_dst, char** varname, char** grdname_src, char** xname_src, char** yname_src, char** nkname_src, char** grdname_dst, char** xname_dst, char** yname_dst, char** nkname_dst, int* deflate, int* propagatedown, int* nanfill, int* skipfirstlast, int* verbose)
+static void parse_commandline(int argc, char* argv[], char** fname_src, char** fname_dst, int* nvar, char*** varnames, char** grdname_src, char** xname_src, char** yname_src, char** nkname_src, char** grdname_dst, char** xname_dst, char** yname_dst, char** nkname_dst, char** fname_win, char** fname_wout, int* conservative, int* deflate, double* band, int* propagatedown, int* nanfill, int* skipfirstlast, int* nthreads, int* pipeline, int* verbose)
 {
     int i;
 
@@ -114,8 +316,13 @@ static void parse_commandline(int argc, char* argv[], char** fname_src, char** f
             i++;
             if (i == argc || argv[i][0] == '-')
                 quit("no variable name found after \"-v\"");
-            *varname = argv[i];
-            i++;
+            while (i < argc && argv[i][0] != '-') {
+                if (*nvar % NVAR_INC == 0)
+                    *varnames = realloc(*varnames, (*nvar + NVAR_INC) * sizeof(void*));
+                (*varnames)[*nvar] = argv[i];
+                (*nvar)++;
+                i++;
+            }
         } else if (strcmp(&argv[i][1], "gi") == 0) {
             i++;
             if (i == argc || argv[i][0] == '-')
@@ -152,12 +359,50 @@ static void parse_commandline(int argc, char* argv[], char** fname_src, char** f
                 *nkname_dst = argv[i];
                 i++;
             }
+        } else if (strcmp(&argv[i][1], "wi") == 0) {
+            i++;
+            if (i == argc || argv[i][0] == '-')
+                quit("no file name found after \"-wi\"");
+            *fname_win = argv[i];
+            i++;
+        } else if (strcmp(&argv[i][1], "wo") == 0) {
+            i++;
+            if (i == argc || argv[i][0] == '-')
+                quit("no file name found after \"-wo\"");
+            *fname_wout = argv[i];
+            i++;
+        } else if (strcmp(&argv[i][1], "c") == 0) {
+            *conservative = 1;
+            i++;
         } else if (strcmp(&argv[i][1], "d") == 0) {
             i++;
             if (i == argc || argv[i][0] == '-')
                 quit("no deflation level found after \"-d\"");
             *deflate = atoi(argv[i]);
             i++;
+        } else if (strcmp(&argv[i][1], "z") == 0) {
+            i++;
+            if (i == argc || argv[i][0] == '-')
+                quit("no output policy found after \"-z\"");
+            ncw_set_outpolicy(argv[i]);
+            i++;
+        } else if (strcmp(&argv[i][1], "P") == 0) {
+            prof_enable();
+            i++;
+        } else if (strcmp(&argv[i][1], "e") == 0) {
+            i++;
+            if (i == argc || argv[i][0] == '-')
+                quit("no band width found after \"-e\"");
+            if (!str2double(argv[i], band) || *band < 0.0 || *band > 90.0)
+                quit("could not convert \"%s\" to a band width between 0 and 90 degrees", argv[i]);
+            i++;
+        } else if (strcmp(&argv[i][1], "t") == 0) {
+            i++;
+            if (i == argc || argv[i][0] == '-')
+                quit("no number of threads found after \"-t\"");
+            if (!str2int(argv[i], nthreads) || *nthreads < 1)
+                quit("could not convert \"%s\" to a positive number of threads", argv[i]);
+            i++;
         } else if (strcmp(&argv[i][1], "V") == 0) {
             i++;
             if (i == argc || argv[i][0] == '-')
@@ -170,6 +415,9 @@ static void parse_commandline(int argc, char* argv[], char** fname_src, char** f
         } else if (strcmp(&argv[i][1], "n") == 0) {
             *propagatedown = 1;
             i++;
+        } else if (strcmp(&argv[i][1], "p") == 0) {
+            *pipeline = 1;
+            i++;
         } else if (strcmp(&argv[i][1], "s") == 0) {
             *skipfirstlast = 1;
             i++;
@@ -195,566 +443,2234 @@ static void ll2xyz(double in[2], double out[3])
 
 /**
  */
-int main(int argc, char* argv[])
+static double dot3(double a[3], double b[3])
 {
-    char* fname_src = NULL;
-    char* fname_dst = NULL;
-    char* varname = NULL;
-    char* grdname_src = NULL;
-    char* xname_src = NULL;
-    char* yname_src = NULL;
-    char* nkname_src = NULL;
-    char* grdname_dst = NULL;
-    char* xname_dst = NULL;
-    char* yname_dst = NULL;
-    char* nkname_dst = NULL;
-    int deflate = 0;
-    int propagatedown = 0;
-    int nanfill = 0;
-    int skipfirstlast = 0;
-    int verbose = VERBOSE_DEF;
-
-    int gridtype = GRIDTYPE_UNDEF;
-
-    int npoint_filled_tot = 0;
-
-    int ncid_src;
-    int varid_src;
-    int ndims_src;
-    size_t dimlen_src[4];
-    int dimids_src[4];
-    int unlimdimid_src = -1;
-    nc_type nctype;
-    size_t ni_src = 0, nj_src = 0, nij_src = 0;
-
-    float* xsrc = NULL;
-    float* ysrc = NULL;
-    int* nksrc = NULL;
-
-    float* xsrc_south = NULL;
-    float* ysrc_south = NULL;
-    float* xsrc_north = NULL;
-    float* ysrc_north = NULL;
-
-    char fname_dst_tmp[MAXSTRLEN];
-
-    float* xdst = NULL;
-    float* ydst = NULL;
-    int* nkdst = NULL;
-
-    float* xdst_south = NULL;
-    float* ydst_south = NULL;
-    float* xdst_north = NULL;
-    float* ydst_north = NULL;
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
 
-    int ncid_dst;
-    int varid_dst;
-    size_t dimlen_dst[4];
-    int dimids_dst[4];
-    size_t ni_dst = 0, nj_dst = 0, nij_dst = 0;
+/**
+ */
+static void cross3(double a[3], double b[3], double out[3])
+{
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
 
-    float* vsrc = NULL;
-    float* vdst = NULL;
-    float* vdst_last = NULL;
+/** Normalises a vector (the result is NaN for a zero vector).
+ */
+static void normalise3(double a[3])
+{
+    double norm = sqrt(dot3(a, a));
 
-    point* points_south = NULL;
-    point* points_north = NULL;
+    a[0] /= norm;
+    a[1] /= norm;
+    a[2] /= norm;
+}
 
-    size_t nk = 0;
+/** Reads horizontal grid.
+ * @param fname - grid file
+ * @param xname - longitude variable
+ * @param yname - latitude variable
+ * @param nkname - variable with the number of valid layers (NULL if none)
+ * @param vect - for 1D coordinates: 1 for unstructured grid, 0 for
+ *               rectangular grid, -1 to decide by dimensions of coordinates
+ * @param g - grid (output)
+ */
+static void grid_read(char fname[], char xname[], char yname[], char nkname[], int vect, grid* g)
+{
+    int ncid;
+    int varid_x, varid_y;
+    size_t dimlen[2];
+    int ndims;
+
+    memset(g, 0, sizeof(grid));
+
+    ncw_open(fname, NC_NOWRITE, &ncid);
+    ncw_inq_varid(ncid, xname, &varid_x);
+    ncw_inq_varid(ncid, yname, &varid_y);
+    ncw_inq_varndims(ncid, varid_x, &ndims);
+    if (ndims == 2) {
+        g->type = GRIDTYPE_CURV;
+        ncw_inq_vardims(ncid, varid_x, 2, NULL, dimlen);
+        ncw_check_vardims(ncid, varid_y, 2, dimlen);
+        g->ni = dimlen[1];
+        g->nj = dimlen[0];
+        g->n = g->ni * g->nj;
+        g->lon = malloc(g->n * sizeof(float));
+        g->lat = malloc(g->n * sizeof(float));
+        ncu_readvarfloat(ncid, varid_x, g->n, g->lon);
+        ncu_readvarfloat(ncid, varid_y, g->n, g->lat);
+    } else if (ndims == 1) {
+        ncw_inq_vardims(ncid, varid_x, 1, NULL, &dimlen[1]);
+        ncw_inq_vardims(ncid, varid_y, 1, NULL, &dimlen[0]);
+        if (vect < 0) {
+            int dimid_x, dimid_y;
+
+            ncw_inq_vardimid(ncid, varid_x, &dimid_x);
+            ncw_inq_vardimid(ncid, varid_y, &dimid_y);
+            vect = (dimid_x == dimid_y);
+        }
+        if (!vect) {
+            g->type = GRIDTYPE_RECT;
+            g->ni = dimlen[1];
+            g->nj = dimlen[0];
+            g->n = g->ni * g->nj;
+            g->lon = malloc(g->ni * sizeof(float));
+            g->lat = malloc(g->nj * sizeof(float));
+            ncu_readvarfloat(ncid, varid_x, g->ni, g->lon);
+            ncu_readvarfloat(ncid, varid_y, g->nj, g->lat);
+        } else {
+            if (dimlen[0] != dimlen[1])
+                quit("%s: grid is unstructured, but coordinates \"%s\" and \"%s\" are of different length", fname, xname, yname);
+            g->type = GRIDTYPE_VECT;
+            g->ni = dimlen[0];
+            g->nj = 0;
+            g->n = g->ni;
+            g->lon = malloc(g->n * sizeof(float));
+            g->lat = malloc(g->n * sizeof(float));
+            ncu_readvarfloat(ncid, varid_x, g->n, g->lon);
+            ncu_readvarfloat(ncid, varid_y, g->n, g->lat);
+        }
+    } else
+        quit("%s: can not handle %d-dimensional coordinate \"%s\"", fname, ndims, xname);
 
-    int i, k;
+    if (nkname != NULL) {
+        int varid;
 
-    parse_commandline(argc, argv, &fname_src, &fname_dst, &varname, &grdname_src, &xname_src, &yname_src, &nkname_src, &grdname_dst, &xname_dst, &yname_dst, &nkname_dst, &deflate, &propagatedown, &nanfill, &skipfirstlast, &verbose);
+        ncw_inq_varid(ncid, nkname, &varid);
+        if (g->nj > 0) {
+            size_t dimlen[2] = { g->nj, g->ni };
 
-    if (fname_src == NULL)
-        quit("no input file specified");
-    if (fname_dst == NULL)
-        quit("no output file specified");
-    if (varname == NULL)
-        quit("no variable name specified");
-    if (grdname_src == NULL)
-        quit("no input grid file specified");
-    if (grdname_dst == NULL)
-        quit("no output grid file specified");
+            ncw_check_vardims(ncid, varid, 2, dimlen);
+        } else {
+            size_t dimlen = g->ni;
 
-    if (verbose) {
-        printf("  src = \"%s\"\n", fname_src);
-        printf("    varname =  \"%s\"\n", varname);
-        fflush(stdout);
+            ncw_check_vardims(ncid, varid, 1, &dimlen);
+        }
+        g->nk = malloc(g->n * sizeof(int));
+        ncw_get_var_int(ncid, varid, g->nk);
     }
+    ncw_close(ncid);
+}
 
-    ncw_set_quitfn(quit);
-    ncu_set_quitfn(quit);
+/** Calculates stereographic projections of the grid nodes. Longitudes are
+ ** freed after that; latitudes are freed unless `keeplat' is set. For
+ ** rectangular grids only the separable factors of the projections are
+ ** stored.
+ */
+static void grid_project(grid* g, int keeplat)
+{
+    size_t i;
+
+    g->rmax = HUGE_VAL;
+    if (g->type == GRIDTYPE_RECT) {
+        g->sinlon = malloc(g->ni * sizeof(float));
+        g->coslon = malloc(g->ni * sizeof(float));
+        g->r_south = malloc(g->nj * sizeof(float));
+        g->r_north = malloc(g->nj * sizeof(float));
+        for (i = 0; i < g->ni; ++i) {
+            g->sinlon[i] = sin(g->lon[i] * DEG2RAD);
+            g->coslon[i] = cos(g->lon[i] * DEG2RAD);
+        }
+        for (i = 0; i < g->nj; ++i) {
+            double lat = g->lat[i] * DEG2RAD;
 
-    /*
-     * src
-     */
-    ncw_open(fname_src, NC_NOWRITE, &ncid_src);
-    ncw_inq_varid(ncid_src, varname, &varid_src);
-    ncw_inq_vardims(ncid_src, varid_src, 4, &ndims_src, dimlen_src);
-    ncw_inq_var(ncid_src, varid_src, NULL, &nctype, NULL, dimids_src, NULL);
-    if (ncw_var_hasunlimdim(ncid_src, varid_src)) {
-        ncw_inq_unlimdim(ncid_src, &unlimdimid_src);
-        if (dimlen_src[0] != 1)
-            quit("%s: %s: %s can not handle more than one record yet", fname_src, varname, PROGRAM_NAME);
+            g->r_south[i] = cos(lat) / (1.0 + sin(lat));
+            g->r_north[i] = cos(lat) / (1.0 - sin(lat));
+        }
+    } else {
+        g->x_south = malloc(g->n * sizeof(float));
+        g->y_south = malloc(g->n * sizeof(float));
+        g->x_north = malloc(g->n * sizeof(float));
+        g->y_north = malloc(g->n * sizeof(float));
+#if defined(_OPENMP)
+#pragma omp parallel for
+#endif
+        for (i = 0; i < g->n; ++i) {
+            double ll[2] = { g->lon[i], -g->lat[i] };
+            double xyz[3];
+
+            ll2xyz(ll, xyz);
+            g->x_south[i] = xyz[0] / (1.0 - xyz[2]);
+            g->y_south[i] = xyz[1] / (1.0 - xyz[2]);
+
+            ll[1] = g->lat[i];
+            ll2xyz(ll, xyz);
+            g->x_north[i] = xyz[0] / (1.0 - xyz[2]);
+            g->y_north[i] = xyz[1] / (1.0 - xyz[2]);
+        }
     }
-    if (verbose) {
-        printf("    size = ");
-        for (i = 0; i < ndims_src; ++i)
-            printf("%zu%s", dimlen_src[i], i < ndims_src - 1 ? " x " : "\n");
-        fflush(stdout);
+    free(g->lon);
+    g->lon = NULL;
+    if (!keeplat) {
+        free(g->lat);
+        g->lat = NULL;
     }
+}
 
-    /*
-     * src grid
-     */
-    if (verbose) {
-        printf("  src grid = \"%s\"\n", grdname_src);
-        fflush(stdout);
+/**
+ */
+static void grid_free(grid* g)
+{
+    if (g->lon != NULL)
+        free(g->lon);
+    if (g->lat != NULL)
+        free(g->lat);
+    if (g->nk != NULL)
+        free(g->nk);
+    if (g->order != NULL)
+        free(g->order);
+    if (g->x_south != NULL) {
+        free(g->x_south);
+        free(g->y_south);
+        free(g->x_north);
+        free(g->y_north);
     }
-    {
-        int ncid;
-        int varid_x, varid_y;
-        size_t dimlen[2];
-        int ndims;
-
-        ncw_open(grdname_src, NC_NOWRITE, &ncid);
-        ncw_inq_varid(ncid, xname_src, &varid_x);
-        ncw_inq_varid(ncid, yname_src, &varid_y);
-        ncw_inq_varndims(ncid, varid_x, &ndims);
-        if (ndims == 2) {
-            gridtype = GRIDTYPE_CURV;
-            ncw_inq_vardims(ncid, varid_x, 2, NULL, dimlen);
-            if (dimlen[0] != dimlen_src[ndims_src - 2]
-                || dimlen[1] != dimlen_src[ndims_src - 1])
-                quit("%s,%s: dimensions of variable \"%s\" do not match grid dimensions of coordinate \"%s\"", fname_src, grdname_src, varname, xname_src);
-
-            ni_src = dimlen[1];
-            nj_src = dimlen[0];
-            nij_src = ni_src * nj_src;
-            xsrc = malloc(nij_src * sizeof(float));
-            ysrc = malloc(nij_src * sizeof(float));
-            ncu_readvarfloat(ncid, varid_x, nij_src, xsrc);
-            ncu_readvarfloat(ncid, varid_y, nij_src, ysrc);
-        } else if (ndims == 1) {
-            ncw_inq_vardims(ncid, varid_x, 1, NULL, &dimlen[1]);
-            ncw_inq_vardims(ncid, varid_y, 1, NULL, &dimlen[0]);
-            if (dimlen[1] == dimlen_src[ndims_src - 1]
-                && dimlen[0] == dimlen_src[ndims_src - 2]) {
-                int ii, j;
-
-                gridtype = GRIDTYPE_RECT;
-                ni_src = dimlen[1];
-                nj_src = dimlen[0];
-                nij_src = ni_src * nj_src;
-                xsrc = malloc(nij_src * sizeof(float));
-                ysrc = malloc(nij_src * sizeof(float));
-                ncu_readvarfloat(ncid, varid_x, ni_src, xsrc);
-                ncu_readvarfloat(ncid, varid_y, nj_src, ysrc);
-
-                for (ii = 0, j = 0; j < nj_src; ++j)
-                    for (i = 0; i < ni_src; ++i, ++ii)
-                        xsrc[ii] = xsrc[i];
-                for (ii = 0, j = 0; j < nj_src; ++j, ii += ni_src)
-                    ysrc[ii] = ysrc[j];
-                for (ii = 0, j = 0; j < nj_src; ++j)
-                    for (i = 0; i < ni_src; ++i, ++ii)
-                        ysrc[ii] = ysrc[j * ni_src];
-            } else if (dimlen[0] == dimlen_src[ndims_src - 1]
-                       && dimlen[1] == dimlen_src[ndims_src - 1]) {
-                gridtype = GRIDTYPE_VECT;
-                ni_src = dimlen[0];
-                nj_src = 0;
-                nij_src = dimlen[0];
-                xsrc = malloc(nij_src * sizeof(float));
-                ysrc = malloc(nij_src * sizeof(float));
-                ncu_readvarfloat(ncid, varid_x, nij_src, xsrc);
-                ncu_readvarfloat(ncid, varid_y, nij_src, ysrc);
-            } else {
-                quit("%s,%s: dimensions of variable \"%s\" do not match grid coordinate(s) \"%s\" or(and) \"%s\"", fname_src, grdname_src, varname, xname_src, yname_src);
-            }
-            if (nkname_src != NULL) {
-                int varid;
+    if (g->sinlon != NULL) {
+        free(g->sinlon);
+        free(g->coslon);
+        free(g->r_south);
+        free(g->r_north);
+    }
+    if (g->corners != NULL)
+        free(g->corners);
+}
 
-                ncw_inq_varid(ncid, nkname_src, &varid);
-                if (nj_src > 0) {
-                    size_t dimlen[2] = { nj_src, ni_src };
+/** Gets latitude of a grid node.
+ */
+static float grid_getlat(grid* g, size_t i)
+{
+    return (g->type == GRIDTYPE_RECT) ? g->lat[i / g->ni] : g->lat[i];
+}
 
-                    ncw_check_vardims(ncid, varid, 2, dimlen);
-                } else if (nj_src == 0) {
-                    size_t dimlen = ni_src;
+/** Gets coordinates of a grid node in a stereographic projection.
+ * @param g - grid
+ * @param i - node index
+ * @param north - 0 for the projection from the south pole (used for the
+ *                northern hemisphere), 1 for the projection from the north
+ *                pole
+ * @param x - X coordinate (output)
+ * @param y - Y coordinate (output)
+ */
+static void grid_getxy(grid* g, size_t i, int north, float* x, float* y)
+{
+    if (g->type == GRIDTYPE_RECT) {
+        size_t ii = i % g->ni;
+        float r = (north) ? g->r_north[i / g->ni] : g->r_south[i / g->ni];
+
+        *x = r * g->sinlon[ii];
+        *y = r * g->coslon[ii];
+    } else if (north) {
+        *x = g->x_north[i];
+        *y = g->y_north[i];
+    } else {
+        *x = g->x_south[i];
+        *y = g->y_south[i];
+    }
+}
 
-                    ncw_check_vardims(ncid, varid, 1, &dimlen);
-                } else
-                    quit("programming error");
-                nksrc = malloc(nij_src * sizeof(int));
-                ncw_get_var_int(ncid, varid, nksrc);
+/** Gets cartesian coordinates of a node of a structured grid. The nodes just
+ ** outside the grid (i = -1, ni or j = -1, nj) are extrapolated linearly (and
+ ** are not on the sphere). Requires longitudes and latitudes.
+ */
+static void grid_getxyz(grid* g, int i, int j, double xyz[3])
+{
+    int ni = g->ni;
+    int nj = g->nj;
+    double xyz0[3], xyz1[3];
+    int d;
+
+    if (i < 0 || i >= ni) {
+        grid_getxyz(g, (i < 0) ? 0 : ni - 1, j, xyz0);
+        grid_getxyz(g, (i < 0) ? 1 : ni - 2, j, xyz1);
+        for (d = 0; d < 3; ++d)
+            xyz[d] = 2.0 * xyz0[d] - xyz1[d];
+    } else if (j < 0 || j >= nj) {
+        grid_getxyz(g, i, (j < 0) ? 0 : nj - 1, xyz0);
+        grid_getxyz(g, i, (j < 0) ? 1 : nj - 2, xyz1);
+        for (d = 0; d < 3; ++d)
+            xyz[d] = 2.0 * xyz0[d] - xyz1[d];
+    } else {
+        size_t ij = (size_t) j * ni + i;
+        double ll[2];
+
+        ll[0] = (g->type == GRIDTYPE_RECT) ? g->lon[i] : g->lon[ij];
+        ll[1] = (g->type == GRIDTYPE_RECT) ? g->lat[j] : g->lat[ij];
+        ll2xyz(ll, xyz);
+    }
+}
+
+/** Calculates corners of the cells of a structured grid. The cells are
+ ** centred at the nodes; a corner is the normalised average of the four
+ ** surrounding nodes (extrapolated at the grid boundary). Requires longitudes
+ ** and latitudes.
+ */
+static void grid_setcorners(grid* g)
+{
+    size_t nic = g->ni + 1;
+    int j;
+
+    if (g->type == GRIDTYPE_VECT)
+        quit("conservative remapping requires structured grids");
+    if (g->ni < 2 || g->nj < 2)
+        quit("conservative remapping requires grids of at least 2 x 2 nodes");
+
+    g->corners = malloc(nic * (g->nj + 1) * 3 * sizeof(double));
+#if defined(_OPENMP)
+#pragma omp parallel for
+#endif
+    for (j = 0; j <= (int) g->nj; ++j) {
+        int i;
+
+        for (i = 0; i <= (int) g->ni; ++i) {
+            double* c = &g->corners[((size_t) j * nic + i) * 3];
+            int ii, jj, d;
+
+            c[0] = c[1] = c[2] = 0.0;
+            for (jj = j - 1; jj <= j; ++jj) {
+                for (ii = i - 1; ii <= i; ++ii) {
+                    double xyz[3];
+
+                    grid_getxyz(g, ii, jj, xyz);
+                    for (d = 0; d < 3; ++d)
+                        c[d] += xyz[d];
+                }
             }
+            normalise3(c);
         }
-        ncw_close(ncid);
     }
+}
 
-    if (verbose) {
-        printf("  dst = \"%s\"\n", fname_dst);
-        fflush(stdout);
-    }
-    /*
-     * dst grid
-     */
-    if (verbose) {
-        printf("  dst grid = \"%s\"\n", grdname_dst);
-        fflush(stdout);
+/** Gets corners of a grid cell (in order, either clockwise or anticlockwise).
+ * @return - 1 if all corners are finite, 0 otherwise
+ */
+static int grid_getcell(grid* g, size_t id, double p[4][3])
+{
+    size_t nic = g->ni + 1;
+    size_t i = id % g->ni;
+    size_t j = id / g->ni;
+    size_t cids[4] = { j * nic + i, j * nic + i + 1, (j + 1) * nic + i + 1, (j + 1) * nic + i };
+    int c, d;
+
+    for (c = 0; c < 4; ++c) {
+        for (d = 0; d < 3; ++d) {
+            p[c][d] = g->corners[cids[c] * 3 + d];
+            if (!isfinite(p[c][d]))
+                return 0;
+        }
     }
-    {
-        int ncid;
-        int varid_x, varid_y;
-        size_t dimlen[2];
-        int ndims;
-
-        ncw_open(grdname_dst, NC_NOWRITE, &ncid);
-        ncw_inq_varid(ncid, xname_dst, &varid_x);
-        ncw_inq_varid(ncid, yname_dst, &varid_y);
-        ncw_inq_varndims(ncid, varid_x, &ndims);
-        if (ndims == 2) {
-            ncw_inq_vardims(ncid, varid_x, 2, NULL, dimlen);
-            ni_dst = dimlen[1];
-            nj_dst = dimlen[0];
-            nij_dst = ni_dst * nj_dst;
-            xdst = malloc(nij_dst * sizeof(float));
-            ydst = malloc(nij_dst * sizeof(float));
-            ncu_readvarfloat(ncid, varid_x, nij_dst, xdst);
-            ncu_readvarfloat(ncid, varid_y, nij_dst, ydst);
-        } else if (ndims == 1) {
-            ncw_inq_vardims(ncid, varid_x, 1, NULL, &dimlen[1]);
-            ncw_inq_vardims(ncid, varid_y, 1, NULL, &dimlen[0]);
-            if (gridtype != GRIDTYPE_VECT) {
-                int ii, j;
-
-                ni_dst = dimlen[1];
-                nj_dst = dimlen[0];
-                nij_dst = ni_dst * nj_dst;
-                xdst = malloc(nij_dst * sizeof(float));
-                ydst = malloc(nij_dst * sizeof(float));
-                ncu_readvarfloat(ncid, varid_x, ni_dst, xdst);
-                ncu_readvarfloat(ncid, varid_y, nj_dst, ydst);
-
-                for (ii = 0, j = 0; j < nj_dst; ++j)
-                    for (i = 0; i < ni_dst; ++i, ++ii)
-                        xdst[ii] = xdst[i];
-                for (ii = 0, j = 0; j < nj_dst; ++j, ii += ni_dst)
-                    ydst[ii] = ydst[j];
-                for (ii = 0, j = 0; j < nj_dst; ++j)
-                    for (i = 0; i < ni_dst; ++i, ++ii)
-                        ydst[ii] = ydst[j * ni_dst];
-            } else if (gridtype == GRIDTYPE_VECT) {
-                if (dimlen[0] != dimlen[1])
-                    quit("source grid is unstructured; destination grid is not (coordinates \"%s\" and \"%s\" of different length)", xname_dst, yname_dst);
-                ni_dst = dimlen[0];
-                nj_dst = 0;
-                nij_dst = ni_dst;
-                xdst = malloc(nij_dst * sizeof(float));
-                ydst = malloc(nij_dst * sizeof(float));
-                ncu_readvarfloat(ncid, varid_x, nij_dst, xdst);
-                ncu_readvarfloat(ncid, varid_y, nij_dst, ydst);
+
+    return 1;
+}
+
+/** Calculates the distance along Hilbert curve of order HILBERT_ORDER for a
+ ** point in the square [-1, 1] x [-1, 1].
+ */
+static uint32_t hilbert_getindex(double x, double y)
+{
+    uint32_t n = 1u << HILBERT_ORDER;
+    uint32_t ix, iy, s, d = 0;
+
+    x = (x + 1.0) / 2.0 * n;
+    y = (y + 1.0) / 2.0 * n;
+    ix = (x <= 0.0) ? 0 : (x >= n - 1) ? n - 1 : (uint32_t) x;
+    iy = (y <= 0.0) ? 0 : (y >= n - 1) ? n - 1 : (uint32_t) y;
+    for (s = n / 2; s > 0; s /= 2) {
+        uint32_t rx = (ix & s) > 0;
+        uint32_t ry = (iy & s) > 0;
+
+        d += s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            uint32_t tmp;
+
+            if (rx == 1) {
+                ix = n - 1 - ix;
+                iy = n - 1 - iy;
             }
+            tmp = ix;
+            ix = iy;
+            iy = tmp;
         }
-        if (nkname_dst != NULL) {
-            int varid;
+    }
 
-            ncw_inq_varid(ncid, nkname_dst, &varid);
-            if (nj_dst > 0) {
-                size_t dimlen[2] = { nj_dst, ni_dst };
+    return d;
+}
 
-                ncw_check_vardims(ncid, varid, 2, dimlen);
-            } else if (nj_dst == 0) {
-                size_t dimlen = ni_dst;
+typedef struct {
+    uint64_t key;
+    int id;
+} nodekey;
 
-                ncw_check_vardims(ncid, varid, 1, &dimlen);
-            } else
-                quit("programming error");
-            nkdst = malloc(nij_dst * sizeof(int));
-            ncw_get_var_int(ncid, varid, nkdst);
-        }
-        ncw_close(ncid);
-    }
+/**
+ */
+static int cmp_nodekey(const void* p1, const void* p2)
+{
+    const nodekey* n1 = p1;
+    const nodekey* n2 = p2;
+
+    if (n1->key > n2->key)
+        return 1;
+    if (n1->key < n2->key)
+        return -1;
+    return (n1->id > n2->id) - (n1->id < n2->id);
+}
 
-    strcpy(fname_dst_tmp, fname_dst);
-    strcat(fname_dst_tmp, ".tmp");
-    ncw_create(fname_dst_tmp, NC_CLOBBER | NC_NETCDF4, &ncid_dst);
-    /*
-     * copy global attributes to destination
-     */
-    ncw_copy_atts(ncid_src, NC_GLOBAL, ncid_dst, NC_GLOBAL);
-    /*
-     * copy command line and wdir to dst
-     */
-    {
-        char* cmd = get_command(argc, argv);
-        char attname[NC_MAX_NAME];
-        char cwd[MAXSTRLEN];
+/** Sorts the destination grid nodes along Hilbert curve in the projection
+ ** used for each node (the northern hemisphere first), so that consecutive
+ ** point locations start close to the previously found triangle. Requires
+ ** latitudes.
+ */
+static void grid_sort(grid* g)
+{
+    nodekey* keys = malloc(g->n * sizeof(nodekey));
+    size_t i;
 
-        snprintf(attname, NC_MAX_NAME, "%s: command", PROGRAM_NAME);
-        ncw_put_att_text(ncid_dst, NC_GLOBAL, attname, cmd);
-        free(cmd);
-        if (getcwd(cwd, MAXSTRLEN) != NULL) {
-            snprintf(attname, NC_MAX_NAME, "%s: wdir", PROGRAM_NAME);
-            ncw_put_att_text(ncid_dst, NC_GLOBAL, attname, cwd);
-        }
+#if defined(_OPENMP)
+#pragma omp parallel for
+#endif
+    for (i = 0; i < g->n; ++i) {
+        /*
+         * (nodes of a hemisphere are within the unit circle)
+         */
+        int north = !(grid_getlat(g, i) > 0.0);
+        float x, y;
+
+        grid_getxy(g, i, north, &x, &y);
+        keys[i].key = ((uint64_t) north << 32) + hilbert_getindex(x, y);
+        keys[i].id = i;
     }
-    /*
-     * define dimensions
-     */
-    for (i = 0; i < ndims_src; ++i) {
-        char dimname[NC_MAX_NAME];
-
-        ncw_inq_dimname(ncid_src, dimids_src[i], dimname);
-        if (ndims_src - i == 1)
-            dimlen_dst[i] = ni_dst;
-        else if (ndims_src - i == 2)
-            dimlen_dst[i] = nj_dst;
-        else if (dimids_src[i] == unlimdimid_src)
-            dimlen_dst[i] = 1;
+    qsort(keys, g->n, sizeof(nodekey), cmp_nodekey);
+    g->order = malloc(g->n * sizeof(int));
+    for (i = 0; i < g->n; ++i)
+        g->order[i] = keys[i].id;
+    free(keys);
+}
+
+/** Sets mask of valid source nodes for a layer.
+ * @param g - source grid
+ * @param k - layer
+ * @param skipfirstlast - flag: do not use the first and last columns
+ * @param v - source values (NULL if not involved)
+ * @param mask - mask (output)
+ * @return - number of valid nodes
+ */
+static int getmask(grid* g, int k, int skipfirstlast, float v[], unsigned char mask[])
+{
+    size_t i;
+    int n = 0;
+
+#if defined(_OPENMP)
+#pragma omp parallel for reduction(+:n)
+#endif
+    for (i = 0; i < g->n; ++i) {
+        if ((skipfirstlast && (i % g->ni == 0 || i % g->ni == g->ni - 1)) || (g->nk != NULL && k >= g->nk[i]) || (v != NULL && !isfinite(v[i])))
+            mask[i] = 0;
         else {
-            nk = dimlen_src[i];
-            dimlen_dst[i] = dimlen_src[i];
+            mask[i] = 1;
+            n++;
         }
-        ncw_def_dim(ncid_dst, dimname, dimlen_dst[i], &dimids_dst[i]);
-    }
-    if (verbose) {
-        printf("    size = ");
-        for (i = 0; i < ndims_src; ++i)
-            printf("%zu%s", dimlen_dst[i], i < ndims_src - 1 ? " x " : "\n");
-        fflush(stdout);
     }
-    /*
-     * define the variable
-     */
-    ncw_def_var(ncid_dst, varname, nctype, ndims_src, dimids_dst, &varid_dst);
-    ncw_copy_atts(ncid_src, varid_src, ncid_dst, varid_dst);
 
-    if (deflate > 0)
-        ncw_def_deflate(ncid_dst, 0, 1, deflate);
-
-    ncw_close(ncid_dst);
-    ncw_close(ncid_src);
+    return n;
+}
 
-    if (verbose) {
-        printf("  converting src lon/lat to stereographic projections:");
-        fflush(stdout);
-    }
-    xsrc_south = malloc(nij_src * sizeof(float));
-    ysrc_south = malloc(nij_src * sizeof(float));
-    xsrc_north = malloc(nij_src * sizeof(float));
-    ysrc_north = malloc(nij_src * sizeof(float));
-    for (i = 0; i < nij_src; ++i) {
-        double ll[2] = { xsrc[i], -ysrc[i] };
-        double xyz[3];
+/**
+ */
+static stencil* stencil_create(size_t n, size_t nnz_max)
+{
+    stencil* st = malloc(sizeof(stencil));
 
-        ll2xyz(ll, xyz);
-        xsrc_south[i] = xyz[0] / (1.0 - xyz[2]);
-        ysrc_south[i] = xyz[1] / (1.0 - xyz[2]);
+    st->n = n;
+    st->nnz = 0;
+    st->rowstart = calloc(n + 1, sizeof(size_t));
+    st->ids = (nnz_max > 0) ? malloc(nnz_max * sizeof(int)) : NULL;
+    st->w = (nnz_max > 0) ? malloc(nnz_max * sizeof(double)) : NULL;
+    st->k = 0;
 
-        ll[1] = ysrc[i];
-        ll2xyz(ll, xyz);
-        xsrc_north[i] = xyz[0] / (1.0 - xyz[2]);
-        ysrc_north[i] = xyz[1] / (1.0 - xyz[2]);
-    }
-    free(xsrc);
-    free(ysrc);
-    if (verbose) {
-        printf("\n");
-        fflush(stdout);
-    }
+    return st;
+}
 
-    if (verbose) {
-        printf("  converting dst lon/lat to stereographic projections:");
-        fflush(stdout);
+/**
+ */
+static void stencil_destroy(stencil* st)
+{
+    free(st->rowstart);
+    if (st->ids != NULL) {
+        free(st->ids);
+        free(st->w);
     }
-    xdst_south = malloc(nij_dst * sizeof(float));
-    ydst_south = malloc(nij_dst * sizeof(float));
-    xdst_north = malloc(nij_dst * sizeof(float));
-    ydst_north = malloc(nij_dst * sizeof(float));
-    for (i = 0; i < nij_dst; ++i) {
-        double ll[2] = { xdst[i], -ydst[i] };
-        double xyz[3];
-
-        ll2xyz(ll, xyz);
-        xdst_south[i] = xyz[0] / (1.0 - xyz[2]);
-        ydst_south[i] = xyz[1] / (1.0 - xyz[2]);
+    free(st);
+}
 
-        ll[1] = ydst[i];
-        ll2xyz(ll, xyz);
-        xdst_north[i] = xyz[0] / (1.0 - xyz[2]);
-        ydst_north[i] = xyz[1] / (1.0 - xyz[2]);
-    }
-    free(xdst);
-    if (verbose) {
-        printf("\n");
-        fflush(stdout);
-    }
+/** Triangulates valid source nodes in one of the projections. Only nodes
+ ** within distance g->rmax from the centre of the projection are used.
+ * @param g - source grid
+ * @param north - projection (see grid_getxy())
+ * @param mask - mask of valid nodes
+ * @param ids - source indices of the triangulation nodes (output, allocated
+ *              here)
+ * @param points - triangulation nodes (output, allocated here; used by the
+ *                 triangulation and to be freed after it is destroyed)
+ * @return - triangulation (NULL if there are fewer than 3 nodes, e.g. for a
+ *           regional source grid or a narrow band with "-e")
+ */
+static delaunay* triangulate(grid* g, int north, unsigned char mask[], int** ids, point** points)
+{
+    int have_polar = 0;
+    int npoint = 0;
+    size_t i;
 
-    if (verbose) {
-        printf("  interpolating:");
-        fflush(stdout);
-    }
+    for (i = 0; i < g->n; ++i) {
+        float x, y;
 
-    vsrc = malloc(nij_src * sizeof(float));
-    vdst = calloc(nij_dst, sizeof(float));
-    if (nk > 1 && propagatedown) {
-        vdst_last = malloc(nij_dst * sizeof(float));
-        for (i = 0; i < nij_dst; ++i)
-            vdst_last[i] = NAN;
+        if (!mask[i])
+            continue;
+        grid_getxy(g, i, north, &x, &y);
+        if (isfinite(x) && isfinite(y) && hypot(x, y) <= g->rmax)
+            npoint++;
     }
+    *points = malloc(npoint * sizeof(point));
+    *ids = malloc(npoint * sizeof(int));
 
-    if (nk == 0)
-        nk = 1;
-
-    points_south = malloc(nij_src * sizeof(point));
-    points_north = malloc(nij_src * sizeof(point));
-    for (k = 0; k < nk; ++k) {
-        int npoint = 0, npoint_south = 0, npoint_north = 0;
-        int have_polar_south = 0, have_polar_north = 0;
+    for (i = 0, npoint = 0; i < g->n; ++i) {
+        float x, y;
 
+        if (!mask[i])
+            continue;
+        grid_getxy(g, i, north, &x, &y);
+        if (!isfinite(x) || !isfinite(y) || hypot(x, y) > g->rmax)
+            continue;
         /*
-         * stats
+         * allow only one node in the tiny circle around the pole
          */
-        int npoint_dst = 0;
-        int npoint_filled = 0;
-
-        ncu_readfield(fname_src, varname, k, ni_src, nj_src, nk, vsrc);
-        for (i = 0; i < nij_src; ++i) {
-            point* p;
-
-            /*
-             * do not use the first and last columns
-             */
-            if (skipfirstlast && (i % ni_src == 0 || i % ni_src == ni_src - 1))
+        if (hypot(x, y) < POLAR_EPS) {
+            if (have_polar)
                 continue;
+            else
+                have_polar = 1;
+        }
+        (*points)[npoint].x = x;
+        (*points)[npoint].y = y;
+        (*points)[npoint].z = 0.0;
+        (*ids)[npoint] = i;
+        npoint++;
+    }
+    if (npoint < 3)
+        return NULL;
 
-            if (nksrc != NULL && k >= nksrc[i])
-                continue;
-            if (!isfinite(vsrc[i]))
-                continue;
+    return delaunay_build(npoint, *points, 0, NULL, 0, NULL);
+}
 
-            if (isfinite(xsrc_south[i]) && isfinite(ysrc_south[i])) {
-                if (hypot(xsrc_south[i], ysrc_south[i]) < POLAR_EPS) {
-                    if (have_polar_south)
-                        goto skip_south;
-                    else
-                        have_polar_south = 1;
-                }
-                p = &points_south[npoint];
-                p->x = xsrc_south[i];
-                p->y = ysrc_south[i];
-                p->z = vsrc[i];
-                npoint_south++;
-            }
-          skip_south:
-            if (isfinite(xsrc_north[i]) && isfinite(ysrc_north[i])) {
-                if (hypot(xsrc_north[i], ysrc_north[i]) < POLAR_EPS) {
-                    if (have_polar_north)
-                        goto skip_north;
-                    else
-                        have_polar_north = 1;
-                }
-                p = &points_north[npoint];
-                p->x = xsrc_north[i];
-                p->y = ysrc_north[i];
-                p->z = vsrc[i];
-                npoint_north++;
-            }
-          skip_north:
-            npoint++;
+/** Calculates interpolation weights for a destination node.
+ * @param d - triangulation (NULL if none)
+ * @param ids - source indices of the triangulation nodes
+ * @param p - destination node in the projection
+ * @param seed - triangle to start the search from (input/output)
+ * @param ids_row - source nodes (output)
+ * @param w_row - weights (output)
+ * @return - 3 if the node is interpolated, 0 otherwise
+ */
+static int stencil_getrow(delaunay* d, int ids[], point* p, int* seed, int ids_row[3], double w_row[3])
+{
+    int* vids;
+    point* p0;
+    point* p1;
+    point* p2;
+    double denom;
+    int tid;
+
+    if (d == NULL || d->ntriangles == 0 || !isfinite(p->x) || !isfinite(p->y))
+        return 0;
+    tid = delaunay_xytoi(d, p, *seed);
+    if (tid < 0)
+        return 0;
+    *seed = tid;
+
+    vids = d->triangles[tid].vids;
+    p0 = &d->points[vids[0]];
+    p1 = &d->points[vids[1]];
+    p2 = &d->points[vids[2]];
+    denom = (p1->y - p2->y) * (p0->x - p2->x) + (p2->x - p1->x) * (p0->y - p2->y);
+    if (denom == 0.0)
+        return 0;
+    w_row[0] = ((p1->y - p2->y) * (p->x - p2->x) + (p2->x - p1->x) * (p->y - p2->y)) / denom;
+    w_row[1] = ((p2->y - p0->y) * (p->x - p2->x) + (p0->x - p2->x) * (p->y - p2->y)) / denom;
+    w_row[2] = 1.0 - w_row[0] - w_row[1];
+    ids_row[0] = ids[vids[0]];
+    ids_row[1] = ids[vids[1]];
+    ids_row[2] = ids[vids[2]];
+
+    return 3;
+}
+
+/** Builds interpolation stencil for a given mask of valid source nodes.
+ ** Destination nodes are processed in the order of gdst->order (if set) in
+ ** chunks of fixed size (in parallel, if compiled with OpenMP); the search in
+ ** each chunk starts from the same triangle, so that the result does not
+ ** depend on the number of threads.
+ * @param gsrc - source grid
+ * @param gdst - destination grid
+ * @param mask - mask of valid source nodes
+ * @param k - layer (defines valid destination nodes)
+ * @return - stencil
+ */
+static stencil* stencil_build(grid* gsrc, grid* gdst, unsigned char mask[], int k)
+{
+    stencil* st = stencil_create(gdst->n, gdst->n * 3);
+    int* ids_south = NULL;
+    int* ids_north = NULL;
+    point* points_south = NULL;
+    point* points_north = NULL;
+    double tp = prof_start();
+    double t0 = get_walltime();
+    delaunay* d_south = triangulate(gsrc, 0, mask, &ids_south, &points_south);
+    delaunay* d_north = triangulate(gsrc, 1, mask, &ids_north, &points_north);
+    double t1 = get_walltime();
+    unsigned char* nrow = calloc(gdst->n, 1);
+    int nchunk = (gdst->n + NPOINT_CHUNK - 1) / NPOINT_CHUNK;
+    int c;
+    size_t i, nnz, nlocated_now = 0;
+
+    prof_stop(PROF_TRIANGULATE, tp, 0);
+    tp = prof_start();
+    st->k = k;
+#if defined(_OPENMP)
+#pragma omp parallel for schedule(dynamic) reduction(+:nlocated_now)
+#endif
+    for (c = 0; c < nchunk; ++c) {
+        size_t i0 = (size_t) c * NPOINT_CHUNK;
+        size_t i1 = (i0 + NPOINT_CHUNK < gdst->n) ? i0 + NPOINT_CHUNK : gdst->n;
+        int seed_south = 0, seed_north = 0;
+        size_t iii;
+
+        for (iii = i0; iii < i1; ++iii) {
+            size_t ii = (gdst->order != NULL) ? (size_t) gdst->order[iii] : iii;
+            point p;
+            float x, y;
+
+            if (gdst->nk != NULL && k >= gdst->nk[ii])
+                continue;
+            nlocated_now++;
+            if (grid_getlat(gdst, ii) > 0.0) {
+                grid_getxy(gdst, ii, 0, &x, &y);
+                p.x = x;
+                p.y = y;
+                nrow[ii] = stencil_getrow(d_south, ids_south, &p, &seed_south, &st->ids[ii * 3], &st->w[ii * 3]);
+            } else {
+                grid_getxy(gdst, ii, 1, &x, &y);
+                p.x = x;
+                p.y = y;
+                nrow[ii] = stencil_getrow(d_north, ids_north, &p, &seed_north, &st->ids[ii * 3], &st->w[ii * 3]);
+            }
+        }
+    }
+    /*
+     * compact
+     */
+    for (i = 0, nnz = 0; i < gdst->n; ++i) {
+        int j;
+
+        st->rowstart[i] = nnz;
+        for (j = 0; j < nrow[i]; ++j, ++nnz) {
+            st->ids[nnz] = st->ids[i * 3 + j];
+            st->w[nnz] = st->w[i * 3 + j];
         }
+    }
+    st->rowstart[gdst->n] = nnz;
+    st->nnz = nnz;
+    prof_stop(PROF_COMPUTE, tp, 0);
+    time_triangulate += t1 - t0;
+    time_locate += get_walltime() - t1;
+    nlocated += nlocated_now;
+
+    if (d_south != NULL)
+        delaunay_destroy(d_south);
+    if (d_north != NULL)
+        delaunay_destroy(d_north);
+    free(points_south);
+    free(points_north);
+    free(ids_south);
+    free(ids_north);
+    free(nrow);
+
+    return st;
+}
 
-        if (!nanfill)
-            memset(vdst, 0, nij_dst * sizeof(float));
+/** Calculates centre, size (the maximal chord from the centre to a corner)
+ ** and bounding box of a grid cell. The box is padded to contain the arcs
+ ** between the corners.
+ * @param p - corners
+ * @param centre - centre (output)
+ * @param r - size (output)
+ * @param box - {xmin, xmax, ymin, ymax, zmin, zmax} (output)
+ * @return - 1 on success, 0 if the cell is degenerate or too large
+ */
+static int cell_getbox(double p[4][3], double centre[3], double* r, double box[6])
+{
+    double pad;
+    int c, d;
+
+    centre[0] = centre[1] = centre[2] = 0.0;
+    for (c = 0; c < 4; ++c)
+        for (d = 0; d < 3; ++d)
+            centre[d] += p[c][d];
+    normalise3(centre);
+    *r = 0.0;
+    for (c = 0; c < 4; ++c) {
+        double dist = sqrt((p[c][0] - centre[0]) * (p[c][0] - centre[0]) + (p[c][1] - centre[1]) * (p[c][1] - centre[1]) + (p[c][2] - centre[2]) * (p[c][2] - centre[2]));
+
+        if (dist > *r || !isfinite(dist))
+            *r = dist;
+    }
+    if (!(*r < CELL_RMAX))
+        return 0;
+
+    /*
+     * (the sagitta of a chord of length 2r)
+     */
+    pad = *r * *r / 2.0;
+    for (d = 0; d < 3; ++d) {
+        box[d * 2] = p[0][d];
+        box[d * 2 + 1] = p[0][d];
+        for (c = 1; c < 4; ++c) {
+            if (p[c][d] < box[d * 2])
+                box[d * 2] = p[c][d];
+            if (p[c][d] > box[d * 2 + 1])
+                box[d * 2 + 1] = p[c][d];
+        }
+        box[d * 2] -= pad;
+        box[d * 2 + 1] += pad;
+    }
+
+    return 1;
+}
+
+/** Gets index of the box containing a coordinate (in a uniform grid of `nb'
+ ** boxes of size `h' covering [-1, 1]).
+ */
+static int box_getindex(double x, double h, int nb)
+{
+    double b = floor((x + 1.0) / h);
+
+    return (b < 0.0) ? 0 : (b >= nb) ? nb - 1 : (int) b;
+}
+
+/** Finds the first entry with a given key in an array sorted by key.
+ * @return - index of the entry (n if not found)
+ */
+static size_t nodekey_find(size_t n, nodekey keys[], uint64_t key)
+{
+    size_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (keys[mid].key < key)
+            lo = mid + 1;
         else
-            for (i = 0; i < nij_dst; ++i)
-                vdst[i] = NAN;
-        if (npoint == 0)
-            goto finalise_level;
+            hi = mid;
+    }
 
-        {
-            delaunay* d_south = delaunay_build(npoint_south, points_south, 0, NULL, 0, NULL);
-            delaunay* d_north = delaunay_build(npoint_north, points_north, 0, NULL, 0, NULL);
-            void* interp_south = lpi_build(d_south);
-            void* interp_north = lpi_build(d_north);
-
-            for (i = 0; i < nij_dst; ++i) {
-                point p;
-
-                if (ydst[i] > 0.0) {
-                    p.x = xdst_south[i];
-                    p.y = ydst_south[i];
-                } else {
-                    p.x = xdst_north[i];
-                    p.y = ydst_north[i];
-                }
+    return (lo < n && keys[lo].key == key) ? lo : n;
+}
+
+/** Sets up the gnomonic projection centred at a given point (the projection
+ ** of great circle arcs are straight lines).
+ * @param centre - centre of the projection
+ * @param e1 - first base vector of the tangent plane (output)
+ * @param e2 - second base vector of the tangent plane (output)
+ */
+static void gnomonic_init(double centre[3], double e1[3], double e2[3])
+{
+    double axis[3] = { 0.0, 0.0, 1.0 };
+
+    if (fabs(centre[2]) > 0.9) {
+        axis[0] = 1.0;
+        axis[2] = 0.0;
+    }
+    cross3(axis, centre, e1);
+    normalise3(e1);
+    cross3(centre, e1, e2);
+}
+
+/**
+ */
+static void gnomonic_fwd(double centre[3], double e1[3], double e2[3], double p[3], double xy[2])
+{
+    double dp = dot3(p, centre);
+
+    xy[0] = dot3(p, e1) / dp;
+    xy[1] = dot3(p, e2) / dp;
+}
+
+/**
+ */
+static void gnomonic_inv(double centre[3], double e1[3], double e2[3], double xy[2], double p[3])
+{
+    int d;
+
+    for (d = 0; d < 3; ++d)
+        p[d] = centre[d] + xy[0] * e1[d] + xy[1] * e2[d];
+    normalise3(p);
+}
+
+/** Clips a polygon by a convex anticlockwise polygon (Sutherland-Hodgman).
+ * @param n - number of vertices of the polygon to be clipped
+ * @param xy - vertices of the polygon to be clipped (input/output, up to
+ *             NPOLY_MAX)
+ * @param nc - number of vertices of the clipping polygon
+ * @param xyc - vertices of the clipping polygon
+ * @return - number of vertices of the clipped polygon
+ */
+static int polygon_clip(int n, double xy[][2], int nc, double xyc[][2])
+{
+    double tmp[NPOLY_MAX][2];
+    int e;
+
+    for (e = 0; e < nc && n > 0; ++e) {
+        double* a = xyc[e];
+        double* b = xyc[(e + 1) % nc];
+        double ex = b[0] - a[0];
+        double ey = b[1] - a[1];
+        int nn = 0, v;
+
+        if (ex == 0.0 && ey == 0.0)
+            continue;
+        for (v = 0; v < n; ++v) {
+            double* p = xy[v];
+            double* q = xy[(v + 1) % n];
+            double sp = ex * (p[1] - a[1]) - ey * (p[0] - a[0]);
+            double sq = ex * (q[1] - a[1]) - ey * (q[0] - a[0]);
+
+            if (nn > NPOLY_MAX - 2)
+                return 0;
+            if (sp >= 0.0) {
+                tmp[nn][0] = p[0];
+                tmp[nn][1] = p[1];
+                nn++;
+            }
+            if ((sp >= 0.0) != (sq >= 0.0)) {
+                double t = sp / (sp - sq);
+
+                tmp[nn][0] = p[0] + t * (q[0] - p[0]);
+                tmp[nn][1] = p[1] + t * (q[1] - p[1]);
+                nn++;
+            }
+        }
+        memcpy(xy, tmp, nn * sizeof(tmp[0]));
+        n = nn;
+    }
+
+    return n;
+}
+
+/** Calculates area on the unit sphere of a convex polygon given in gnomonic
+ ** projection (as a fan of spherical triangles).
+ */
+static double polygon_area(double centre[3], double e1[3], double e2[3], int n, double xy[][2])
+{
+    double p0[3], p1[3], p2[3];
+    double area = 0.0;
+    int v;
+
+    if (n < 3)
+        return 0.0;
+    gnomonic_inv(centre, e1, e2, xy[0], p0);
+    gnomonic_inv(centre, e1, e2, xy[1], p1);
+    for (v = 2; v < n; ++v) {
+        double cr[3];
+
+        gnomonic_inv(centre, e1, e2, xy[v], p2);
+        cross3(p1, p2, cr);
+        area += 2.0 * atan2(dot3(p0, cr), 1.0 + dot3(p0, p1) + dot3(p1, p2) + dot3(p2, p0));
+        memcpy(p1, p2, sizeof(p1));
+    }
+
+    return fabs(area);
+}
 
-                if (nkdst == NULL || k < nkdst[i]) {
-                    npoint_dst++;
-                    if (ydst[i] > 0.0)
-                        lpi_interpolate_point(interp_south, &p);
-                    else
-                        lpi_interpolate_point(interp_north, &p);
-
-                    if (isfinite(p.z)) {
-                        vdst[i] = (float) p.z;
-                        if (vdst_last != NULL)
-                            vdst_last[i] = (float) p.z;
-                    } else {
-                        npoint_filled_tot++;
-                        npoint_filled++;
-                        if (vdst_last != NULL && isfinite(vdst_last[i]))
-                            vdst[i] = vdst_last[i];
+/**
+ */
+static int cmp_int(const void* p1, const void* p2)
+{
+    int i1 = *(const int*) p1;
+    int i2 = *(const int*) p2;
+
+    return (i1 > i2) - (i1 < i2);
+}
+
+/** Calculates overlaps of source and destination cells on sphere. For each
+ ** destination cell the matrix contains the overlapping source cells and the
+ ** fractions of the destination cell area they cover. The source cells are
+ ** binned into a uniform grid of cubic boxes; the destination cells are
+ ** processed in chunks of fixed size (in parallel, if compiled with OpenMP),
+ ** so that the result does not depend on the number of threads.
+ * @param gsrc - source grid (with corners)
+ * @param gdst - destination grid (with corners)
+ * @return - overlap matrix
+ */
+static stencil* overlaps_build(grid* gsrc, grid* gdst)
+{
+    double tp = prof_start();
+    double t0 = get_walltime();
+    int nchunk = (gdst->n + NPOINT_CHUNK - 1) / NPOINT_CHUNK;
+    size_t* chunk_nnz = calloc(nchunk, sizeof(size_t));
+    int** chunk_ids = calloc(nchunk, sizeof(int*));
+    double** chunk_w = calloc(nchunk, sizeof(double*));
+    size_t* rowlen = calloc(gdst->n, sizeof(size_t));
+    double rsum = 0.0, h;
+    size_t nvalid = 0, nkey = 0;
+    nodekey* keys;
+    stencil* ov;
+    int nb, pass, c;
+    size_t i, nnz;
+
+    /*
+     * box size: four times the mean size of the source cells, so that most
+     * cells fall into one or two boxes in each direction
+     */
+    for (i = 0; i < gsrc->n; ++i) {
+        double p[4][3], centre[3], box[6], r;
+
+        if (grid_getcell(gsrc, i, p) && cell_getbox(p, centre, &r, box)) {
+            rsum += r;
+            nvalid++;
+        }
+    }
+    if (nvalid == 0)
+        quit("conservative remapping: no valid source cells");
+    h = 4.0 * rsum / nvalid;
+    nb = (h > 2.0 / NBOX_MAX) ? (int) ceil(2.0 / h) : NBOX_MAX;
+    h = 2.0 / nb;
+
+    /*
+     * bin the source cells (count in the first pass, fill in the second)
+     */
+    keys = NULL;
+    for (pass = 0; pass < 2; ++pass) {
+        if (pass == 1)
+            keys = malloc(nkey * sizeof(nodekey));
+        nkey = 0;
+        for (i = 0; i < gsrc->n; ++i) {
+            double p[4][3], centre[3], box[6], r;
+            int bx, by, bz;
+
+            if (!grid_getcell(gsrc, i, p) || !cell_getbox(p, centre, &r, box))
+                continue;
+            for (bx = box_getindex(box[0], h, nb); bx <= box_getindex(box[1], h, nb); ++bx)
+                for (by = box_getindex(box[2], h, nb); by <= box_getindex(box[3], h, nb); ++by)
+                    for (bz = box_getindex(box[4], h, nb); bz <= box_getindex(box[5], h, nb); ++bz, ++nkey) {
+                        if (pass == 0)
+                            continue;
+                        keys[nkey].key = ((uint64_t) bx * nb + by) * nb + bz;
+                        keys[nkey].id = i;
+                    }
+        }
+    }
+    qsort(keys, nkey, sizeof(nodekey), cmp_nodekey);
+
+#if defined(_OPENMP)
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (c = 0; c < nchunk; ++c) {
+        size_t i0 = (size_t) c * NPOINT_CHUNK;
+        size_t i1 = (i0 + NPOINT_CHUNK < gdst->n) ? i0 + NPOINT_CHUNK : gdst->n;
+        int* cand = NULL;
+        int ncand_max = 0;
+        size_t ii;
+
+        for (ii = i0; ii < i1; ++ii) {
+            double pd[4][3], centre[3], e1[3], e2[3], box[6], rd;
+            double xyd[4][2];
+            double area_dst;
+            int ncand = 0;
+            int bx, by, bz, v;
+
+            if (!grid_getcell(gdst, ii, pd) || !cell_getbox(pd, centre, &rd, box))
+                continue;
+            gnomonic_init(centre, e1, e2);
+            for (v = 0; v < 4; ++v)
+                gnomonic_fwd(centre, e1, e2, pd[v], xyd[v]);
+            /*
+             * make the destination cell anticlockwise
+             */
+            if ((xyd[2][0] - xyd[0][0]) * (xyd[3][1] - xyd[1][1]) - (xyd[2][1] - xyd[0][1]) * (xyd[3][0] - xyd[1][0]) < 0.0) {
+                double tmp[2] = { xyd[1][0], xyd[1][1] };
+
+                xyd[1][0] = xyd[3][0];
+                xyd[1][1] = xyd[3][1];
+                xyd[3][0] = tmp[0];
+                xyd[3][1] = tmp[1];
+            }
+            area_dst = polygon_area(centre, e1, e2, 4, xyd);
+            if (!(area_dst > 0.0))
+                continue;
+
+            /*
+             * candidates: source cells in the boxes overlapping the bounding
+             * box of the destination cell
+             */
+            for (bx = box_getindex(box[0], h, nb); bx <= box_getindex(box[1], h, nb); ++bx) {
+                for (by = box_getindex(box[2], h, nb); by <= box_getindex(box[3], h, nb); ++by) {
+                    for (bz = box_getindex(box[4], h, nb); bz <= box_getindex(box[5], h, nb); ++bz) {
+                        uint64_t key = ((uint64_t) bx * nb + by) * nb + bz;
+                        size_t kk;
+
+                        for (kk = nodekey_find(nkey, keys, key); kk < nkey && keys[kk].key == key; ++kk) {
+                            if (ncand == ncand_max) {
+                                ncand_max += NCAND_INC;
+                                cand = realloc(cand, ncand_max * sizeof(int));
+                            }
+                            cand[ncand++] = keys[kk].id;
+                        }
                     }
                 }
             }
-            lpi_destroy(interp_south);
-            delaunay_destroy(d_south);
-            lpi_destroy(interp_north);
-            delaunay_destroy(d_north);
+            qsort(cand, ncand, sizeof(int), cmp_int);
+
+            for (v = 0; v < ncand; ++v) {
+                double ps[4][3], centre_s[3], box_s[6], rs;
+                double xy[NPOLY_MAX][2];
+                double f;
+                int n, d;
+
+                if (v > 0 && cand[v] == cand[v - 1])
+                    continue;
+                (void) grid_getcell(gsrc, cand[v], ps);
+                (void) cell_getbox(ps, centre_s, &rs, box_s);
+                for (d = 0; d < 3; ++d)
+                    centre_s[d] -= centre[d];
+                if (sqrt(dot3(centre_s, centre_s)) > rs + rd)
+                    continue;
+                for (n = 0; n < 4; ++n) {
+                    if (dot3(ps[n], centre) <= 0.0)
+                        break;
+                    gnomonic_fwd(centre, e1, e2, ps[n], xy[n]);
+                }
+                if (n < 4)
+                    continue;
+                n = polygon_clip(4, xy, 4, xyd);
+                f = polygon_area(centre, e1, e2, n, xy) / area_dst;
+                if (!(f > OVERLAP_EPS))
+                    continue;
+                if (chunk_nnz[c] % NOVERLAP_INC == 0) {
+                    chunk_ids[c] = realloc(chunk_ids[c], (chunk_nnz[c] + NOVERLAP_INC) * sizeof(int));
+                    chunk_w[c] = realloc(chunk_w[c], (chunk_nnz[c] + NOVERLAP_INC) * sizeof(double));
+                }
+                chunk_ids[c][chunk_nnz[c]] = cand[v];
+                chunk_w[c][chunk_nnz[c]] = f;
+                chunk_nnz[c]++;
+                rowlen[ii]++;
+            }
+        }
+        if (cand != NULL)
+            free(cand);
+    }
+
+    for (c = 0, nnz = 0; c < nchunk; ++c)
+        nnz += chunk_nnz[c];
+    ov = stencil_create(gdst->n, nnz);
+    ov->nnz = nnz;
+    for (i = 0; i < gdst->n; ++i)
+        ov->rowstart[i + 1] = ov->rowstart[i] + rowlen[i];
+    for (c = 0, nnz = 0; c < nchunk; ++c) {
+        if (chunk_nnz[c] == 0)
+            continue;
+        memcpy(&ov->ids[nnz], chunk_ids[c], chunk_nnz[c] * sizeof(int));
+        memcpy(&ov->w[nnz], chunk_w[c], chunk_nnz[c] * sizeof(double));
+        nnz += chunk_nnz[c];
+        free(chunk_ids[c]);
+        free(chunk_w[c]);
+    }
+    prof_stop(PROF_COMPUTE, tp, 0);
+    time_overlap += get_walltime() - t0;
+    noverlap += ov->nnz;
+
+    free(keys);
+    free(chunk_nnz);
+    free(chunk_ids);
+    free(chunk_w);
+    free(rowlen);
+
+    return ov;
+}
+
+/** Builds conservative remapping stencil for a given mask of valid source
+ ** nodes from the overlap matrix. The weights in each row are normalised by
+ ** the total overlap with valid source cells, so that a destination cell
+ ** partially covered by valid source cells gets their area-weighted average.
+ * @param ov - overlap matrix
+ * @param gdst - destination grid
+ * @param mask - mask of valid source nodes
+ * @param k - layer (defines valid destination nodes)
+ * @return - stencil
+ */
+static stencil* stencil_conservative(stencil* ov, grid* gdst, unsigned char mask[], int k)
+{
+    stencil* st = stencil_create(ov->n, ov->nnz);
+    double tp = prof_start();
+    size_t i, ii, nnz = 0;
+
+    st->k = k;
+    for (i = 0; i < ov->n; ++i) {
+        size_t start = nnz;
+        double sum = 0.0;
+
+        st->rowstart[i] = nnz;
+        if (gdst->nk != NULL && k >= gdst->nk[i])
+            continue;
+        for (ii = ov->rowstart[i]; ii < ov->rowstart[i + 1]; ++ii) {
+            if (!mask[ov->ids[ii]])
+                continue;
+            st->ids[nnz] = ov->ids[ii];
+            st->w[nnz] = ov->w[ii];
+            sum += ov->w[ii];
+            nnz++;
         }
+        for (ii = start; ii < nnz; ++ii)
+            st->w[ii] /= sum;
+    }
+    st->rowstart[ov->n] = nnz;
+    st->nnz = nnz;
+    prof_stop(PROF_COMPUTE, tp, 0);
+
+    return st;
+}
+
+/** Applies interpolation stencil. Destination nodes that can not be
+ ** interpolated (empty row or non-finite source value) are set to NaN.
+ */
+static void stencil_apply(stencil* st, float vsrc[], float vdst[])
+{
+    size_t i;
+
+#if defined(_OPENMP)
+#pragma omp parallel for
+#endif
+    for (i = 0; i < st->n; ++i) {
+        double v = 0.0;
+        size_t ii;
+
+        if (st->rowstart[i] == st->rowstart[i + 1]) {
+            vdst[i] = NAN;
+            continue;
+        }
+        for (ii = st->rowstart[i]; ii < st->rowstart[i + 1]; ++ii)
+            v += st->w[ii] * vsrc[st->ids[ii]];
+        vdst[i] = (isfinite(v)) ? (float) v : NAN;
+    }
+}
 
-      finalise_level:
+/** Prints timing of stencil building.
+ */
+static void print_buildstats(void)
+{
+    if (time_overlap > 0.0)
+        printf("  cell overlaps: %zu in %.3f s\n", noverlap, time_overlap);
+    else {
+        printf("  triangulation: %.3f s\n", time_triangulate);
+        printf("  point location: %zu nodes in %.3f s (%.3g nodes/s)\n", nlocated, time_locate, (time_locate > 0.0) ? (double) nlocated / time_locate : 0.0);
+    }
+    fflush(stdout);
+}
+
+/** Builds interpolation stencils for all distinct masks of valid source nodes
+ ** and saves them to weights file.
+ * @param fname - weights file
+ * @param gsrc - source grid
+ * @param gdst - destination grid
+ * @param ov - overlap matrix for conservative remapping (NULL for linear
+ *             interpolation)
+ * @param skipfirstlast - flag: do not use the first and last columns
+ * @param cmd - command line
+ * @param verbose - verbosity level
+ */
+static void weights_write(char fname[], grid* gsrc, grid* gdst, stencil* ov, int skipfirstlast, char cmd[], int verbose)
+{
+    int nlayer = 1;
+    int* layer2stencil;
+    int* stencil2layer;
+    int nstencil = 0;
+    unsigned char* mask = malloc(gsrc->n);
+    unsigned char* mask_prev = malloc(gsrc->n);
+    int ncid;
+    int dimids[2];
+    int dimid_nnz;
+    int varid_stencil, varid_rowstart, varid_ids, varid_w, varid_nkdst = -1;
+    int64_t* rowstart;
+    size_t nnz_total = 0;
+    int k, s;
+    size_t i;
+
+    /*
+     * layers beyond the deepest valid source layer have the same mask as the
+     * last one
+     */
+    if (gsrc->nk != NULL) {
+        for (i = 0; i < gsrc->n; ++i)
+            if (gsrc->nk[i] >= nlayer)
+                nlayer = gsrc->nk[i] + 1;
+    }
+    layer2stencil = malloc(nlayer * sizeof(int));
+    stencil2layer = malloc(nlayer * sizeof(int));
+    for (k = 0; k < nlayer; ++k) {
+        (void) getmask(gsrc, k, skipfirstlast, NULL, mask);
+        if (k == 0 || memcmp(mask, mask_prev, gsrc->n) != 0) {
+            stencil2layer[nstencil] = k;
+            nstencil++;
+            memcpy(mask_prev, mask, gsrc->n);
+        }
+        layer2stencil[k] = nstencil - 1;
+    }
+    if (verbose) {
+        printf("  weights = \"%s\"\n", fname);
+        printf("    %d layer(s), %d distinct mask(s)\n", nlayer, nstencil);
+        printf("    calculating:");
+        fflush(stdout);
+    }
+
+    ncw_create(fname, NC_CLOBBER | NC_NETCDF4, &ncid);
+    ncw_put_att_text(ncid, NC_GLOBAL, "method", (ov != NULL) ? "conservative" : "linear");
+    {
+        int ni_src = gsrc->ni, nj_src = gsrc->nj, ni_dst = gdst->ni, nj_dst = gdst->nj;
+
+        ncw_put_att_int(ncid, NC_GLOBAL, "ni_src", 1, &ni_src);
+        ncw_put_att_int(ncid, NC_GLOBAL, "nj_src", 1, &nj_src);
+        ncw_put_att_int(ncid, NC_GLOBAL, "ni_dst", 1, &ni_dst);
+        ncw_put_att_int(ncid, NC_GLOBAL, "nj_dst", 1, &nj_dst);
+        ncw_put_att_int(ncid, NC_GLOBAL, "skipfirstlast", 1, &skipfirstlast);
+    }
+    {
+        char attname[NC_MAX_NAME];
+        char cwd[MAXSTRLEN];
+
+        snprintf(attname, NC_MAX_NAME, "%s: command", PROGRAM_NAME);
+        ncw_put_att_text(ncid, NC_GLOBAL, attname, cmd);
+        if (getcwd(cwd, MAXSTRLEN) != NULL) {
+            snprintf(attname, NC_MAX_NAME, "%s: wdir", PROGRAM_NAME);
+            ncw_put_att_text(ncid, NC_GLOBAL, attname, cwd);
+        }
+    }
+    ncw_def_dim(ncid, "nk", nlayer, &dimids[0]);
+    ncw_def_var(ncid, "stencil", NC_INT, 1, dimids, &varid_stencil);
+    ncw_put_att_text(ncid, varid_stencil, "long_name", "stencil for each layer (the last one is used for deeper layers)");
+    ncw_def_dim(ncid, "nstencil", nstencil, &dimids[0]);
+    ncw_def_dim(ncid, "ndst1", gdst->n + 1, &dimids[1]);
+    ncw_def_var(ncid, "rowstart", NC_INT64, 2, dimids, &varid_rowstart);
+    ncw_put_att_text(ncid, varid_rowstart, "long_name", "start of row for each destination node in \"ids\" and \"weights\"");
+    ncw_def_dim(ncid, "nnz", NC_UNLIMITED, &dimid_nnz);
+    ncw_def_var(ncid, "ids", NC_INT, 1, &dimid_nnz, &varid_ids);
+    ncw_put_att_text(ncid, varid_ids, "long_name", "source node");
+    ncw_def_var(ncid, "weights", NC_DOUBLE, 1, &dimid_nnz, &varid_w);
+    if (gdst->nk != NULL) {
+        ncw_def_dim(ncid, "ndst", gdst->n, &dimids[0]);
+        ncw_def_var(ncid, "nkdst", NC_INT, 1, dimids, &varid_nkdst);
+        ncw_put_att_text(ncid, varid_nkdst, "long_name", "number of valid layers in destination nodes");
+    }
+    ncw_def_deflate(ncid, 0, 1, 1);
+    ncw_enddef(ncid);
+
+    ncw_put_var_int(ncid, varid_stencil, layer2stencil);
+    if (gdst->nk != NULL)
+        ncw_put_var_int(ncid, varid_nkdst, gdst->nk);
+
+    rowstart = malloc((gdst->n + 1) * sizeof(int64_t));
+    for (s = 0; s < nstencil; ++s) {
+        stencil* st;
+        int npoint;
+
+        k = stencil2layer[s];
+        npoint = getmask(gsrc, k, skipfirstlast, NULL, mask);
+        if (npoint > 0)
+            st = (ov != NULL) ? stencil_conservative(ov, gdst, mask, k) : stencil_build(gsrc, gdst, mask, k);
+        else
+            st = stencil_create(gdst->n, 0);
+
+        for (i = 0; i <= gdst->n; ++i)
+            rowstart[i] = nnz_total + st->rowstart[i];
+        {
+            size_t start[2] = { s, 0 };
+            size_t count[2] = { 1, gdst->n + 1 };
+
+            ncw_put_vara(ncid, varid_rowstart, start, count, rowstart);
+        }
+        if (st->nnz > 0) {
+            size_t start = nnz_total;
+            size_t count = st->nnz;
+
+            ncw_put_vara_int(ncid, varid_ids, &start, &count, st->ids);
+            ncw_put_vara_double(ncid, varid_w, &start, &count, st->w);
+        }
+        nnz_total += st->nnz;
+        stencil_destroy(st);
 
-        ncu_writefield(fname_dst_tmp, varname, k, ni_dst, nj_dst, nk, vdst);
         if (verbose == 1) {
-            printf("%c", (k + 1) % 10 ? '.' : '|');
+            printf("%c", (s + 1) % 10 ? '.' : '|');
             fflush(stdout);
         } else if (verbose > 1) {
+            printf("\n      stencil %d: k = %d, %d in", s, k, npoint);
+            fflush(stdout);
+        }
+    }
+    ncw_close(ncid);
+    if (verbose) {
+        printf("\n    # weights = %zu\n", nnz_total);
+        fflush(stdout);
+    }
+    if (verbose > 1) {
+        print_buildstats();
+        printf("  peak memory: %.1f MB\n", (double) get_peakrss() / 1.0e6);
+        fflush(stdout);
+    }
+
+    free(rowstart);
+    free(mask);
+    free(mask_prev);
+    free(layer2stencil);
+    free(stencil2layer);
+}
+
+/**
+ */
+static weights* weights_open(char fname[])
+{
+    weights* w = calloc(1, sizeof(weights));
+    char method[NC_MAX_NAME];
+    size_t len;
+    int varid;
+
+    ncw_open(fname, NC_NOWRITE, &w->ncid);
+    ncw_inq_attlen(w->ncid, NC_GLOBAL, "method", &len);
+    if (len >= NC_MAX_NAME)
+        quit("%s: unknown interpolation method", fname);
+    ncw_get_att_text(w->ncid, NC_GLOBAL, "method", method);
+    method[len] = 0;
+    if (strcmp(method, "linear") != 0 && strcmp(method, "conservative") != 0)
+        quit("%s: unknown interpolation method \"%s\"", fname, method);
+    ncw_get_att_int(w->ncid, NC_GLOBAL, "ni_src", &w->ni_src);
+    ncw_get_att_int(w->ncid, NC_GLOBAL, "nj_src", &w->nj_src);
+    ncw_get_att_int(w->ncid, NC_GLOBAL, "ni_dst", &w->ni_dst);
+    ncw_get_att_int(w->ncid, NC_GLOBAL, "nj_dst", &w->nj_dst);
+
+    ncw_inq_varid(w->ncid, "stencil", &varid);
+    ncw_inq_vardims(w->ncid, varid, 1, NULL, &len);
+    w->nlayer = len;
+    w->layer2stencil = malloc(w->nlayer * sizeof(int));
+    ncw_get_var_int(w->ncid, varid, w->layer2stencil);
+    ncw_inq_varid(w->ncid, "rowstart", &w->varid_rowstart);
+    {
+        size_t dimlen[2];
+
+        ncw_inq_vardims(w->ncid, w->varid_rowstart, 2, NULL, dimlen);
+        w->nstencil = dimlen[0];
+        if (dimlen[1] != (size_t) w->ni_dst * (w->nj_dst > 0 ? w->nj_dst : 1) + 1)
+            quit("%s: dimensions of \"rowstart\" do not match destination grid dimensions", fname);
+    }
+    ncw_inq_varid(w->ncid, "ids", &w->varid_ids);
+    ncw_inq_varid(w->ncid, "weights", &w->varid_w);
+    if (ncw_var_exists(w->ncid, "nkdst")) {
+        ncw_inq_varid(w->ncid, "nkdst", &varid);
+        w->nkdst = malloc((size_t) w->ni_dst * (w->nj_dst > 0 ? w->nj_dst : 1) * sizeof(int));
+        ncw_get_var_int(w->ncid, varid, w->nkdst);
+    }
+    w->current[0] = -1;
+    w->current[1] = -1;
+
+    return w;
+}
+
+/** Gets stencil for a layer; reads it from the weights file unless it is
+ ** one of the two most recently read. The stencil returned by the previous
+ ** call remains valid.
+ * @return 1 if the stencil has been read, 0 otherwise
+ */
+static int weights_getstencil(weights* w, int k, stencil** st)
+{
+    int s = w->layer2stencil[(k < w->nlayer) ? k : w->nlayer - 1];
+    size_t n = (size_t) w->ni_dst * (w->nj_dst > 0 ? w->nj_dst : 1);
+    int64_t* rowstart;
+    int slot;
+    size_t i;
+
+    for (slot = 0; slot < 2; ++slot) {
+        if (w->current[slot] == s) {
+            w->last = slot;
+            *st = w->st[slot];
+            return 0;
+        }
+    }
+    slot = (w->current[0] < 0) ? 0 : 1 - w->last;
+    if (w->st[slot] != NULL)
+        stencil_destroy(w->st[slot]);
+
+    rowstart = malloc((n + 1) * sizeof(int64_t));
+    {
+        size_t start[2] = { s, 0 };
+        size_t count[2] = { 1, n + 1 };
+
+        ncw_get_vara(w->ncid, w->varid_rowstart, start, count, rowstart);
+    }
+    w->st[slot] = stencil_create(n, rowstart[n] - rowstart[0]);
+    w->st[slot]->nnz = rowstart[n] - rowstart[0];
+    for (i = 0; i <= n; ++i)
+        w->st[slot]->rowstart[i] = rowstart[i] - rowstart[0];
+    if (w->st[slot]->nnz > 0) {
+        size_t start = rowstart[0];
+        size_t count = w->st[slot]->nnz;
+
+        ncw_get_vara_int(w->ncid, w->varid_ids, &start, &count, w->st[slot]->ids);
+        ncw_get_vara_double(w->ncid, w->varid_w, &start, &count, w->st[slot]->w);
+    }
+    free(rowstart);
+    w->current[slot] = s;
+    w->last = slot;
+    *st = w->st[slot];
+
+    return 1;
+}
+
+/**
+ */
+static void weights_close(weights* w)
+{
+    ncw_close(w->ncid);
+    free(w->layer2stencil);
+    if (w->nkdst != NULL)
+        free(w->nkdst);
+    if (w->st[0] != NULL)
+        stencil_destroy(w->st[0]);
+    if (w->st[1] != NULL)
+        stencil_destroy(w->st[1]);
+    free(w);
+}
+
+/** Checks whether a variable looks like a geographic coordinate (these are
+ ** not interpolated when the variables are selected automatically).
+ */
+static int iscoordinate(int ncid, int varid)
+{
+    char* attnames[] = { "standard_name", "units" };
+    char* values[] = { "longitude", "latitude", "degrees_east", "degrees_north", "degree_east", "degree_north" };
+    int a, i;
+
+    for (a = 0; a < 2; ++a) {
+        char attval[NC_MAX_NAME];
+        size_t len;
+
+        if (!ncw_att_exists(ncid, varid, attnames[a]))
+            continue;
+        ncw_inq_attlen(ncid, varid, attnames[a], &len);
+        if (len >= NC_MAX_NAME)
+            continue;
+        ncw_get_att_text(ncid, varid, attnames[a], attval);
+        attval[len] = 0;
+        for (i = 0; i < 6; ++i)
+            if (strcmp(attval, values[i]) == 0)
+                return 1;
+    }
+
+    return 0;
+}
+
+/** Finds a cached stencil built for a given mask of valid source nodes and
+ ** applicable to layer k.
+ */
+static stencil* stencilcache_find(stencilcache* c, size_t n, unsigned char mask[], int k)
+{
+    int i;
 
-            printf("\n    k = %d: %d in, %d out", k, npoint, npoint_dst);
-            if (npoint_filled > 0)
-                printf(" (%d filled)", npoint_filled);
+    for (i = 0; i < c->n; ++i)
+        if (k >= c->st[i]->k && memcmp(mask, c->mask[i], n) == 0)
+            return c->st[i];
+
+    return NULL;
+}
+
+/** Adds a stencil to the cache; the oldest entry is discarded if the cache is
+ ** full.
+ */
+static void stencilcache_add(stencilcache* c, size_t n, unsigned char mask[], stencil* st)
+{
+    int i;
+
+    if (c->n < NSTENCILCACHE) {
+        i = c->n;
+        c->mask[i] = malloc(n);
+        c->n++;
+    } else {
+        i = c->next;
+        stencil_destroy(c->st[i]);
+        c->next = (c->next + 1) % NSTENCILCACHE;
+    }
+    c->st[i] = st;
+    memcpy(c->mask[i], mask, n);
+}
+
+/**
+ */
+static void stencilcache_free(stencilcache* c)
+{
+    int i;
+
+    for (i = 0; i < c->n; ++i) {
+        stencil_destroy(c->st[i]);
+        free(c->mask[i]);
+    }
+    c->n = 0;
+    c->next = 0;
+}
+
+/** Gets the rank interpolating a field. With MPI, rank 0 writes the output
+ ** and the other ranks interpolate. If there are at least as many layers as
+ ** interpolating ranks then the layers are dealt to them cyclically (so that
+ ** the stencils of a layer are built by one rank only); otherwise the fields
+ ** are dealt cyclically. Each rank sends its fields in the order they are
+ ** written in.
+ * @param tasks - all fields
+ * @param t - field index
+ * @param nk - number of layers
+ */
+static int task_getowner(task tasks[], int t, int nk)
+{
+    if (nprocesses == 1)
+        return 0;
+    if (nk >= nprocesses - 1)
+        return 1 + tasks[t].k % (nprocesses - 1);
+    return 1 + t % (nprocesses - 1);
+}
+
+/** Sets the destination values that have not been interpolated: either to
+ ** the deepest valid value above (with "-n") or to the fill value.
+ */
+static void task_finalise(task* tk, variable vars[], size_t nij_dst, int nkdst[], int nanfill, float vdst[])
+{
+    variable* var = &vars[tk->vi];
+    float* vdst_last = (var->vdst_last != NULL) ? var->vdst_last[tk->r] : NULL;
+    float fillvalue = (nanfill) ? NAN : 0.0f;
+    size_t i;
+
+    if (tk->npoint == 0) {
+        for (i = 0; i < nij_dst; ++i)
+            vdst[i] = fillvalue;
+        return;
+    }
+    for (i = 0; i < nij_dst; ++i) {
+        if (nkdst == NULL || tk->k < nkdst[i]) {
+            tk->npoint_dst++;
+            if (isfinite(vdst[i])) {
+                if (vdst_last != NULL)
+                    vdst_last[i] = vdst[i];
+                continue;
+            }
+            tk->npoint_filled++;
+            if (vdst_last != NULL && isfinite(vdst_last[i])) {
+                vdst[i] = vdst_last[i];
+                continue;
+            }
+        }
+        vdst[i] = fillvalue;
+    }
+}
+
+/**
+ */
+static void task_report(task tasks[], int t, int ntask, variable vars[], int verbose)
+{
+    task* tk = &tasks[t];
+
+    if (verbose == 1 && (t == ntask - 1 || tasks[t + 1].k != tk->k)) {
+        printf("%c", (tk->k + 1) % 10 ? '.' : '|');
+        fflush(stdout);
+    } else if (verbose > 1) {
+        printf("\n    k = %d: %s", tk->k, vars[tk->vi].varname);
+        if (vars[tk->vi].nr > 1)
+            printf("[%d]", tk->r);
+        printf(": %d in, %d out", tk->npoint, tk->npoint_dst);
+        if (tk->npoint_filled > 0)
+            printf(" (%d filled)", tk->npoint_filled);
+        fflush(stdout);
+    }
+}
+
+/**
+ */
+int main(int argc, char* argv[])
+{
+    char* fname_src = NULL;
+    char* fname_dst = NULL;
+    int nvar = 0;
+    char** varnames = NULL;
+    char* grdname_src = NULL;
+    char* xname_src = NULL;
+    char* yname_src = NULL;
+    char* nkname_src = NULL;
+    char* grdname_dst = NULL;
+    char* xname_dst = NULL;
+    char* yname_dst = NULL;
+    char* nkname_dst = NULL;
+    char* fname_win = NULL;
+    char* fname_wout = NULL;
+    int conservative = 0;
+    int deflate = 0;
+    double band = -1.0;
+    int propagatedown = 0;
+    int nanfill = 0;
+    int skipfirstlast = 0;
+    int nthreads = 0;
+    int pipeline = 0;
+    int verbose = VERBOSE_DEF;
+
+    grid gsrc, gdst;
+    weights* w = NULL;
+    stencil* overlaps = NULL;
+    int* nkdst = NULL;
+
+    int npoint_filled_tot = 0;
+
+    int ncid_src;
+    int unlimdimid_src = -1;
+    size_t ni_src = 0, nj_src = 0, nij_src = 0;
+    int nhdims;
+
+    char fname_dst_tmp[MAXSTRLEN];
+
+    int ncid_dst;
+    size_t ni_dst = 0, nj_dst = 0, nij_dst = 0;
+
+    variable* vars = NULL;
+    int ncopy = 0;
+    int* copyids = NULL;
+    float* vsrc[2] = { NULL, NULL };
+    float* vdst[2] = { NULL, NULL };
+    int ntask;
+    task* tasks = NULL;
+    int nmytask;
+    int* mytasks = NULL;
+
+    stencilcache cache;
+    unsigned char* mask = NULL;
+    int nst_built = 0, nst_reused = 0;
+
+    int nk = 1;
+
+    int i, k, vi, t, m, b;
+
+    parse_commandline(argc, argv, &fname_src, &fname_dst, &nvar, &varnames, &grdname_src, &xname_src, &yname_src, &nkname_src, &grdname_dst, &xname_dst, &yname_dst, &nkname_dst, &fname_win, &fname_wout, &conservative, &deflate, &band, &propagatedown, &nanfill, &skipfirstlast, &nthreads, &pipeline, &verbose);
+
+    if (fname_win != NULL && fname_wout != NULL)
+        quit("can not use both \"-wi\" and \"-wo\"");
+    if (fname_wout == NULL || fname_src != NULL) {
+        if (fname_src == NULL)
+            quit("no input file specified");
+        if (fname_dst == NULL)
+            quit("no output file specified");
+    }
+    if (fname_win == NULL) {
+        if (grdname_src == NULL)
+            quit("no input grid file specified");
+        if (grdname_dst == NULL)
+            quit("no output grid file specified");
+    } else if (band >= 0.0)
+        quit("can not use \"-e\" with \"-wi\"");
+    else if (conservative)
+        quit("can not use \"-c\" with \"-wi\" (the method is defined by the weights file)");
+    if (conservative && band >= 0.0)
+        quit("can not use \"-e\" with \"-c\"");
+
+    ncw_set_quitfn(quit);
+    ncu_set_quitfn(quit);
+
+#if defined(MPI)
+    {
+        int provided;
+
+        /*
+         * (only the master thread calls MPI)
+         */
+        MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+        MPI_Comm_size(MPI_COMM_WORLD, &nprocesses);
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    }
+    if (rank > 0)
+        verbose = 0;
+    if (verbose) {
+        printf("  MPI: initialised %d process(es)\n", nprocesses);
+        fflush(stdout);
+    }
+#endif
+
+#if defined(_OPENMP)
+    if (nthreads > 0)
+        omp_set_num_threads(nthreads);
+    if (verbose) {
+        printf("  # threads = %d\n", omp_get_max_threads());
+        fflush(stdout);
+    }
+    /*
+     * (the interpolation thread in the pipeline uses nested parallel regions)
+     */
+    if (pipeline)
+        omp_set_max_active_levels(2);
+#else
+    if (nthreads > 1)
+        printf("  warning: %s has been compiled without OpenMP; ignoring \"-t\"\n", PROGRAM_NAME);
+    if (pipeline)
+        printf("  warning: %s has been compiled without OpenMP; ignoring \"-p\"\n", PROGRAM_NAME);
+#endif
+
+    memset(&gsrc, 0, sizeof(grid));
+    memset(&gdst, 0, sizeof(grid));
+    memset(&cache, 0, sizeof(stencilcache));
+
+    if (fname_win == NULL) {
+        /*
+         * src grid
+         */
+        if (verbose) {
+            printf("  src grid = \"%s\"\n", grdname_src);
+            fflush(stdout);
+        }
+        grid_read(grdname_src, xname_src, yname_src, nkname_src, -1, &gsrc);
+        ni_src = gsrc.ni;
+        nj_src = gsrc.nj;
+        /*
+         * dst grid
+         */
+        if (verbose) {
+            printf("  dst grid = \"%s\"\n", grdname_dst);
+            fflush(stdout);
+        }
+        grid_read(grdname_dst, xname_dst, yname_dst, nkname_dst, gsrc.type == GRIDTYPE_VECT, &gdst);
+        if (gsrc.type == GRIDTYPE_VECT && gdst.type != GRIDTYPE_VECT)
+            quit("source grid is unstructured; destination grid is not");
+        ni_dst = gdst.ni;
+        nj_dst = gdst.nj;
+        nkdst = gdst.nk;
+
+        if (conservative) {
+            if (gsrc.type == GRIDTYPE_VECT)
+                quit("%s: conservative remapping requires structured grids", grdname_src);
+            if (verbose) {
+                printf("  calculating cell overlaps:");
+                fflush(stdout);
+            }
+            grid_setcorners(&gsrc);
+            grid_setcorners(&gdst);
+            overlaps = overlaps_build(&gsrc, &gdst);
+            /*
+             * (neither coordinates nor corners are needed any more)
+             */
+            free(gsrc.lon);
+            free(gsrc.lat);
+            free(gsrc.corners);
+            free(gdst.lon);
+            free(gdst.lat);
+            free(gdst.corners);
+            gsrc.lon = gsrc.lat = gdst.lon = gdst.lat = NULL;
+            gsrc.corners = gdst.corners = NULL;
+            if (verbose) {
+                printf("\n");
+                printf("    # overlaps = %zu\n", overlaps->nnz);
+                if (verbose > 1)
+                    printf("  peak memory: %.1f MB\n", (double) get_peakrss() / 1.0e6);
+                fflush(stdout);
+            }
+        } else {
+            if (verbose) {
+                printf("  converting src lon/lat to stereographic projections:");
+                fflush(stdout);
+            }
+            grid_project(&gsrc, 0);
+            if (band >= 0.0 && band < 90.0)
+                /*
+                 * the distance from the centre of the projection to the node
+                 * at latitude `band' beyond the equator
+                 */
+                gsrc.rmax = tan(M_PI / 4.0 + band * DEG2RAD / 2.0);
+            if (verbose) {
+                printf("\n");
+                printf("  converting dst lon/lat to stereographic projections:");
+                fflush(stdout);
+            }
+            grid_project(&gdst, 1);
+            grid_sort(&gdst);
+            if (verbose) {
+                printf("\n");
+                if (verbose > 1)
+                    printf("  peak memory: %.1f MB\n", (double) get_peakrss() / 1.0e6);
+                fflush(stdout);
+            }
+        }
+
+        if (fname_wout != NULL) {
+            if (rank == 0) {
+                char* cmd = get_command(argc, argv);
+
+                weights_write(fname_wout, &gsrc, &gdst, overlaps, skipfirstlast, cmd, verbose);
+                free(cmd);
+            }
+#if defined(MPI)
+            MPI_Barrier(MPI_COMM_WORLD);
+#endif
+            if (fname_src == NULL)
+                goto cleanup;
+            /*
+             * interpolate with the saved weights, so that the result is the
+             * same as with "-wi"
+             */
+            w = weights_open(fname_wout);
+        }
+    } else {
+        if (verbose) {
+            printf("  weights = \"%s\"\n", fname_win);
+            fflush(stdout);
+        }
+        w = weights_open(fname_win);
+        ni_src = w->ni_src;
+        nj_src = w->nj_src;
+        ni_dst = w->ni_dst;
+        nj_dst = w->nj_dst;
+        nkdst = w->nkdst;
+        if (verbose) {
+            printf("    %d layer(s), %d distinct mask(s)\n", w->nlayer, w->nstencil);
             fflush(stdout);
         }
     }
-    file_rename(fname_dst_tmp, fname_dst);
+    nij_src = (nj_src > 0) ? ni_src * nj_src : ni_src;
+    nij_dst = (nj_dst > 0) ? ni_dst * nj_dst : ni_dst;
+    nhdims = (nj_src > 0) ? 2 : 1;
+
+    if (verbose) {
+        printf("  src = \"%s\"\n", fname_src);
+        fflush(stdout);
+    }
+
+    /*
+     * src
+     */
+    ncw_open(fname_src, NC_NOWRITE, &ncid_src);
+    ncw_inq_unlimdim(ncid_src, &unlimdimid_src);
+    if (varnames == NULL) {
+        /*
+         * select all variables defined on the source grid
+         */
+        int nvar_all, vid;
+
+        ncw_inq_nvars(ncid_src, &nvar_all);
+        for (vid = 0; vid < nvar_all; ++vid) {
+            char name[NC_MAX_NAME];
+            nc_type type;
+            int ndims;
+            int dimids[NC_MAX_DIMS];
+            size_t dimlen[NC_MAX_DIMS];
+
+            ncw_inq_var(ncid_src, vid, name, &type, &ndims, dimids, NULL);
+            if (ndims < nhdims || ndims > nhdims + 2 || type == NC_CHAR || type == NC_STRING)
+                continue;
+            ncw_inq_vardims(ncid_src, vid, NC_MAX_DIMS, NULL, dimlen);
+            if (dimlen[ndims - 1] != ni_src || (nhdims == 2 && dimlen[ndims - 2] != nj_src))
+                continue;
+            if (ndims == nhdims + 2 && dimids[0] != unlimdimid_src && dimlen[0] != 1)
+                continue;
+            if ((xname_src != NULL && strcmp(name, xname_src) == 0) || (yname_src != NULL && strcmp(name, yname_src) == 0) || (nkname_src != NULL && strcmp(name, nkname_src) == 0) || iscoordinate(ncid_src, vid))
+                continue;
+            if (nvar % NVAR_INC == 0)
+                varnames = realloc(varnames, (nvar + NVAR_INC) * sizeof(void*));
+            varnames[nvar] = strdup(name);
+            nvar++;
+        }
+        if (nvar == 0)
+            quit("%s: found no variables defined on the source grid", fname_src);
+    } else
+        for (vi = 0; vi < nvar; ++vi)
+            varnames[vi] = strdup(varnames[vi]);
+
+    vars = calloc(nvar, sizeof(variable));
+    for (vi = 0; vi < nvar; ++vi) {
+        variable* var = &vars[vi];
+        size_t dimlen[4];
+        int dimids[4];
+
+        var->varname = varnames[vi];
+        ncw_inq_varid(ncid_src, var->varname, &var->varid_src);
+        ncw_inq_vardims(ncid_src, var->varid_src, 4, &var->ndims, dimlen);
+        ncw_inq_vardimid(ncid_src, var->varid_src, dimids);
+        if (var->ndims < nhdims || dimlen[var->ndims - 1] != ni_src || (nhdims == 2 && dimlen[var->ndims - 2] != nj_src))
+            quit("%s: dimensions of variable \"%s\" do not match source grid dimensions", fname_src, var->varname);
+        var->nk = 1;
+        var->nr = 1;
+        if (var->ndims == nhdims + 1) {
+            if (dimids[0] == unlimdimid_src)
+                var->nr = dimlen[0];
+            else
+                var->nk = dimlen[0];
+        } else if (var->ndims == nhdims + 2) {
+            if (dimids[0] != unlimdimid_src && dimlen[0] != 1)
+                quit("%s: %s: expected the first dimension to be either unlimited or of length 1", fname_src, var->varname);
+            var->nr = dimlen[0];
+            var->nk = dimlen[1];
+        } else if (var->ndims > nhdims + 2)
+            quit("%s: %s: can not handle %d-dimensional variables on %s grid", fname_src, var->varname, var->ndims, (nhdims == 2) ? "structured" : "unstructured");
+        if (var->nk > nk)
+            nk = var->nk;
+        if (verbose) {
+            printf("    %s: ", var->varname);
+            for (i = 0; i < var->ndims; ++i)
+                printf("%zu%s", dimlen[i], i < var->ndims - 1 ? " x " : "\n");
+            fflush(stdout);
+        }
+    }
+
+    /*
+     * dst (with MPI, rank 0 writes the output)
+     */
+    if (rank == 0) {
+        if (verbose) {
+            printf("  dst = \"%s\"\n", fname_dst);
+            fflush(stdout);
+        }
+        strcpy(fname_dst_tmp, fname_dst);
+        strcat(fname_dst_tmp, ".tmp");
+        ncw_create(fname_dst_tmp, NC_CLOBBER | NC_NETCDF4, &ncid_dst);
+        /*
+         * copy global attributes to destination
+         */
+        ncw_copy_atts(ncid_src, NC_GLOBAL, ncid_dst, NC_GLOBAL);
+        /*
+         * copy command line and wdir to dst
+         */
+        {
+            char* cmd = get_command(argc, argv);
+            char attname[NC_MAX_NAME];
+            char cwd[MAXSTRLEN];
+
+            snprintf(attname, NC_MAX_NAME, "%s: command", PROGRAM_NAME);
+            ncw_put_att_text(ncid_dst, NC_GLOBAL, attname, cmd);
+            free(cmd);
+            if (getcwd(cwd, MAXSTRLEN) != NULL) {
+                snprintf(attname, NC_MAX_NAME, "%s: wdir", PROGRAM_NAME);
+                ncw_put_att_text(ncid_dst, NC_GLOBAL, attname, cwd);
+            }
+        }
+        /*
+         * define dimensions and variables
+         */
+        for (vi = 0; vi < nvar; ++vi) {
+            variable* var = &vars[vi];
+            int dimids_src[4], dimids_dst[4];
+            nc_type nctype;
+
+            ncw_inq_var(ncid_src, var->varid_src, NULL, &nctype, NULL, dimids_src, NULL);
+            for (i = 0; i < var->ndims; ++i) {
+                char dimname[NC_MAX_NAME];
+                size_t len;
+
+                ncw_inq_dim(ncid_src, dimids_src[i], dimname, &len);
+                if (var->ndims - i == 1)
+                    len = ni_dst;
+                else if (var->ndims - i == 2 && nhdims == 2)
+                    len = nj_dst;
+                else if (dimids_src[i] == unlimdimid_src)
+                    len = NC_UNLIMITED;
+                if (ncw_dim_exists(ncid_dst, dimname)) {
+                    size_t len_dst;
+
+                    ncw_inq_dimid(ncid_dst, dimname, &dimids_dst[i]);
+                    ncw_inq_dimlen(ncid_dst, dimids_dst[i], &len_dst);
+                    if (len != NC_UNLIMITED && len != len_dst)
+                        quit("%s: dimension \"%s\" is used both as horizontal and non-horizontal dimension", fname_src, dimname);
+                } else
+                    ncw_def_dim(ncid_dst, dimname, len, &dimids_dst[i]);
+            }
+            ncw_def_var(ncid_dst, var->varname, nctype, var->ndims, dimids_dst, &var->varid_dst);
+            ncw_copy_atts(ncid_src, var->varid_src, ncid_dst, var->varid_dst);
+        }
+        /*
+         * copy record variables like "time"
+         */
+        if (unlimdimid_src >= 0) {
+            char dimname[NC_MAX_NAME];
+            int nvar_all, vid;
+
+            ncw_inq_dimname(ncid_src, unlimdimid_src, dimname);
+            ncw_inq_nvars(ncid_src, &nvar_all);
+            for (vid = 0; vid < nvar_all && ncw_dim_exists(ncid_dst, dimname); ++vid) {
+                char name[NC_MAX_NAME];
+                int ndims, dimid;
+
+                ncw_inq_varndims(ncid_src, vid, &ndims);
+                if (ndims != 1)
+                    continue;
+                ncw_inq_vardimid(ncid_src, vid, &dimid);
+                ncw_inq_varname(ncid_src, vid, name);
+                if (dimid != unlimdimid_src || ncw_var_exists(ncid_dst, name))
+                    continue;
+                (void) ncw_copy_vardef(ncid_src, vid, ncid_dst);
+                if (ncopy % NVAR_INC == 0)
+                    copyids = realloc(copyids, (ncopy + NVAR_INC) * sizeof(int));
+                copyids[ncopy] = vid;
+                ncopy++;
+            }
+        }
+
+        if (deflate > 0)
+            ncw_def_deflate(ncid_dst, 0, 1, deflate);
+        ncw_def_outpolicy(ncid_dst);
+
+        ncw_enddef(ncid_dst);
+
+        for (i = 0; i < ncopy; ++i)
+            ncw_copy_vardata(ncid_src, copyids[i], ncid_dst);
+    }
+
+    if (verbose) {
+        printf("  interpolating:");
+        fflush(stdout);
+    }
+
+    for (b = 0; b < 2; ++b) {
+        vsrc[b] = malloc(nij_src * sizeof(float));
+        vdst[b] = malloc(nij_dst * sizeof(float));
+    }
+    for (vi = 0; vi < nvar; ++vi) {
+        variable* var = &vars[vi];
+
+        var->field_src = ncu_field_attach(ncid_src, var->varname, ni_src, nj_src, var->nk);
+        if (rank > 0)
+            continue;
+        var->field_dst = ncu_field_attach(ncid_dst, var->varname, ni_dst, nj_dst, var->nk);
+        if (var->nk > 1 && propagatedown) {
+            int r;
+
+            var->vdst_last = malloc(var->nr * sizeof(float*));
+            for (r = 0; r < var->nr; ++r) {
+                var->vdst_last[r] = malloc(nij_dst * sizeof(float));
+                for (i = 0; i < nij_dst; ++i)
+                    var->vdst_last[r][i] = NAN;
+            }
+        }
+    }
+
+    /*
+     * Layers are processed in the outer cycle so that the stencils built for a
+     * layer of one variable can be reused for the same layer of other
+     * variables and records.
+     */
+    for (k = 0, ntask = 0; k < nk; ++k)
+        for (vi = 0; vi < nvar; ++vi)
+            if (k < vars[vi].nk)
+                ntask += vars[vi].nr;
+    tasks = calloc(ntask, sizeof(task));
+    for (k = 0, t = 0; k < nk; ++k) {
+        for (vi = 0; vi < nvar; ++vi) {
+            int r;
+
+            if (k >= vars[vi].nk)
+                continue;
+            for (r = 0; r < vars[vi].nr; ++r, ++t) {
+                tasks[t].k = k;
+                tasks[t].vi = vi;
+                tasks[t].r = r;
+            }
+        }
+    }
+
+    if (w == NULL)
+        mask = malloc(nij_src);
+    /*
+     * fields processed by this rank (by all fields in the serial case)
+     */
+    mytasks = malloc(ntask * sizeof(int));
+    for (t = 0, nmytask = 0; t < ntask; ++t)
+        if (task_getowner(tasks, t, nk) == rank)
+            mytasks[nmytask++] = t;
+    /*
+     * Interpolation of field m is done while field m - 1 is written (or sent
+     * to the writer) and field m + 1 is read. Because NetCDF library is not
+     * thread-safe, all I/O is done by one thread. (At m = -1 the first field
+     * is read.)
+     */
+    for (m = -1; m <= nmytask; ++m) {
+#if defined(_OPENMP)
+#pragma omp parallel sections num_threads(2) if(pipeline)
+#endif
+        {
+#if defined(_OPENMP)
+#pragma omp section
+#endif
+            {
+                if (m > 0 && nprocesses == 1) {
+                    task* tk = &tasks[mytasks[m - 1]];
+                    variable* var = &vars[tk->vi];
+
+                    ncu_field_setrecord(var->field_dst, tk->r);
+                    ncu_field_write(var->field_dst, tk->k, vdst[(m - 1) % 2]);
+                }
+                if (m + 1 < nmytask) {
+                    task* tk = &tasks[mytasks[m + 1]];
+                    variable* var = &vars[tk->vi];
+
+                    ncu_field_setrecord(var->field_src, tk->r);
+                    ncu_field_read(var->field_src, tk->k, vsrc[(m + 1) % 2]);
+                    if (w != NULL) {
+                        if (m >= 0 && tasks[mytasks[m]].k == tk->k)
+                            tk->st = tasks[mytasks[m]].st;
+                        else if (weights_getstencil(w, tk->k, &tk->st))
+                            nst_built++;
+                        else
+                            nst_reused++;
+                    }
+                }
+            }
+#if defined(_OPENMP)
+#pragma omp section
+#endif
+            if (m >= 0 && m < nmytask) {
+                task* tk = &tasks[mytasks[m]];
+                float* vs = vsrc[m % 2];
+                float* vd = vdst[m % 2];
+                int kk = tk->k;
+                size_t ii;
+                double t0;
+
+                if (w == NULL) {
+                    tk->npoint = getmask(&gsrc, kk, skipfirstlast, vs, mask);
+                    /*
+                     * the stencil depends on the set of valid source nodes
+                     * only; also, a stencil built for an upper layer covers
+                     * all valid destination nodes of the layers below
+                     */
+                    if (tk->npoint > 0) {
+                        tk->st = stencilcache_find(&cache, nij_src, mask, kk);
+                        if (tk->st != NULL)
+                            nst_reused++;
+                        else {
+                            tk->st = (overlaps != NULL) ? stencil_conservative(overlaps, &gdst, mask, kk) : stencil_build(&gsrc, &gdst, mask, kk);
+                            stencilcache_add(&cache, nij_src, mask, tk->st);
+                            nst_built++;
+                        }
+                    }
+                } else if (tk->st->nnz > 0) {
+                    for (ii = 0; ii < nij_src; ++ii)
+                        if (isfinite(vs[ii]))
+                            tk->npoint++;
+                }
+                t0 = prof_start();
+                if (tk->npoint > 0)
+                    stencil_apply(tk->st, vs, vd);
+                if (nprocesses == 1)
+                    task_finalise(tk, vars, nij_dst, nkdst, nanfill, vd);
+                prof_stop(PROF_COMPUTE, t0, 0);
+            }
+        }
+
+        if (m >= 0 && m < nmytask && nprocesses > 1) {
+#if defined(MPI)
+            /*
+             * (the interpolated field is finalised by the writer, as filling
+             * with "-n" depends on the layers above; the messages from a rank
+             * are received in the order they are sent, so that a fixed tag
+             * is used)
+             */
+            MPI_Send(&tasks[mytasks[m]].npoint, 1, MPI_INT, 0, TAG_FIELD, MPI_COMM_WORLD);
+            if (tasks[mytasks[m]].npoint > 0)
+                MPI_Send(vdst[m % 2], nij_dst, MPI_FLOAT, 0, TAG_FIELD, MPI_COMM_WORLD);
+#endif
+        }
+        if (m > 0 && nprocesses == 1)
+            task_report(tasks, mytasks[m - 1], ntask, vars, verbose);
+    }
+#if defined(MPI)
+    if (nprocesses > 1 && rank == 0) {
+        /*
+         * writer
+         */
+        for (t = 0; t < ntask; ++t) {
+            task* tk = &tasks[t];
+            variable* var = &vars[tk->vi];
+            int owner = task_getowner(tasks, t, nk);
+
+            MPI_Recv(&tk->npoint, 1, MPI_INT, owner, TAG_FIELD, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            if (tk->npoint > 0)
+                MPI_Recv(vdst[0], nij_dst, MPI_FLOAT, owner, TAG_FIELD, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            task_finalise(tk, vars, nij_dst, nkdst, nanfill, vdst[0]);
+            ncu_field_setrecord(var->field_dst, tk->r);
+            ncu_field_write(var->field_dst, tk->k, vdst[0]);
+            task_report(tasks, t, ntask, vars, verbose);
+        }
+    }
+    if (nprocesses > 1) {
+        int nst[2] = { nst_built, nst_reused };
+
+        MPI_Reduce((rank == 0) ? MPI_IN_PLACE : nst, nst, 2, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+        nst_built = nst[0];
+        nst_reused = nst[1];
+    }
+#endif
+    for (t = 0; t < ntask; ++t)
+        npoint_filled_tot += tasks[t].npoint_filled;
+    for (vi = 0; vi < nvar; ++vi) {
+        variable* var = &vars[vi];
+
+        ncu_field_close(var->field_src);
+        if (var->field_dst != NULL)
+            ncu_field_close(var->field_dst);
+        if (var->vdst_last != NULL) {
+            int r;
+
+            for (r = 0; r < var->nr; ++r)
+                free(var->vdst_last[r]);
+            free(var->vdst_last);
+        }
+        free(var->varname);
+    }
+    ncw_close(ncid_src);
+    if (rank == 0) {
+        ncw_close(ncid_dst);
+        file_rename(fname_dst_tmp, fname_dst);
+    }
     if (verbose) {
         printf("\n");
         printf("  -> %s\n", fname_dst);
-        if (verbose > 1)
+        if (verbose > 1) {
             printf("  # cells filled = %d\n", npoint_filled_tot);
+            printf("  # stencils %s = %d, reused = %d\n", (w == NULL) ? "built" : "read", nst_built, nst_reused);
+            if (w == NULL && nst_built > 0 && nprocesses == 1)
+                print_buildstats();
+            printf("  peak memory: %.1f MB\n", (double) get_peakrss() / 1.0e6);
+        }
         fflush(stdout);
     }
 
-    free(points_south);
-    free(points_north);
-    free(vsrc);
-    free(vdst);
-    free(ydst);
-    free(xsrc_south);
-    free(ysrc_south);
-    free(xsrc_north);
-    free(ysrc_north);
-    free(xdst_south);
-    free(ydst_south);
-    free(xdst_north);
-    free(ydst_north);
-    if (vdst_last != NULL)
-        free(vdst_last);
+    free(vars);
+    free(varnames);
+    if (copyids != NULL)
+        free(copyids);
+    free(tasks);
+    free(mytasks);
+    for (b = 0; b < 2; ++b) {
+        free(vsrc[b]);
+        free(vdst[b]);
+    }
+    if (w == NULL) {
+        stencilcache_free(&cache);
+        free(mask);
+    }
+
+  cleanup:
+    if (w != NULL)
+        weights_close(w);
+    if (overlaps != NULL)
+        stencil_destroy(overlaps);
+    grid_free(&gdst);
+    grid_free(&gsrc);
+    prof_report();
+
+#if defined(MPI)
+    MPI_Barrier(MPI_COMM_WORLD);
+    MPI_Finalize();
+#endif
 
     return 0;
 }
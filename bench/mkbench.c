@@ -0,0 +1,414 @@
+/******************************************************************************
+ *
+ * File:        mkbench.c
+ *
+ * Created:     14/10/2026
+ *
+ * Authors:     Pavel Sakov
+ *
+ * Description: MKBENCH generates synthetic NetCDF-4 inputs for benchmarking
+ *              GFU utilities: the source and destination grids for regrid_ll
+ *              and an ensemble of model dumps with a double and a float 3D
+ *              variable on the source grid. The data is deterministic for a
+ *              given set of options, so that the benchmarks are reproducible
+ *              across machines. A summary of the dataset is written to
+ *              "bench.info" for use by bench/run.sh.
+ *
+ * Revisions:
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "ncw.h"
+#include "utils.h"
+#include "version.h"
+
+#define PROGRAM_NAME "mkbench"
+#define PROGRAM_VERSION "0.01"
+
+#define GRID_RECT 0
+#define GRID_CURV 1
+#define GRID_TRIPOLAR 2
+#define GRID_UNSTR 3
+#define NGRIDTYPE 4
+
+#define NI_DEF 360
+#define NJ_DEF 300
+#define NK_DEF 30
+#define NREC_DEF 1
+#define NMEM_DEF 4
+#define DEFLATE_DEF 1
+
+#define LAT_SOUTH -78.0
+#define LAT_NORTH 89.5
+#define PHI0 50.0               /* southern edge of the tripolar cap */
+#define FILLVALUE -1.0e10
+
+#define DEG2RAD (M_PI / 180.0)
+
+static char* gridnames[NGRIDTYPE] = { "rect", "curv", "tripolar", "unstr" };
+
+static uint64_t rng = 88172645463325252ull;
+
+/** Uniform random number in [0, 1) (xorshift64*).
+ */
+static double rnd(void)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+
+    return (double) ((rng * 2685821657736338717ull) >> 11) / 9007199254740992.0;
+}
+
+/**
+ */
+static void usage(int status)
+{
+    printf("  Usage: %s -o <dir> [-g <grid>] [-n <ni> <nj>] [-k <nk>] [-r <nrec>] [-e <nmem>] [-c <nlayer>] [-d <level>]\n", PROGRAM_NAME);
+    printf("         %s -v\n", PROGRAM_NAME);
+    printf("  Options:\n");
+    printf("    -o <dir>       -- output directory (must exist)\n");
+    printf("    -g <grid>      -- source grid: rect, curv, tripolar or unstr (default: tripolar)\n");
+    printf("    -n <ni> <nj>   -- horizontal size (default: %d x %d; unstr: %d x %d nodes)\n", NI_DEF, NJ_DEF, NI_DEF, NJ_DEF);
+    printf("    -k <nk>        -- number of layers (default: %d)\n", NK_DEF);
+    printf("    -r <nrec>      -- number of records (default: %d)\n", NREC_DEF);
+    printf("    -e <nmem>      -- number of ensemble members (default: %d)\n", NMEM_DEF);
+    printf("    -c <nlayer>    -- number of layers in a chunk (default: 1)\n");
+    printf("    -d <level>     -- deflation level, 0 for none (default: %d)\n", DEFLATE_DEF);
+    printf("    -v             -- print version and exit\n");
+    printf("  Output:\n");
+    printf("    grid_src.nc    -- lon, lat and number of valid layers \"nk\"\n");
+    printf("    grid_dst.nc    -- lon, lat (rectangular, or unstructured for \"-g unstr\")\n");
+    printf("    mem<nnn>.nc    -- time, temp (double) and salt (float) on the source grid\n");
+    printf("    bench.info     -- dataset summary\n");
+    exit(status);
+}
+
+/**
+ */
+static void parse_commandline(int argc, char* argv[], char** dir, int* gridtype, int* ni, int* nj, int* nk, int* nrec, int* nmem, int* nlayer_chunk, int* deflate)
+{
+    int i;
+
+    if (argc == 1)
+        usage(0);
+
+    if (argc == 2 && argv[1][0] == '-' && argv[1][1] == 'v') {
+        printf("  %s v%s\n", PROGRAM_NAME, PROGRAM_VERSION);
+        printf("  GFU v%s\n", VERSION);
+        exit(0);
+    }
+
+    i = 1;
+    while (i < argc) {
+        if (argv[i][0] != '-') {
+            printf("  error: argument \"%s\" does not follow usage\n", argv[i]);
+            usage(1);
+        }
+        if (strcmp(argv[i], "-o") == 0) {
+            i++;
+            if (i == argc)
+                quit("no directory specified after \"-o\"");
+            *dir = argv[i];
+            i++;
+        } else if (strcmp(argv[i], "-g") == 0) {
+            i++;
+            if (i == argc)
+                quit("no grid type specified after \"-g\"");
+            for (*gridtype = 0; *gridtype < NGRIDTYPE; ++(*gridtype))
+                if (strcmp(argv[i], gridnames[*gridtype]) == 0)
+                    break;
+            if (*gridtype == NGRIDTYPE)
+                quit("unknown grid type \"%s\"", argv[i]);
+            i++;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            i++;
+            if (i + 1 >= argc || !str2int(argv[i], ni) || !str2int(argv[i + 1], nj) || *ni < 2 || *nj < 2)
+                quit("could not read grid size after \"-n\"");
+            i += 2;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            i++;
+            if (i == argc || !str2int(argv[i], nk) || *nk < 1)
+                quit("could not read number of layers after \"-k\"");
+            i++;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            i++;
+            if (i == argc || !str2int(argv[i], nrec) || *nrec < 1)
+                quit("could not read number of records after \"-r\"");
+            i++;
+        } else if (strcmp(argv[i], "-e") == 0) {
+            i++;
+            if (i == argc || !str2int(argv[i], nmem) || *nmem < 1)
+                quit("could not read number of members after \"-e\"");
+            i++;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            i++;
+            if (i == argc || !str2int(argv[i], nlayer_chunk) || *nlayer_chunk < 1)
+                quit("could not read number of layers in a chunk after \"-c\"");
+            i++;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            i++;
+            if (i == argc || !str2int(argv[i], deflate) || *deflate < 0 || *deflate > 9)
+                quit("could not read deflation level (0 to 9) after \"-d\"");
+            i++;
+        } else
+            quit("unknown option \"%s\"", argv[i]);
+    }
+    if (*dir == NULL)
+        quit("no output directory specified");
+}
+
+/** Calculates node coordinates of the source grid. For GRID_RECT only the
+ ** first ni elements of `lon' and nj elements of `lat' are meaningful.
+ ** The tripolar grid is regular south of PHI0; north of it the grid lines
+ ** converge to two singular points at 0 and 180E (placed on land), as in the
+ ** ORCA grids.
+ */
+static void src_getcoords(int gridtype, int ni, int nj, double lon[], double lat[])
+{
+    int i, j, ij;
+
+    if (gridtype == GRID_UNSTR) {
+        for (ij = 0; ij < ni * nj; ++ij) {
+            lat[ij] = asin(2.0 * rnd() - 1.0) / DEG2RAD;
+            lon[ij] = 360.0 * rnd() - 180.0;
+        }
+        return;
+    }
+    if (gridtype == GRID_RECT) {
+        for (i = 0; i < ni; ++i)
+            lon[i] = -180.0 + 360.0 * (i + 0.5) / ni;
+        for (j = 0; j < nj; ++j)
+            lat[j] = LAT_SOUTH + (LAT_NORTH - LAT_SOUTH) * (j + 0.5) / nj;
+        return;
+    }
+    for (j = 0, ij = 0; j < nj; ++j) {
+        double latj = LAT_SOUTH + (LAT_NORTH - LAT_SOUTH) * (j + 0.5) / nj;
+
+        for (i = 0; i < ni; ++i, ++ij) {
+            double loni = -180.0 + 360.0 * (i + 0.5) / ni;
+
+            if (gridtype == GRID_CURV) {
+                lon[ij] = loni + 2.0 * sin(2.0 * M_PI * j / nj);
+                lat[ij] = latj + 0.5 * sin(2.0 * loni * DEG2RAD) * cos(latj * DEG2RAD);
+            } else {
+                lon[ij] = loni;
+                lat[ij] = (latj <= PHI0) ? latj : PHI0 + (latj - PHI0) * (0.05 + 0.95 * fabs(sin(loni * DEG2RAD)));
+            }
+        }
+    }
+}
+
+/** Calculates number of valid layers in each node (0 on land).
+ */
+static void src_getnk(int gridtype, int ni, int nj, int nk, double lon[], double lat[], int nklev[])
+{
+    int n = ni * nj;
+    int ij;
+
+    for (ij = 0; ij < n; ++ij) {
+        double lo = (gridtype == GRID_RECT) ? lon[ij % ni] : lon[ij];
+        double la = (gridtype == GRID_RECT) ? lat[ij / ni] : lat[ij];
+        double g = sin(2.0 * lo * DEG2RAD + 1.0) * cos(3.0 * la * DEG2RAD);
+
+        if (g > 0.6 || la < -70.0 || (gridtype == GRID_TRIPOLAR && la > PHI0 && fabs(sin(lo * DEG2RAD)) < 0.3))
+            nklev[ij] = 0;
+        else
+            nklev[ij] = 1 + (int) ((nk - 1) * (0.6 - g) / 1.6);
+    }
+}
+
+/** Writes a grid file.
+ */
+static void grid_write(char fname[], int gridtype, int ni, int nj, double lon[], double lat[], int nklev[])
+{
+    int ncid, dimids[2], varid_lon, varid_lat, varid_nk = -1;
+
+    ncw_create(fname, NC_CLOBBER | NC_NETCDF4, &ncid);
+    if (gridtype == GRID_UNSTR) {
+        ncw_def_dim(ncid, "nodes", ni * nj, &dimids[0]);
+        ncw_def_var(ncid, "lon", NC_DOUBLE, 1, dimids, &varid_lon);
+        ncw_def_var(ncid, "lat", NC_DOUBLE, 1, dimids, &varid_lat);
+        if (nklev != NULL)
+            ncw_def_var(ncid, "nk", NC_INT, 1, dimids, &varid_nk);
+    } else {
+        ncw_def_dim(ncid, "y", nj, &dimids[0]);
+        ncw_def_dim(ncid, "x", ni, &dimids[1]);
+        if (gridtype == GRID_RECT) {
+            ncw_def_var(ncid, "lon", NC_DOUBLE, 1, &dimids[1], &varid_lon);
+            ncw_def_var(ncid, "lat", NC_DOUBLE, 1, &dimids[0], &varid_lat);
+        } else {
+            ncw_def_var(ncid, "lon", NC_DOUBLE, 2, dimids, &varid_lon);
+            ncw_def_var(ncid, "lat", NC_DOUBLE, 2, dimids, &varid_lat);
+        }
+        if (nklev != NULL)
+            ncw_def_var(ncid, "nk", NC_INT, 2, dimids, &varid_nk);
+    }
+    ncw_put_att_text(ncid, varid_lon, "units", "degrees_east");
+    ncw_put_att_text(ncid, varid_lat, "units", "degrees_north");
+    if (nklev != NULL)
+        ncw_put_att_text(ncid, varid_nk, "long_name", "number of valid layers");
+    ncw_put_att_text(ncid, NC_GLOBAL, "grid_type", gridnames[gridtype]);
+    ncw_enddef(ncid);
+
+    ncw_put_var_double(ncid, varid_lon, lon);
+    ncw_put_var_double(ncid, varid_lat, lat);
+    if (nklev != NULL)
+        ncw_put_var_int(ncid, varid_nk, nklev);
+    ncw_close(ncid);
+}
+
+/** Writes an ensemble member. The fields are smooth functions of location
+ ** and depth with a member-specific noise. The data is written layer by
+ ** layer.
+ */
+static void member_write(char fname[], int gridtype, int ni, int nj, int nk, int nrec, double lon[], double lat[], int nklev[], int nlayer_chunk, int deflate)
+{
+    int n = ni * nj;
+    int nhdim = (gridtype == GRID_UNSTR) ? 1 : 2;
+    int ncid, dimids[4], varid_time, varid_temp, varid_salt;
+    size_t chunksizes[4], start[4], count[4];
+    double fill_d = FILLVALUE;
+    float fill_f = (float) FILLVALUE;
+    double* vd = malloc(n * sizeof(double));
+    float* vf = malloc(n * sizeof(float));
+    int r, k, ij;
+
+    ncw_create(fname, NC_CLOBBER | NC_NETCDF4, &ncid);
+    ncw_def_dim(ncid, "time", NC_UNLIMITED, &dimids[0]);
+    ncw_def_dim(ncid, "z", nk, &dimids[1]);
+    if (gridtype == GRID_UNSTR)
+        ncw_def_dim(ncid, "nodes", n, &dimids[2]);
+    else {
+        ncw_def_dim(ncid, "y", nj, &dimids[2]);
+        ncw_def_dim(ncid, "x", ni, &dimids[3]);
+    }
+    ncw_def_var(ncid, "time", NC_DOUBLE, 1, dimids, &varid_time);
+    ncw_put_att_text(ncid, varid_time, "units", "days since 2000-01-01");
+    ncw_def_var(ncid, "temp", NC_DOUBLE, 2 + nhdim, dimids, &varid_temp);
+    ncw_put_att_double(ncid, varid_temp, "_FillValue", 1, &fill_d);
+    ncw_put_att_text(ncid, varid_temp, "units", "degC");
+    ncw_def_var(ncid, "salt", NC_FLOAT, 2 + nhdim, dimids, &varid_salt);
+    ncw_put_att_float(ncid, varid_salt, "_FillValue", 1, &fill_f);
+    ncw_put_att_text(ncid, varid_salt, "units", "psu");
+
+    chunksizes[0] = 1;
+    chunksizes[1] = (nlayer_chunk < nk) ? nlayer_chunk : nk;
+    chunksizes[2] = (gridtype == GRID_UNSTR) ? n : nj;
+    chunksizes[3] = ni;
+    ncw_def_var_chunking(ncid, varid_temp, NC_CHUNKED, chunksizes);
+    ncw_def_var_chunking(ncid, varid_salt, NC_CHUNKED, chunksizes);
+    if (deflate > 0) {
+        ncw_def_var_deflate(ncid, varid_temp, 1, 1, deflate);
+        ncw_def_var_deflate(ncid, varid_salt, 1, 1, deflate);
+    }
+    ncw_enddef(ncid);
+
+    start[2] = 0;
+    start[3] = 0;
+    count[0] = 1;
+    count[1] = 1;
+    count[2] = (gridtype == GRID_UNSTR) ? n : nj;
+    count[3] = ni;
+    for (r = 0; r < nrec; ++r) {
+        double t = (double) r;
+
+        start[0] = r;
+        ncw_put_vara_double(ncid, varid_time, start, count, &t);
+        for (k = 0; k < nk; ++k) {
+            double decay = exp(-(double) k / (0.3 * nk));
+
+            start[1] = k;
+            for (ij = 0; ij < n; ++ij) {
+                double lo = ((gridtype == GRID_RECT) ? lon[ij % ni] : lon[ij]) * DEG2RAD;
+                double la = ((gridtype == GRID_RECT) ? lat[ij / ni] : lat[ij]) * DEG2RAD;
+
+                if (k >= nklev[ij]) {
+                    vd[ij] = fill_d;
+                    vf[ij] = fill_f;
+                } else {
+                    vd[ij] = 2.0 + 25.0 * cos(la) * decay + 0.5 * sin(3.0 * lo + 0.1 * r) + 0.2 * (rnd() - 0.5);
+                    vf[ij] = (float) (34.5 + 1.5 * sin(la) * decay + 0.3 * cos(2.0 * lo) + 0.05 * (rnd() - 0.5));
+                }
+            }
+            ncw_put_vara_double(ncid, varid_temp, start, count, vd);
+            ncw_put_vara_float(ncid, varid_salt, start, count, vf);
+        }
+    }
+    ncw_close(ncid);
+
+    free(vd);
+    free(vf);
+}
+
+/**
+ */
+int main(int argc, char* argv[])
+{
+    char* dir = NULL;
+    int gridtype = GRID_TRIPOLAR;
+    int ni = NI_DEF, nj = NJ_DEF, nk = NK_DEF, nrec = NREC_DEF, nmem = NMEM_DEF;
+    int nlayer_chunk = 1, deflate = DEFLATE_DEF;
+    char fname[MAXSTRLEN];
+    double* lon;
+    double* lat;
+    int* nklev;
+    FILE* f;
+    int e;
+
+    parse_commandline(argc, argv, &dir, &gridtype, &ni, &nj, &nk, &nrec, &nmem, &nlayer_chunk, &deflate);
+    ncw_set_quitfn(quit);
+
+    printf("  %s grid, %d x %d x %d, %d record(s), %d member(s):\n", gridnames[gridtype], ni, nj, nk, nrec, nmem);
+    lon = malloc(ni * nj * sizeof(double));
+    lat = malloc(ni * nj * sizeof(double));
+    nklev = malloc(ni * nj * sizeof(int));
+
+    src_getcoords(gridtype, ni, nj, lon, lat);
+    src_getnk(gridtype, ni, nj, nk, lon, lat, nklev);
+    snprintf(fname, MAXSTRLEN, "%s/grid_src.nc", dir);
+    printf("    %s\n", fname);
+    grid_write(fname, gridtype, ni, nj, lon, lat, nklev);
+
+    for (e = 0; e < nmem; ++e) {
+        snprintf(fname, MAXSTRLEN, "%s/mem%03d.nc", dir, e + 1);
+        printf("    %s\n", fname);
+        fflush(stdout);
+        member_write(fname, gridtype, ni, nj, nk, nrec, lon, lat, nklev, nlayer_chunk, deflate);
+    }
+
+    /*
+     * destination grid: rectangular grid offset by half a cell from the
+     * source, or another set of random nodes for unstructured source
+     */
+    if (gridtype == GRID_UNSTR)
+        src_getcoords(GRID_UNSTR, ni, nj, lon, lat);
+    else {
+        int i, j;
+
+        for (i = 0; i < ni; ++i)
+            lon[i] = -180.0 + 360.0 * i / ni;
+        for (j = 0; j < nj; ++j)
+            lat[j] = LAT_SOUTH + (LAT_NORTH - LAT_SOUTH) * j / (nj - 1);
+    }
+    snprintf(fname, MAXSTRLEN, "%s/grid_dst.nc", dir);
+    printf("    %s\n", fname);
+    grid_write(fname, (gridtype == GRID_UNSTR) ? GRID_UNSTR : GRID_RECT, ni, nj, lon, lat, NULL);
+
+    snprintf(fname, MAXSTRLEN, "%s/bench.info", dir);
+    if ((f = fopen(fname, "w")) == NULL)
+        quit("%s: could not open for writing", fname);
+    fprintf(f, "grid=%s\nni=%d\nnj=%d\nnk=%d\nnrec=%d\nnmem=%d\nnvar=2\nchunk=%d\ndeflate=%d\n", gridnames[gridtype], ni, nj, nk, nrec, nmem, nlayer_chunk, deflate);
+    fclose(f);
+
+    free(lon);
+    free(lat);
+    free(nklev);
+
+    return 0;
+}
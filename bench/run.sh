@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# File:        run.sh
+#
+# Description: Generates a synthetic dataset with bin/mkbench and times GFU
+#              utilities on it, reporting throughput in MB/s (of the input
+#              data) and layers/s. Each utility is run with "-P"; its profile
+#              is saved to <dir>/<test>.log.
+#
+# Usage:       sh bench/run.sh <dir> [<mkbench options>]
+#
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "  Usage: sh bench/run.sh <dir> [<mkbench options>]"
+    exit 1
+fi
+
+BIN=$(cd $(dirname $0)/../bin && pwd)
+DIR=$1
+shift
+
+mkdir -p $DIR
+$BIN/mkbench -o $DIR "$@"
+. $DIR/bench.info
+
+cd $DIR
+rm -f regrid.nc weights.nc ave.nc d2f.nc cat.nc
+
+MEMBERS=$(i=1; while [ $i -le $nmem ]; do printf "mem%03d.nc " $i; i=$((i + 1)); done)
+
+# size of files in bytes
+size()
+{
+    cat "$@" | wc -c
+}
+
+# run <test> <bytes> <layers> <command> [...]
+run()
+{
+    name=$1
+    bytes=$2
+    layers=$3
+    shift 3
+    t0=$(date +%s.%N)
+    "$@" > $name.log 2>&1 || { echo "  $name: failed, see $DIR/$name.log"; exit 1; }
+    t1=$(date +%s.%N)
+    echo "$name $t0 $t1 $bytes $layers" | awk '{t = $3 - $2; printf("  %-14s %10.3f %10.1f %10.1f\n", $1, t, (t > 0) ? $4 / 1.0e6 / t : 0, (t > 0) ? $5 / t : 0)}'
+}
+
+echo
+echo "  $grid grid, $ni x $nj x $nk, $nrec record(s), $nmem member(s), chunk = $chunk layer(s), deflate = $deflate:"
+echo "  test             time (s)       MB/s   layers/s"
+
+MEM1=mem001.nc
+NLAYER=$(expr $nrec \* $nk \* $nvar)
+
+run regrid_ll $(size $MEM1) $NLAYER $BIN/regrid_ll -i $MEM1 -o regrid.nc -v temp salt -gi grid_src.nc lon lat nk -go grid_dst.nc lon lat -P
+run regrid_ll-wo $(size grid_src.nc) $nk $BIN/regrid_ll -gi grid_src.nc lon lat nk -go grid_dst.nc lon lat -wo weights.nc -P
+run regrid_ll-wi $(size $MEM1) $NLAYER $BIN/regrid_ll -i $MEM1 -o regrid.nc -v temp salt -wi weights.nc -P
+run ncave $(size $MEMBERS) $(expr $NLAYER \* $nmem) $BIN/ncave -v temp -v salt -s sd -p -f -P $MEMBERS ave.nc
+run ncd2f $(size $MEM1) $(expr $nrec \* $nk) $BIN/ncd2f -i $MEM1 -o d2f.nc -v temp -O -P
+if [ $nmem -gt 1 ]; then
+    MEM2=mem002.nc
+    run nccat $(size $MEM1 $MEM2) $(expr $NLAYER \* 2) $BIN/nccat -i $MEM1 $MEM2 -o cat.nc -d time -P
+fi
@@ -19,12 +19,15 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdarg.h>
 #include <math.h>
+#include <float.h>
 #include <stdint.h>
 #include <assert.h>
 #include "ncw.h"
 #include "ncutils.h"
+#include "profile.h"
 
 static void ncu_quit_fn_def(char* format, ...);
 static ncu_quit_fn quit = ncu_quit_fn_def;
@@ -52,27 +55,30 @@ void ncu_set_quitfn(ncu_quit_fn quitfn)
     quit = quitfn;
 }
 
-/**
+/** Gets the number of layers of a variable in an open file.
  */
-int ncu_getnfields(char fname[], char varname[])
+int ncu_inq_nfields(int ncid, int varid)
 {
-    int ncid;
-    int varid;
     int ndims;
     size_t dimlen[4];
     int hasrecorddim;
 
-    ncw_open(fname, NC_NOWRITE, &ncid);
-    ncw_inq_varid(ncid, varname, &varid);
     ncw_inq_vardims(ncid, varid, 4, &ndims, dimlen);
-    hasrecorddim = (ncw_var_hasunlimdim(ncid, varid) || dimlen[0] == 1);
-    ncw_close(ncid);
+    if (ndims > 4) {
+        char varname[NC_MAX_NAME];
+
+        ncw_inq_varname(ncid, varid, varname);
+        quit("%s: %s: do not know how to handle more than 4-dimensional variables\n", ncw_get_path(ncid), varname);
+    }
+    hasrecorddim = (ncw_var_hasunlimdim(ncid, varid) || (ndims > 0 && dimlen[0] == 1));
 
-    if (ndims > 4)
-        quit("%s: %s: do not know how to handle more than 4-dimensional variables\n", fname, varname);
     if (ndims == 4) {
-        if (!hasrecorddim)
-            quit("%s: %s: expect an unlimited dimension to be present for a 4-dimensional variable\n", fname, varname);
+        if (!hasrecorddim) {
+            char varname[NC_MAX_NAME];
+
+            ncw_inq_varname(ncid, varid, varname);
+            quit("%s: %s: expect an unlimited dimension to be present for a 4-dimensional variable\n", ncw_get_path(ncid), varname);
+        }
         return (int) dimlen[1];
     }
     if (ndims == 3)
@@ -85,429 +91,309 @@ int ncu_getnfields(char fname[], char varname[])
 
 /**
  */
-void ncu_readvarfloat(int ncid, int varid, size_t n, float v[])
+int ncu_getnfields(char fname[], char varname[])
 {
-    char attnames[2][20] = { "_FillValue", "missing_value" };
-    nc_type vartype = -1;
-    int typesize = 0;
-    void* vv = NULL;
-    size_t i, s;
+    int ncid;
+    int varid;
+    int nfields;
 
-    ncw_check_varsize(ncid, varid, n);
-    ncw_get_var_float_fixerange(ncid, varid, v);
+    ncw_open(fname, NC_NOWRITE, &ncid);
+    ncw_inq_varid(ncid, varname, &varid);
+    nfields = ncu_inq_nfields(ncid, varid);
+    ncw_close(ncid);
 
-    ncw_inq_vartype(ncid, varid, &vartype);
-    typesize = ncw_sizeof(vartype);
+    return nfields;
+}
 
-    for (s = 0; s < 2; ++s) {
-        char* attname = attnames[s];
+/*
+ * Descriptor of a (multi-dimensional) field in a NetCDF file. It keeps the
+ * file open and holds the variable's dimensions and the attributes that
+ * ncu_field_read() and ncu_field_write() need for unpacking/packing, so that
+ * a number of layers can be read or written without the overhead of
+ * re-opening the file and re-querying the metadata for each layer.
+ */
+struct ncu_field {
+    char* fname;
+    char* varname;
+    int ncid;
+    int owner;                  /* 1 if the file has been opened by
+                                 * ncu_field_open() */
+    int varid;
+    int ni;
+    int nj;
+    int nk;
+    int ndims;
+    size_t dimlen[4];
+    int hasrecorddim;
+    int record;                 /* record to read or write (-1 = the last
+                                 * one) */
+    nc_type vartype;
+    int typesize;
+
+    /*
+     * attributes in the native type of the variable (used for reading)
+     */
+    int hasfill;
+    int nofill;
+    char fill[8];
+    int hasmissing;
+    char missing[8];
+    int hasmin;
+    char valid_min[8];
+    int hasmax;
+    char valid_max[8];
+    int hasrange;
+    char valid_range[16];
+
+    /*
+     * attributes converted to float (used for writing)
+     */
+    float fill_f;
+    float missing_f;
+    float valid_min_f;
+    float valid_max_f;
+    float valid_range_f[2];
+
+    int hasscale;
+    float scale_factor;
+    int hasoffset;
+    float add_offset;
+
+    /*
+     * scratch buffer for reading values in the native type
+     */
+    size_t nvv;
+    void* vv;
+
+    int cacheset;               /* 1 if the chunk cache has been sized */
+};
 
-        if (ncw_att_exists2(ncid, varid, attname)) {
-            ncw_check_attlen(ncid, varid, attname, 1);
+/**
+ */
+static double ncu_native2double(nc_type type, void* value)
+{
+    switch (type) {
+    case NC_BYTE:
+        return (double) ((signed char*) value)[0];
+    case NC_CHAR:
+        return (double) ((char*) value)[0];
+    case NC_UBYTE:
+        return (double) ((unsigned char*) value)[0];
+    case NC_SHORT:
+        return (double) ((int16_t*) value)[0];
+    case NC_USHORT:
+        return (double) ((uint16_t*) value)[0];
+    case NC_INT:
+        return (double) ((int32_t*) value)[0];
+    case NC_UINT:
+        return (double) ((uint32_t*) value)[0];
+    case NC_INT64:
+        return (double) ((int64_t*) value)[0];
+    case NC_UINT64:
+        return (double) ((uint64_t*) value)[0];
+    case NC_FLOAT:
+        return (double) ((float*) value)[0];
+    case NC_DOUBLE:
+        return ((double*) value)[0];
+    default:
+        quit("programming error");
+    }
 
-            if (vv == NULL) {
-                if (vartype != NC_FLOAT) {
-                    vv = malloc(n * typesize);
-                    ncw_get_var(ncid, varid, vv);
-                } else
-                    vv = v;
-            }
+    return NAN;
+}
 
-            if (typesize == 1) {
-                int8_t value;
-
-                ncw_get_att(ncid, varid, attname, &value);
-                for (i = 0; i < n; ++i)
-                    if (((int8_t*) vv)[i] == value)
-                        v[i] = NAN;
-            } else if (typesize == 2) {
-                int16_t value;
-
-                ncw_get_att(ncid, varid, attname, &value);
-                for (i = 0; i < n; ++i)
-                    if (((int16_t*) vv)[i] == value)
-                        v[i] = NAN;
-            } else if (typesize == 4) {
-                int32_t value;
-
-                ncw_get_att(ncid, varid, attname, &value);
-                for (i = 0; i < n; ++i)
-                    if (((int32_t*) vv)[i] == value)
-                        v[i] = NAN;
-            } else if (typesize == 8) {
-                int64_t value;
-
-                ncw_get_att(ncid, varid, attname, &value);
-                for (i = 0; i < n; ++i)
-                    if (((int64_t*) vv)[i] == value)
-                        v[i] = NAN;
-            } else
-                quit("programming error");
+/** Reads the attributes of the field's variable that are used for decoding
+ ** and encoding the values.
+ */
+static void ncu_field_getatts(ncu_field* f)
+{
+    int ncid = f->ncid;
+    int varid = f->varid;
+
+    if (ncw_att_exists2(ncid, varid, "_FillValue")) {
+        ncw_check_attlen(ncid, varid, "_FillValue", 1);
+        ncw_get_att(ncid, varid, "_FillValue", f->fill);
+        ncw_get_att_float(ncid, varid, "_FillValue", &f->fill_f);
+        f->hasfill = 1;
+    } else {
+        ncw_inq_var_fill(ncid, varid, &f->nofill, f->fill);
+        if (!f->nofill) {
+            f->fill_f = (float) ncu_native2double(f->vartype, f->fill);
+            f->hasfill = 1;
         }
     }
-    if (!ncw_att_exists2(ncid, varid, "_FillValue")) {
-        if (vv == NULL) {
-            if (typesize != sizeof(float)) {
-                vv = malloc(n * typesize);
-                ncw_get_var(ncid, varid, vv);
-            } else
-                vv = v;
-        }
-        if (typesize == 1) {
-            int nofill;
-            int8_t value;
-
-            ncw_inq_var_fill(ncid, varid, &nofill, &value);
-            if (nofill == 0)
-                for (i = 0; i < n; ++i)
-                    if (((int8_t*) vv)[i] == value)
-                        v[i] = NAN;
-        } else if (typesize == 2) {
-            int nofill;
-            int16_t value;
-
-            ncw_inq_var_fill(ncid, varid, &nofill, &value);
-            if (nofill == 0)
-                for (i = 0; i < n; ++i)
-                    if (((int16_t*) vv)[i] == value)
-                        v[i] = NAN;
-        } else if (typesize == 4) {
-            int nofill;
-            int32_t value;
-
-            ncw_inq_var_fill(ncid, varid, &nofill, &value);
-            if (nofill == 0)
-                for (i = 0; i < n; ++i)
-                    if (((int32_t*) vv)[i] == value)
-                        v[i] = NAN;
-        } else if (typesize == 8) {
-            int nofill;
-            int64_t value;
-
-            ncw_inq_var_fill(ncid, varid, &nofill, &value);
-            if (nofill == 0)
-                for (i = 0; i < n; ++i)
-                    if (((int64_t*) vv)[i] == value)
-                        v[i] = NAN;
-        } else
-            quit("programming error");
+    if (ncw_att_exists2(ncid, varid, "missing_value")) {
+        ncw_check_attlen(ncid, varid, "missing_value", 1);
+        ncw_get_att(ncid, varid, "missing_value", f->missing);
+        ncw_get_att_float(ncid, varid, "missing_value", &f->missing_f);
+        f->hasmissing = 1;
     }
     if (ncw_att_exists2(ncid, varid, "valid_min")) {
         ncw_check_attlen(ncid, varid, "valid_min", 1);
-
-        if (vv == NULL) {
-            if (typesize != sizeof(float)) {
-                vv = malloc(n * typesize);
-                ncw_get_var(ncid, varid, vv);
-            } else
-                vv = v;
-        }
-
-        if (vartype == NC_BYTE || vartype == NC_CHAR) {
-            char value;
-
-            ncw_get_att(ncid, varid, "valid_min", &value);
-            for (i = 0; i < n; ++i)
-                if (((char*) vv)[i] < value)
-                    v[i] = NAN;
-        } else if (vartype == NC_UBYTE) {
-            char value;
-
-            ncw_get_att(ncid, varid, "valid_min", &value);
-            for (i = 0; i < n; ++i)
-                if (((unsigned char*) vv)[i] < value)
-                    v[i] = NAN;
-        } else if (vartype == NC_SHORT) {
-            int16_t value;
-
-            ncw_get_att(ncid, varid, "valid_min", &value);
-            for (i = 0; i < n; ++i)
-                if (((int16_t*) vv)[i] < value)
-                    v[i] = NAN;
-        } else if (vartype == NC_USHORT) {
-            uint16_t value;
-
-            ncw_get_att(ncid, varid, "valid_min", &value);
-            for (i = 0; i < n; ++i)
-                if (((uint16_t*) vv)[i] < value)
-                    v[i] = NAN;
-        } else if (vartype == NC_INT || vartype == NC_LONG) {
-            int32_t value;
-
-            ncw_get_att(ncid, varid, "valid_min", &value);
-            for (i = 0; i < n; ++i)
-                if (((int32_t*) vv)[i] < value)
-                    v[i] = NAN;
-        } else if (vartype == NC_UINT) {
-            uint32_t value;
-
-            ncw_get_att(ncid, varid, "valid_min", &value);
-            for (i = 0; i < n; ++i)
-                if (((uint32_t*) vv)[i] < value)
-                    v[i] = NAN;
-        } else if (vartype == NC_INT64) {
-            int64_t value;
-
-            ncw_get_att(ncid, varid, "valid_min", &value);
-            for (i = 0; i < n; ++i)
-                if (((int64_t*) vv)[i] < value)
-                    v[i] = NAN;
-        } else if (vartype == NC_UINT64) {
-            uint64_t value;
-
-            ncw_get_att(ncid, varid, "valid_min", &value);
-            for (i = 0; i < n; ++i)
-                if (((uint64_t*) vv)[i] < value)
-                    v[i] = NAN;
-        } else if (vartype == NC_FLOAT) {
-            float value;
-
-            assert(sizeof(float) == 4);
-            ncw_get_att(ncid, varid, "valid_min", &value);
-            for (i = 0; i < n; ++i)
-                if (((float*) vv)[i] < value)
-                    v[i] = NAN;
-        } else if (vartype == NC_DOUBLE) {
-            double value;
-
-            assert(sizeof(double) == 8);
-            ncw_get_att(ncid, varid, "valid_min", &value);
-            for (i = 0; i < n; ++i)
-                if (((double*) vv)[i] < value)
-                    v[i] = NAN;
-        } else
-            quit("programming error");
+        ncw_get_att(ncid, varid, "valid_min", f->valid_min);
+        ncw_get_att_float(ncid, varid, "valid_min", &f->valid_min_f);
+        f->hasmin = 1;
     }
     if (ncw_att_exists2(ncid, varid, "valid_max")) {
         ncw_check_attlen(ncid, varid, "valid_max", 1);
-
-        if (vv == NULL) {
-            if (typesize != sizeof(float)) {
-                vv = malloc(n * typesize);
-                ncw_get_var(ncid, varid, vv);
-            } else
-                vv = v;
-        }
-
-        if (vartype == NC_BYTE || vartype == NC_CHAR) {
-            char value;
-
-            ncw_get_att(ncid, varid, "valid_max", &value);
-            for (i = 0; i < n; ++i)
-                if (((char*) vv)[i] > value)
-                    v[i] = NAN;
-        } else if (vartype == NC_UBYTE) {
-            char value;
-
-            ncw_get_att(ncid, varid, "valid_max", &value);
-            for (i = 0; i < n; ++i)
-                if (((unsigned char*) vv)[i] > value)
-                    v[i] = NAN;
-        } else if (vartype == NC_SHORT) {
-            int16_t value;
-
-            ncw_get_att(ncid, varid, "valid_max", &value);
-            for (i = 0; i < n; ++i)
-                if (((int16_t*) vv)[i] > value)
-                    v[i] = NAN;
-        } else if (vartype == NC_USHORT) {
-            uint16_t value;
-
-            ncw_get_att(ncid, varid, "valid_max", &value);
-            for (i = 0; i < n; ++i)
-                if (((uint16_t*) vv)[i] > value)
-                    v[i] = NAN;
-        } else if (vartype == NC_INT || vartype == NC_LONG) {
-            int32_t value;
-
-            ncw_get_att(ncid, varid, "valid_max", &value);
-            for (i = 0; i < n; ++i)
-                if (((int32_t*) vv)[i] > value)
-                    v[i] = NAN;
-        } else if (vartype == NC_UINT) {
-            uint32_t value;
-
-            ncw_get_att(ncid, varid, "valid_max", &value);
-            for (i = 0; i < n; ++i)
-                if (((uint32_t*) vv)[i] > value)
-                    v[i] = NAN;
-        } else if (vartype == NC_INT64) {
-            int64_t value;
-
-            ncw_get_att(ncid, varid, "valid_max", &value);
-            for (i = 0; i < n; ++i)
-                if (((int64_t*) vv)[i] > value)
-                    v[i] = NAN;
-        } else if (vartype == NC_UINT64) {
-            uint64_t value;
-
-            ncw_get_att(ncid, varid, "valid_max", &value);
-            for (i = 0; i < n; ++i)
-                if (((uint64_t*) vv)[i] > value)
-                    v[i] = NAN;
-        } else if (vartype == NC_FLOAT) {
-            float value;
-
-            assert(sizeof(float) == 4);
-            ncw_get_att(ncid, varid, "valid_max", &value);
-            for (i = 0; i < n; ++i)
-                if (((float*) vv)[i] > value)
-                    v[i] = NAN;
-        } else if (vartype == NC_DOUBLE) {
-            double value;
-
-            assert(sizeof(double) == 8);
-            ncw_get_att(ncid, varid, "valid_max", &value);
-            for (i = 0; i < n; ++i)
-                if (((double*) vv)[i] > value)
-                    v[i] = NAN;
-        } else
-            quit("programming error");
+        ncw_get_att(ncid, varid, "valid_max", f->valid_max);
+        ncw_get_att_float(ncid, varid, "valid_max", &f->valid_max_f);
+        f->hasmax = 1;
     }
     if (ncw_att_exists2(ncid, varid, "valid_range")) {
         ncw_check_attlen(ncid, varid, "valid_range", 2);
-
-        if (vv == NULL) {
-            if (typesize != sizeof(float)) {
-                vv = malloc(n * typesize);
-                ncw_get_var(ncid, varid, vv);
-            } else
-                vv = v;
-        }
-
-        if (vartype == NC_BYTE || vartype == NC_CHAR) {
-            char value[2];
-
-            ncw_get_att(ncid, varid, "valid_range", value);
-            for (i = 0; i < n; ++i)
-                if (((char*) vv)[i] < value[0] || ((char*) vv)[i] > value[1])
-                    v[i] = NAN;
-        } else if (vartype == NC_UBYTE) {
-            char value[2];
-
-            ncw_get_att(ncid, varid, "valid_range", value);
-            for (i = 0; i < n; ++i)
-                if (((unsigned char*) vv)[i] < value[0] || ((unsigned char*) vv)[i] > value[1])
-                    v[i] = NAN;
-        } else if (vartype == NC_SHORT) {
-            int16_t value[2];
-
-            ncw_get_att(ncid, varid, "valid_range", value);
-            for (i = 0; i < n; ++i)
-                if (((int16_t*) vv)[i] < value[0] || ((int16_t*) vv)[i] > value[1])
-                    v[i] = NAN;
-        } else if (vartype == NC_USHORT) {
-            uint16_t value[2];
-
-            ncw_get_att(ncid, varid, "valid_range", value);
-            for (i = 0; i < n; ++i)
-                if (((uint16_t*) vv)[i] < value[0] || ((uint16_t*) vv)[i] > value[1])
-                    v[i] = NAN;
-        } else if (vartype == NC_INT || vartype == NC_LONG) {
-            int32_t value[2];
-
-            ncw_get_att(ncid, varid, "valid_range", value);
-            for (i = 0; i < n; ++i)
-                if (((int32_t*) vv)[i] < value[0] || ((int32_t*) vv)[i] > value[1])
-                    v[i] = NAN;
-        } else if (vartype == NC_UINT) {
-            uint32_t value[2];
-
-            ncw_get_att(ncid, varid, "valid_range", value);
-            for (i = 0; i < n; ++i)
-                if (((uint32_t*) vv)[i] < value[0] || ((uint32_t*) vv)[i] > value[1])
-                    v[i] = NAN;
-        } else if (vartype == NC_INT64) {
-            int64_t value[2];
-
-            ncw_get_att(ncid, varid, "valid_range", value);
-            for (i = 0; i < n; ++i)
-                if (((int64_t*) vv)[i] < value[0] || ((int64_t*) vv)[i] > value[1])
-                    v[i] = NAN;
-        } else if (vartype == NC_UINT64) {
-            uint64_t value[2];
-
-            ncw_get_att(ncid, varid, "valid_range", value);
-            for (i = 0; i < n; ++i)
-                if (((uint64_t*) vv)[i] < value[0] || ((uint64_t*) vv)[i] > value[1])
-                    v[i] = NAN;
-        } else if (vartype == NC_FLOAT) {
-            float value[2];
-
-            assert(sizeof(float) == 4);
-            ncw_get_att(ncid, varid, "valid_range", value);
-            for (i = 0; i < n; ++i)
-                if (((float*) vv)[i] < value[0] || ((float*) vv)[i] > value[1])
-                    v[i] = NAN;
-        } else if (vartype == NC_DOUBLE) {
-            double value[2];
-
-            assert(sizeof(double) == 8);
-            ncw_get_att(ncid, varid, "valid_range", value);
-            for (i = 0; i < n; ++i)
-                if (((double*) vv)[i] < value[0]
-                    || ((double*) vv)[i] > value[1])
-                    v[i] = NAN;
-        } else
-            quit("programming error");
+        ncw_get_att(ncid, varid, "valid_range", f->valid_range);
+        ncw_get_att_float(ncid, varid, "valid_range", f->valid_range_f);
+        f->hasrange = 1;
     }
-    if (vv != NULL && vartype != NC_FLOAT)
-        free(vv);
-
     if (ncw_att_exists(ncid, varid, "scale_factor")) {
-        float scale_factor;
-
         ncw_check_attlen(ncid, varid, "scale_factor", 1);
-        ncw_get_att_float(ncid, varid, "scale_factor", &scale_factor);
-        for (i = 0; i < n; ++i)
-            v[i] *= scale_factor;
+        ncw_get_att_float(ncid, varid, "scale_factor", &f->scale_factor);
+        f->hasscale = 1;
     }
     if (ncw_att_exists(ncid, varid, "add_offset")) {
-        float add_offset;
-
-        ncw_check_attlen(ncid, varid, "scale_factor", 1);
-        ncw_get_att_float(ncid, varid, "add_offset", &add_offset);
-        for (i = 0; i < n; ++i)
-            v[i] += add_offset;
+        ncw_check_attlen(ncid, varid, "add_offset", 1);
+        ncw_get_att_float(ncid, varid, "add_offset", &f->add_offset);
+        f->hasoffset = 1;
     }
 }
 
-/** Reads one horizontal field (layer) for a variable from a NetCDF file.
- ** Verifies that the field dimensions are ni x nj.
+/** Attaches a field descriptor to variable `varname' in an open NetCDF file.
+ ** Negative values of ni, nj or nk switch off the corresponding checks of
+ ** dimensions. The file is not closed by ncu_field_close().
  */
-void ncu_readfield(char fname[], char varname[], int k, int ni, int nj, int nk, float* v)
+ncu_field* ncu_field_attach(int ncid, char varname[], int ni, int nj, int nk)
 {
-    int ncid;
+    ncu_field* f = calloc(1, sizeof(ncu_field));
     int varid;
-    int ndims;
-    size_t dimlen[4];
-    size_t start[4], count[4];
-    size_t i, n;
-    int hasrecorddim;
 
-    ncw_open(fname, NC_NOWRITE, &ncid);
+    f->fname = ncw_get_path(ncid);
+    f->varname = strdup(varname);
+    f->ncid = ncid;
+    f->owner = 0;
     ncw_inq_varid(ncid, varname, &varid);
-    ncw_inq_vardims(ncid, varid, 4, &ndims, dimlen);
-    hasrecorddim = ncw_var_hasunlimdim(ncid, varid);
-    if (hasrecorddim)
-        if (dimlen[0] == 0)
-            quit("ncu_readfield(): \"%s\": %s: empty record dimension", fname, varname);
+    f->varid = varid;
+    f->ni = ni;
+    f->nj = nj;
+    f->nk = nk;
+    ncw_inq_vardims(ncid, varid, 4, &f->ndims, f->dimlen);
+    if (f->ndims > 4)
+        quit("\"%s\": %s: do not know how to handle more than 4-dimensional variables", f->fname, varname);
+    f->hasrecorddim = ncw_var_hasunlimdim(ncid, varid);
+    f->record = -1;
+    ncw_inq_vartype(ncid, varid, &f->vartype);
+    f->typesize = ncw_sizeof(f->vartype);
+    if (f->typesize != 1 && f->typesize != 2 && f->typesize != 4 && f->typesize != 8)
+        quit("\"%s\": %s: can not handle variables of type %s", f->fname, varname, ncw_nctype2str(f->vartype));
+
+    ncu_field_getatts(f);
+
+    return f;
+}
+
+/** Opens a NetCDF file and attaches a field descriptor to variable `varname'
+ ** in it. The file is closed by ncu_field_close().
+ * @param mode - NC_NOWRITE for reading, NC_WRITE for reading and writing
+ */
+ncu_field* ncu_field_open(char fname[], char varname[], int mode, int ni, int nj, int nk)
+{
+    ncu_field* f;
+    int ncid;
+
+    ncw_open(fname, mode, &ncid);
+    f = ncu_field_attach(ncid, varname, ni, nj, nk);
+    f->owner = 1;
+
+    return f;
+}
+
+/**
+ */
+void ncu_field_close(ncu_field* f)
+{
+    if (f->owner)
+        ncw_close(f->ncid);
+    free(f->fname);
+    free(f->varname);
+    if (f->vv != NULL)
+        free(f->vv);
+    free(f);
+}
+
+/**
+ */
+int ncu_field_getncid(ncu_field* f)
+{
+    return f->ncid;
+}
+
+/**
+ */
+int ncu_field_getvarid(ncu_field* f)
+{
+    return f->varid;
+}
+
+/** Sets the record to be read or written by ncu_field_read() and
+ ** ncu_field_write(). By default (r = -1) the last record is read, and the
+ ** last record (or the first one in an empty file) is written.
+ */
+void ncu_field_setrecord(ncu_field* f, int r)
+{
+    if (r > 0 && !f->hasrecorddim)
+        quit("\"%s\": %s: can not set record %d for a variable without unlimited dimension", f->fname, f->varname, r);
+    f->record = r;
+}
+
+/** Calculates the hyperslab for layers k, ..., k + nlayer - 1.
+ * @param f - field descriptor
+ * @param k - layer index
+ * @param nlayer - number of layers
+ * @param towrite - 1 if the slab is to be written, 0 otherwise
+ * @param fn - name of the calling procedure (for error messages)
+ * @param start - start indices (output)
+ * @param count - counts (output)
+ * @return - number of elements in the hyperslab
+ */
+static size_t ncu_field_getslab(ncu_field* f, int k, int nlayer, int towrite, char fn[], size_t start[], size_t count[])
+{
+    char* fname = f->fname;
+    char* varname = f->varname;
+    int ndims = f->ndims;
+    size_t* dimlen = f->dimlen;
+    int hasrecorddim = f->hasrecorddim;
+    int ni = f->ni;
+    int nj = f->nj;
+    int nk = f->nk;
+    size_t rec;
+    int kdim = -1;              /* vertical dimension (-1 if k is ignored) */
+    size_t i, n;
+
+    if (hasrecorddim && dimlen[0] == 0 && !towrite)
+        quit("%s: \"%s\": %s: empty record dimension", fn, fname, varname);
+    if (f->record < 0)
+        rec = (dimlen[0] == 0) ? 0 : dimlen[0] - 1;
+    else {
+        if (hasrecorddim && !towrite && f->record >= dimlen[0])
+            quit("%s: \"%s\": %s: record %d is out of range (# records = %zu)", fn, fname, varname, f->record, dimlen[0]);
+        rec = f->record;
+    }
 
     if (ndims == 4) {
-        if (nj == 0) {
-            quit("ncu_readfield(): \"%s\": %s: expected positive \"j\" dimension for a 4-dimensional variable\n", fname, varname);
-        }
+        if (nj == 0)
+            quit("%s: \"%s\": %s: expected positive \"j\" dimension for a 4-dimensional variable\n", fn, fname, varname);
         if (!hasrecorddim && dimlen[0] != 1)
-            quit("ncu_readfield(): \"%s\": %s: for a 4-dimensional variable expected the first dimension to be either unlimited or of length 1\n", fname, varname);
-        start[0] = dimlen[0] - 1;
-        if (dimlen[1] != nk) {
-            if (dimlen[1] != 1)
-                quit("ncu_readfield(): \"%s\": vertical dimension of variable \"%s\" (nk = %d) does not match grid dimension (nk = %d)", fname, varname, dimlen[1], nk);
+            quit("%s: \"%s\": %s: for a 4-dimensional variable expected the first dimension to be either unlimited or of length 1\n", fn, fname, varname);
+        start[0] = rec;
+        if (nk >= 0 && dimlen[1] != nk) {
+            if (dimlen[1] != 1 || towrite)
+                quit("%s: \"%s\": vertical dimension of variable \"%s\" (nk = %d) does not match grid dimension (nk = %d)", fn, fname, varname, dimlen[1], nk);
             else
                 k = 0;          /* ignore k */
-        }
+        } else
+            kdim = 1;
         if ((ni >= 0 && nj >= 0) && (dimlen[3] != ni || dimlen[2] != nj))
-            quit("ncu_readfield(): \"%s\": horizontal dimensions of variable \"%s\" (ni = %d, nj = %d) do not match grid dimensions (ni = %d, nj = %d)", fname, varname, dimlen[3], dimlen[2], ni, nj);
+            quit("%s: \"%s\": horizontal dimensions of variable \"%s\" (ni = %d, nj = %d) do not match grid dimensions (ni = %d, nj = %d)", fn, fname, varname, dimlen[3], dimlen[2], ni, nj);
         start[1] = k;
         start[2] = 0;
         start[3] = 0;
@@ -519,38 +405,35 @@ void ncu_readfield(char fname[], char varname[], int k, int ni, int nj, int nk,
         if (nj > 0) {
             if (!hasrecorddim) {
                 if (nk >= 0 && dimlen[0] != nk && !(dimlen[0] == 1 && (k == 0 || k == nk - 1)))
-                    quit("ncu_readfield(): \"%s\": vertical dimension of variable \"%s\" (nk = %d) does not match grid dimension (nk = %d)", fname, varname, dimlen[0], nk);
+                    quit("%s: \"%s\": vertical dimension of variable \"%s\" (nk = %d) does not match grid dimension (nk = %d)", fn, fname, varname, dimlen[0], nk);
                 start[0] = (dimlen[0] == 1) ? 0 : k;
-                start[1] = 0;
-                start[2] = 0;
-                count[0] = 1;
-                count[1] = dimlen[1];
-                count[2] = dimlen[2];
-            } else {
+                if (dimlen[0] != 1)
+                    kdim = 0;
+            } else
                 /*
-                 * ignore k in this case
+                 * 2D variable, ignore k
                  */
-                start[0] = dimlen[0] - 1;
-                start[1] = 0;
-                start[2] = 0;
-                count[0] = 1;
-                count[1] = dimlen[1];
-                count[2] = dimlen[2];
-            }
+                start[0] = rec;
+            start[1] = 0;
+            start[2] = 0;
+            count[0] = 1;
+            count[1] = dimlen[1];
+            count[2] = dimlen[2];
             if ((ni >= 0 && nj >= 0) && (dimlen[2] != ni || dimlen[1] != nj))
-                quit("ncu_readfield(): \"%s\": horizontal dimensions of variable \"%s\" (ni = %d, nj = %d) do not match grid dimensions (ni = %d, nj = %d)", fname, varname, dimlen[2], dimlen[1], ni, nj);
+                quit("%s: \"%s\": horizontal dimensions of variable \"%s\" (ni = %d, nj = %d) do not match grid dimensions (ni = %d, nj = %d)", fn, fname, varname, dimlen[2], dimlen[1], ni, nj);
         } else {
             if (!hasrecorddim && dimlen[0] != 1)
-                quit("ncu_readfield(): \"%s\": %s: for a 3-dimensional variable on unstructured horizontal grid expected the first dimension to be either unlimited or of length 1\n", fname, varname);
-            start[0] = dimlen[0] - 1;
+                quit("%s: \"%s\": %s: for a 3-dimensional variable on unstructured horizontal grid expected the first dimension to be either unlimited or of length 1\n", fn, fname, varname);
+            start[0] = rec;
             if (nk >= 0 && dimlen[1] != nk) {
                 if (dimlen[1] != 1)
-                    quit("ncu_readfield(): \"%s\": vertical dimension of variable \"%s\" (nk = %d) does not match grid dimension (nk = %d)", fname, varname, dimlen[1], nk);
+                    quit("%s: \"%s\": vertical dimension of variable \"%s\" (nk = %d) does not match grid dimension (nk = %d)", fn, fname, varname, dimlen[1], nk);
                 else
                     k = 0;      /* ignore k */
-            }
+            } else
+                kdim = 1;
             if (ni >= 0 && dimlen[2] != ni)
-                quit("ncu_readfield(): \"%s\": horizontal dimension of variable \"%s\" (ni = %d) does not match grid dimension (ni = %d)", fname, varname, dimlen[2], ni);
+                quit("%s: \"%s\": horizontal dimension of variable \"%s\" (ni = %d) does not match grid dimension (ni = %d)", fn, fname, varname, dimlen[2], ni);
             start[1] = k;
             start[2] = 0;
             count[0] = 1;
@@ -560,7 +443,7 @@ void ncu_readfield(char fname[], char varname[], int k, int ni, int nj, int nk,
     } else if (ndims == 2) {
         if (nj > 0) {
             if (hasrecorddim)
-                quit("ncu_readfield(): %s: can not read layer from a 1D variable \"%s\"", fname, varname);
+                quit("%s: \"%s\": can not handle a layer of a 1D variable \"%s\"", fn, fname, varname);
             /*
              * ignore k
              */
@@ -569,487 +452,656 @@ void ncu_readfield(char fname[], char varname[], int k, int ni, int nj, int nk,
             count[0] = dimlen[0];
             count[1] = dimlen[1];
             if ((ni >= 0 && nj >= 0) && (dimlen[1] != ni || dimlen[0] != nj))
-                quit("ncu_readfield(): \"%s\": horizontal dimensions of variable \"%s\" (ni = %d, nj = %d) do not match grid dimensions (ni = %d, nj = %d)", fname, varname, dimlen[1], dimlen[0], ni, nj);
+                quit("%s: \"%s\": horizontal dimensions of variable \"%s\" (ni = %d, nj = %d) do not match grid dimensions (ni = %d, nj = %d)", fn, fname, varname, dimlen[1], dimlen[0], ni, nj);
         } else {
             if (!hasrecorddim) {
-                if (dimlen[0] != nk && !(dimlen[0] == 1 && (k == 0 || k == nk - 1)))
-                    quit("ncu_readfield(): \"%s\": vertical dimension of variable \"%s\" (nk = %d) does not match grid dimension (nk = %d)", fname, varname, dimlen[0], nk);
-                start[0] = k;
-                start[1] = 0;
-                count[0] = 1;
-                count[1] = dimlen[1];
-            } else {
+                if (nk >= 0 && dimlen[0] != nk && !(dimlen[0] == 1 && (k == 0 || k == nk - 1)))
+                    quit("%s: \"%s\": vertical dimension of variable \"%s\" (nk = %d) does not match grid dimension (nk = %d)", fn, fname, varname, dimlen[0], nk);
+                start[0] = (dimlen[0] == 1) ? 0 : k;
+                if (dimlen[0] != 1)
+                    kdim = 0;
+            } else
                 /*
                  * ignore k in this case
                  */
-                start[0] = dimlen[0] - 1;
-                start[1] = 0;
-                count[0] = 1;
-                count[1] = dimlen[1];
-            }
+                start[0] = rec;
+            start[1] = 0;
+            count[0] = 1;
+            count[1] = dimlen[1];
             if (ni >= 0 && dimlen[1] != ni)
-                quit("ncu_readfield(): \"%s\": horizontal dimension of variable \"%s\" (ni = %d) does not match grid dimension (ni = %d)", fname, varname, dimlen[1], ni);
+                quit("%s: \"%s\": horizontal dimension of variable \"%s\" (ni = %d) does not match grid dimension (ni = %d)", fn, fname, varname, dimlen[1], ni);
         }
     } else if (ndims == 1) {
-        if (nj > 0) {
-            quit("ncu_readfield(): %s: can not read 2D field for \"%s\": # of dimensions = %d", fname, varname, ndims);
-        } else {
-            if (hasrecorddim)
-                quit("ncu_readfield(): %s: can not read layer from a 0D variable \"%s\"", fname, varname);
-            /*
-             * ignore k in this case
-             */
-            start[0] = 0;
-            count[0] = dimlen[0];
-        }
+        if (nj > 0)
+            quit("%s: \"%s\": can not handle 2D field for \"%s\": # of dimensions = %d", fn, fname, varname, ndims);
+        if (hasrecorddim)
+            quit("%s: \"%s\": can not handle a layer of a 0D variable \"%s\"", fn, fname, varname);
+        /*
+         * ignore k in this case
+         */
+        start[0] = 0;
+        count[0] = dimlen[0];
     } else
-        quit("ncu_readfield(): %s: can not read 2D field for \"%s\": # of dimensions = %d", fname, varname, ndims);
-
-    ncw_get_vara_float_fixerange(ncid, varid, start, count, v);
+        quit("%s: \"%s\": can not handle 2D field for \"%s\": # of dimensions = %d", fn, fname, varname, ndims);
+
+    if (nlayer > 1) {
+        if (kdim < 0)
+            quit("%s: \"%s\": %s: can not handle %d layers of a variable without vertical dimension", fn, fname, varname, nlayer);
+        if (k + nlayer > dimlen[kdim])
+            quit("%s: \"%s\": %s: layers %d to %d are out of range (nk = %zu)", fn, fname, varname, k, k + nlayer - 1, dimlen[kdim]);
+        count[kdim] = nlayer;
+    }
 
-    n = 1;
-    for (i = 0; i < ndims; ++i)
+    for (i = 0, n = 1; i < ndims; ++i)
         n *= count[i];
 
-    {
-        void* vv = NULL;
-        nc_type vartype = -1;
-        int typesize = 0;
-        char buf[128];
-        void* attval = buf;
-
-        ncw_inq_vartype(ncid, varid, &vartype);
-        typesize = ncw_sizeof(vartype);
-        if (vartype != NC_FLOAT) {
-            vv = malloc(n * typesize);
-            ncw_get_vara(ncid, varid, start, count, vv);
-        } else
-            vv = v;
+    return n;
+}
 
-        if (ncw_att_exists2(ncid, varid, "_FillValue")) {
-            ncw_check_attlen(ncid, varid, "_FillValue", 1);
-            ncw_get_att(ncid, varid, "_FillValue", attval);
-        } else {
-            int nofill;
+/** Sizes the chunk cache of the field's variable to hold all chunks
+ ** intersecting the slab of layers k, ..., k + nlayer - 1.
+ */
+static void ncu_field_sizecache(ncu_field* f, int k, int nlayer, int towrite)
+{
+    int storage;
+    size_t chunksizes[NC_MAX_VAR_DIMS];
+    size_t start[4], count[4];
+    size_t size, nchunk, cachesize, nelems;
+    float preemption;
+    int i;
+
+    f->cacheset = 1;
+    ncw_inq_var_chunking(f->ncid, f->varid, &storage, chunksizes);
+    if (storage != NC_CHUNKED)
+        return;
+    (void) ncu_field_getslab(f, k, nlayer, towrite, "ncu_field_setcache()", start, count);
+    for (i = 0, size = f->typesize, nchunk = 1; i < f->ndims; ++i) {
+        size *= chunksizes[i];
+        nchunk *= (start[i] + count[i] - 1) / chunksizes[i] - start[i] / chunksizes[i] + 1;
+    }
+    if (nc_get_var_chunk_cache(f->ncid, f->varid, &cachesize, &nelems, &preemption) != NC_NOERR)
+        nc_get_chunk_cache(&cachesize, &nelems, &preemption);
+    if (cachesize >= size * nchunk)
+        return;
+    if (nelems < nchunk)
+        nelems = nchunk;
+    ncw_set_var_chunk_cache(f->ncid, f->varid, size * nchunk, nelems, preemption);
+}
+
+/** Sets the chunk cache of the field's variable large enough to hold all
+ ** chunks intersecting a slab of `nlayer' layers, so that the chunks shared
+ ** by consecutive slabs are not read and decompressed again. Does nothing
+ ** for contiguous variables or when the variable's cache is large enough.
+ ** Unless called explicitly, the cache is sized by the first read or write
+ ** for the slab size used in it; so for chunks of several layers each chunk is
+ ** decompressed once for all its layers.
+ */
+void ncu_field_setcache(ncu_field* f, int nlayer)
+{
+    ncu_field_sizecache(f, 0, nlayer, 0);
+}
+
+/** Sets a value to NaN if `bad' is non-zero. (Unlike a conditional expression,
+ ** this does not prevent vectorisation of the calling loop under the default
+ ** -ftrapping-math.)
+ */
+static float nanif(float v, int bad)
+{
+    uint32_t u;
+
+    memcpy(&u, &v, sizeof(u));
+    u |= (0u - (uint32_t) (bad != 0)) & 0x7fc00000u;
+    memcpy(&v, &u, sizeof(u));
 
-            ncw_inq_var_fill(ncid, varid, &nofill, attval);
-            if (nofill)
-                goto skip;
+    return v;
+}
+
+/** Decodes values of the field's variable read in the native type: sets
+ ** the values equal to _FillValue or missing_value, or outside the valid
+ ** range, to NaN, casts the rest to float and unpacks them with scale_factor and
+ ** add_offset -- all in one pass specialised for each type. For NC_DOUBLE the
+ ** values outside the float range are also set to NaN. `vv' and `v' may
+ ** coincide for NC_FLOAT.
+ ** The loops have no branches: the tests are combined with non-short-circuit
+ ** operators and the results are masked with nanif(). With "omp simd" gcc
+ ** vectorises them at -O2 when compiled with -fopenmp (or at -O3) for
+ ** NC_FLOAT and the integer types of up to 32 bits; the loops for NC_DOUBLE
+ ** and the 64-bit integer types remain scalar.
+ */
+static void ncu_decode(ncu_field* f, size_t n, void* vv, float* v)
+{
+    int hasfill = f->hasfill, hasmissing = f->hasmissing;
+    int hasmin = f->hasmin, hasmax = f->hasmax, hasrange = f->hasrange;
+    float scale = (f->hasscale) ? f->scale_factor : 1.0f;
+    float offset = (f->hasoffset) ? f->add_offset : 0.0f;
+    size_t i;
+
+    if (f->vartype == NC_BYTE || f->vartype == NC_CHAR) {
+        signed char* x = vv;
+        signed char fill, missing, lo, hi, range[2];
+
+        memcpy(&fill, f->fill, sizeof(signed char));
+        memcpy(&missing, f->missing, sizeof(signed char));
+        memcpy(&lo, f->valid_min, sizeof(signed char));
+        memcpy(&hi, f->valid_max, sizeof(signed char));
+        memcpy(range, f->valid_range, 2 * sizeof(signed char));
+#if defined(_OPENMP)
+#pragma omp simd
+#endif
+        for (i = 0; i < n; ++i) {
+            signed char xi = x[i];
+
+            int bad = (hasfill & (xi == fill)) | (hasmissing & (xi == missing)) | (hasmin & (xi < lo)) | (hasmax & (xi > hi)) | (hasrange & ((xi < range[0]) | (xi > range[1])));
+
+            v[i] = nanif((float) xi * scale + offset, bad);
         }
-        if (typesize == 1) {
-            for (i = 0; i < n; ++i)
-                if (((int8_t*) vv)[i] == ((int8_t*) attval)[0])
-                    v[i] = NAN;
-        } else if (typesize == 2) {
-            for (i = 0; i < n; ++i)
-                if (((int16_t*) vv)[i] == ((int16_t*) attval)[0])
-                    v[i] = NAN;
-        } else if (typesize == 4) {
-            for (i = 0; i < n; ++i)
-                if (((int32_t*) vv)[i] == ((int32_t*) attval)[0])
-                    v[i] = NAN;
-        } else if (typesize == 8) {
-            for (i = 0; i < n; ++i)
-                if (((int64_t*) vv)[i] == ((int64_t*) attval)[0])
-                    v[i] = NAN;
-        } else
-            quit("programming error");
-
-      skip:
-        if (ncw_att_exists2(ncid, varid, "missing_value")) {
-            ncw_check_attlen(ncid, varid, "missing_value", 1);
-            ncw_get_att(ncid, varid, "missing_value", attval);
-            if (typesize == 1) {
-                for (i = 0; i < n; ++i)
-                    if (((int8_t*) vv)[i] == ((int8_t*) attval)[0])
-                        v[i] = NAN;
-            } else if (typesize == 2) {
-                for (i = 0; i < n; ++i)
-                    if (((int16_t*) vv)[i] == ((int16_t*) attval)[0])
-                        v[i] = NAN;
-            } else if (typesize == 4) {
-                for (i = 0; i < n; ++i)
-                    if (((int32_t*) vv)[i] == ((int32_t*) attval)[0])
-                        v[i] = NAN;
-            } else if (typesize == 8) {
-                for (i = 0; i < n; ++i)
-                    if (((int64_t*) vv)[i] == ((int64_t*) attval)[0])
-                        v[i] = NAN;
-            } else
-                quit("programming error");
+    } else if (f->vartype == NC_UBYTE) {
+        unsigned char* x = vv;
+        unsigned char fill, missing, lo, hi, range[2];
+
+        memcpy(&fill, f->fill, sizeof(unsigned char));
+        memcpy(&missing, f->missing, sizeof(unsigned char));
+        memcpy(&lo, f->valid_min, sizeof(unsigned char));
+        memcpy(&hi, f->valid_max, sizeof(unsigned char));
+        memcpy(range, f->valid_range, 2 * sizeof(unsigned char));
+#if defined(_OPENMP)
+#pragma omp simd
+#endif
+        for (i = 0; i < n; ++i) {
+            unsigned char xi = x[i];
+
+            int bad = (hasfill & (xi == fill)) | (hasmissing & (xi == missing)) | (hasmin & (xi < lo)) | (hasmax & (xi > hi)) | (hasrange & ((xi < range[0]) | (xi > range[1])));
+
+            v[i] = nanif((float) xi * scale + offset, bad);
         }
-
-        if (ncw_att_exists2(ncid, varid, "valid_min")) {
-            ncw_check_attlen(ncid, varid, "valid_min", 1);
-            ncw_get_att(ncid, varid, "valid_min", attval);
-            if (vartype == NC_BYTE || vartype == NC_CHAR) {
-                for (i = 0; i < n; ++i)
-                    if (((char*) vv)[i] < ((char*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_UBYTE) {
-                for (i = 0; i < n; ++i)
-                    if (((unsigned char*) vv)[i] < ((unsigned char*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_SHORT) {
-                for (i = 0; i < n; ++i)
-                    if (((int16_t*) vv)[i] < ((int16_t*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_USHORT) {
-                for (i = 0; i < n; ++i)
-                    if (((uint16_t*) vv)[i] < ((uint16_t*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_INT || vartype == NC_LONG) {
-                for (i = 0; i < n; ++i)
-                    if (((int32_t*) vv)[i] < ((int32_t*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_UINT) {
-                for (i = 0; i < n; ++i)
-                    if (((uint32_t*) vv)[i] < ((uint32_t*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_INT64) {
-                for (i = 0; i < n; ++i)
-                    if (((int64_t*) vv)[i] < ((int64_t*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_UINT64) {
-                for (i = 0; i < n; ++i)
-                    if (((uint64_t*) vv)[i] < ((uint64_t*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_FLOAT) {
-                assert(sizeof(float) == 4);
-                for (i = 0; i < n; ++i)
-                    if (((float*) vv)[i] < ((float*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_DOUBLE) {
-                for (i = 0; i < n; ++i)
-                    if (((double*) vv)[i] < ((double*) attval)[0])
-                        v[i] = NAN;
-            } else
-                quit("programming error");
+    } else if (f->vartype == NC_SHORT) {
+        int16_t* x = vv;
+        int16_t fill, missing, lo, hi, range[2];
+
+        memcpy(&fill, f->fill, sizeof(int16_t));
+        memcpy(&missing, f->missing, sizeof(int16_t));
+        memcpy(&lo, f->valid_min, sizeof(int16_t));
+        memcpy(&hi, f->valid_max, sizeof(int16_t));
+        memcpy(range, f->valid_range, 2 * sizeof(int16_t));
+#if defined(_OPENMP)
+#pragma omp simd
+#endif
+        for (i = 0; i < n; ++i) {
+            int16_t xi = x[i];
+
+            int bad = (hasfill & (xi == fill)) | (hasmissing & (xi == missing)) | (hasmin & (xi < lo)) | (hasmax & (xi > hi)) | (hasrange & ((xi < range[0]) | (xi > range[1])));
+
+            v[i] = nanif((float) xi * scale + offset, bad);
         }
-
-        if (ncw_att_exists2(ncid, varid, "valid_max")) {
-            ncw_check_attlen(ncid, varid, "valid_max", 1);
-            ncw_get_att(ncid, varid, "valid_max", attval);
-            if (vartype == NC_BYTE || vartype == NC_CHAR) {
-                for (i = 0; i < n; ++i)
-                    if (((char*) vv)[i] > ((char*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_UBYTE) {
-                for (i = 0; i < n; ++i)
-                    if (((unsigned char*) vv)[i] > ((unsigned char*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_SHORT) {
-                for (i = 0; i < n; ++i)
-                    if (((int16_t*) vv)[i] > ((int16_t*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_USHORT) {
-                for (i = 0; i < n; ++i)
-                    if (((uint16_t*) vv)[i] > ((uint16_t*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_INT || vartype == NC_LONG) {
-                for (i = 0; i < n; ++i)
-                    if (((int32_t*) vv)[i] > ((int32_t*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_UINT) {
-                for (i = 0; i < n; ++i)
-                    if (((uint32_t*) vv)[i] > ((uint32_t*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_INT64) {
-                for (i = 0; i < n; ++i)
-                    if (((int64_t*) vv)[i] > ((int64_t*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_UINT64) {
-                for (i = 0; i < n; ++i)
-                    if (((uint64_t*) vv)[i] > ((uint64_t*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_FLOAT) {
-                assert(sizeof(float) == 4);
-                for (i = 0; i < n; ++i)
-                    if (((float*) vv)[i] > ((float*) attval)[0])
-                        v[i] = NAN;
-            } else if (vartype == NC_DOUBLE) {
-                for (i = 0; i < n; ++i)
-                    if (((double*) vv)[i] > ((double*) attval)[0])
-                        v[i] = NAN;
-            } else
-                quit("programming error");
+    } else if (f->vartype == NC_USHORT) {
+        uint16_t* x = vv;
+        uint16_t fill, missing, lo, hi, range[2];
+
+        memcpy(&fill, f->fill, sizeof(uint16_t));
+        memcpy(&missing, f->missing, sizeof(uint16_t));
+        memcpy(&lo, f->valid_min, sizeof(uint16_t));
+        memcpy(&hi, f->valid_max, sizeof(uint16_t));
+        memcpy(range, f->valid_range, 2 * sizeof(uint16_t));
+#if defined(_OPENMP)
+#pragma omp simd
+#endif
+        for (i = 0; i < n; ++i) {
+            uint16_t xi = x[i];
+
+            int bad = (hasfill & (xi == fill)) | (hasmissing & (xi == missing)) | (hasmin & (xi < lo)) | (hasmax & (xi > hi)) | (hasrange & ((xi < range[0]) | (xi > range[1])));
+
+            v[i] = nanif((float) xi * scale + offset, bad);
+        }
+    } else if (f->vartype == NC_INT || f->vartype == NC_LONG) {
+        int32_t* x = vv;
+        int32_t fill, missing, lo, hi, range[2];
+
+        memcpy(&fill, f->fill, sizeof(int32_t));
+        memcpy(&missing, f->missing, sizeof(int32_t));
+        memcpy(&lo, f->valid_min, sizeof(int32_t));
+        memcpy(&hi, f->valid_max, sizeof(int32_t));
+        memcpy(range, f->valid_range, 2 * sizeof(int32_t));
+#if defined(_OPENMP)
+#pragma omp simd
+#endif
+        for (i = 0; i < n; ++i) {
+            int32_t xi = x[i];
+
+            int bad = (hasfill & (xi == fill)) | (hasmissing & (xi == missing)) | (hasmin & (xi < lo)) | (hasmax & (xi > hi)) | (hasrange & ((xi < range[0]) | (xi > range[1])));
+
+            v[i] = nanif((float) xi * scale + offset, bad);
+        }
+    } else if (f->vartype == NC_UINT) {
+        uint32_t* x = vv;
+        uint32_t fill, missing, lo, hi, range[2];
+
+        memcpy(&fill, f->fill, sizeof(uint32_t));
+        memcpy(&missing, f->missing, sizeof(uint32_t));
+        memcpy(&lo, f->valid_min, sizeof(uint32_t));
+        memcpy(&hi, f->valid_max, sizeof(uint32_t));
+        memcpy(range, f->valid_range, 2 * sizeof(uint32_t));
+#if defined(_OPENMP)
+#pragma omp simd
+#endif
+        for (i = 0; i < n; ++i) {
+            uint32_t xi = x[i];
+
+            int bad = (hasfill & (xi == fill)) | (hasmissing & (xi == missing)) | (hasmin & (xi < lo)) | (hasmax & (xi > hi)) | (hasrange & ((xi < range[0]) | (xi > range[1])));
+
+            v[i] = nanif((float) xi * scale + offset, bad);
+        }
+    } else if (f->vartype == NC_INT64) {
+        int64_t* x = vv;
+        int64_t fill, missing, lo, hi, range[2];
+
+        memcpy(&fill, f->fill, sizeof(int64_t));
+        memcpy(&missing, f->missing, sizeof(int64_t));
+        memcpy(&lo, f->valid_min, sizeof(int64_t));
+        memcpy(&hi, f->valid_max, sizeof(int64_t));
+        memcpy(range, f->valid_range, 2 * sizeof(int64_t));
+#if defined(_OPENMP)
+#pragma omp simd
+#endif
+        for (i = 0; i < n; ++i) {
+            int64_t xi = x[i];
+
+            int bad = (hasfill & (xi == fill)) | (hasmissing & (xi == missing)) | (hasmin & (xi < lo)) | (hasmax & (xi > hi)) | (hasrange & ((xi < range[0]) | (xi > range[1])));
+
+            v[i] = nanif((float) xi * scale + offset, bad);
+        }
+    } else if (f->vartype == NC_UINT64) {
+        uint64_t* x = vv;
+        uint64_t fill, missing, lo, hi, range[2];
+
+        memcpy(&fill, f->fill, sizeof(uint64_t));
+        memcpy(&missing, f->missing, sizeof(uint64_t));
+        memcpy(&lo, f->valid_min, sizeof(uint64_t));
+        memcpy(&hi, f->valid_max, sizeof(uint64_t));
+        memcpy(range, f->valid_range, 2 * sizeof(uint64_t));
+#if defined(_OPENMP)
+#pragma omp simd
+#endif
+        for (i = 0; i < n; ++i) {
+            uint64_t xi = x[i];
+
+            int bad = (hasfill & (xi == fill)) | (hasmissing & (xi == missing)) | (hasmin & (xi < lo)) | (hasmax & (xi > hi)) | (hasrange & ((xi < range[0]) | (xi > range[1])));
+
+            v[i] = nanif((float) xi * scale + offset, bad);
+        }
+    } else if (f->vartype == NC_FLOAT) {
+        float* x = vv;
+        float fill, missing, lo, hi, range[2];
+
+        memcpy(&fill, f->fill, sizeof(float));
+        memcpy(&missing, f->missing, sizeof(float));
+        memcpy(&lo, f->valid_min, sizeof(float));
+        memcpy(&hi, f->valid_max, sizeof(float));
+        memcpy(range, f->valid_range, 2 * sizeof(float));
+#if defined(_OPENMP)
+#pragma omp simd
+#endif
+        for (i = 0; i < n; ++i) {
+            float xi = x[i];
+
+            int bad = (hasfill & (xi == fill)) | (hasmissing & (xi == missing)) | (hasmin & (xi < lo)) | (hasmax & (xi > hi)) | (hasrange & ((xi < range[0]) | (xi > range[1])));
+
+            v[i] = nanif((float) xi * scale + offset, bad);
+        }
+    } else if (f->vartype == NC_DOUBLE) {
+        double* x = vv;
+        double fill, missing, lo, hi, range[2];
+
+        memcpy(&fill, f->fill, sizeof(double));
+        memcpy(&missing, f->missing, sizeof(double));
+        memcpy(&lo, f->valid_min, sizeof(double));
+        memcpy(&hi, f->valid_max, sizeof(double));
+        memcpy(range, f->valid_range, 2 * sizeof(double));
+#if defined(_OPENMP)
+#pragma omp simd
+#endif
+        for (i = 0; i < n; ++i) {
+            double xi = x[i];
+
+            int bad = (hasfill & (xi == fill)) | (hasmissing & (xi == missing)) | (hasmin & (xi < lo)) | (hasmax & (xi > hi)) | (hasrange & ((xi < range[0]) | (xi > range[1]))) | !((xi >= -FLT_MAX) & (xi <= FLT_MAX));
+
+            v[i] = nanif((float) xi * scale + offset, bad);
         }
+    } else
+        quit("\"%s\": %s: can not decode variables of type %s", f->fname, f->varname, ncw_nctype2str(f->vartype));
+}
 
-        if (ncw_att_exists2(ncid, varid, "valid_range")) {
-            ncw_check_attlen(ncid, varid, "valid_range", 2);
-            ncw_get_att(ncid, varid, "valid_range", attval);
-            if (vartype == NC_BYTE || vartype == NC_CHAR) {
-                for (i = 0; i < n; ++i)
-                    if (((char*) vv)[i] < ((char*) attval)[0] || ((char*) vv)[i] > ((char*) attval)[1])
-                        v[i] = NAN;
-            } else if (vartype == NC_UBYTE) {
-                for (i = 0; i < n; ++i)
-                    if (((unsigned char*) vv)[i] < ((unsigned char*) attval)[0] || ((unsigned char*) vv)[i] > ((unsigned char*) attval)[1])
-                        v[i] = NAN;
-            } else if (vartype == NC_SHORT) {
-                for (i = 0; i < n; ++i)
-                    if (((int16_t*) vv)[i] < ((int16_t*) attval)[0] || ((int16_t*) vv)[i] > ((int16_t*) attval)[1])
-                        v[i] = NAN;
-            } else if (vartype == NC_USHORT) {
-                for (i = 0; i < n; ++i)
-                    if (((uint16_t*) vv)[i] < ((uint16_t*) attval)[0] || ((uint16_t*) vv)[i] > ((uint16_t*) attval)[1])
-                        v[i] = NAN;
-            } else if (vartype == NC_INT || vartype == NC_LONG) {
-                for (i = 0; i < n; ++i)
-                    if (((int32_t*) vv)[i] < ((int32_t*) attval)[0] || ((int32_t*) vv)[i] > ((int32_t*) attval)[1])
-                        v[i] = NAN;
-            } else if (vartype == NC_UINT) {
-                for (i = 0; i < n; ++i)
-                    if (((uint32_t*) vv)[i] < ((uint32_t*) attval)[0] || ((uint32_t*) vv)[i] > ((uint32_t*) attval)[1])
-                        v[i] = NAN;
-            } else if (vartype == NC_INT64) {
-                for (i = 0; i < n; ++i)
-                    if (((int64_t*) vv)[i] < ((int64_t*) attval)[0] || ((int64_t*) vv)[i] > ((int64_t*) attval)[1])
-                        v[i] = NAN;
-            } else if (vartype == NC_UINT64) {
-                for (i = 0; i < n; ++i)
-                    if (((uint64_t*) vv)[i] < ((uint64_t*) attval)[0] || ((uint64_t*) vv)[i] > ((uint64_t*) attval)[1])
-                        v[i] = NAN;
-            } else if (vartype == NC_FLOAT) {
-                assert(sizeof(float) == 4);
-                for (i = 0; i < n; ++i)
-                    if (((float*) vv)[i] < ((float*) attval)[0] || ((float*) vv)[i] > ((float*) attval)[1])
-                        v[i] = NAN;
-            } else if (vartype == NC_DOUBLE) {
-                for (i = 0; i < n; ++i)
-                    if (((double*) vv)[i] < ((double*) attval)[0] || ((double*) vv)[i] > ((double*) attval)[1])
-                        v[i] = NAN;
-            } else
-                quit("programming error");
+/** Reads layers k, ..., k + nlayer - 1 of the field.
+ */
+void ncu_field_reada(ncu_field* f, int k, int nlayer, float* v)
+{
+    size_t start[4], count[4];
+    size_t n;
+    void* vv;
+    double t0;
+
+    n = ncu_field_getslab(f, k, nlayer, 0, "ncu_field_reada()", start, count);
+    if (!f->cacheset)
+        ncu_field_sizecache(f, k, nlayer, 0);
+
+    if (f->vartype != NC_FLOAT) {
+        if (f->nvv < n) {
+            f->vv = realloc(f->vv, n * f->typesize);
+            f->nvv = n;
         }
+        vv = f->vv;
+    } else
+        vv = v;
+    ncw_get_vara(f->ncid, f->varid, start, count, vv);
+    t0 = prof_start();
+    ncu_decode(f, n, vv, v);
+    prof_stop(PROF_DECODE, t0, n * f->typesize);
+}
 
-        if (vartype != NC_FLOAT)
-            free(vv);
-    }
+/** Reads a variable as float. The data is read once in the native type and
+ ** decoded in a single pass (see ncu_decode()).
+ */
+void ncu_readvarfloat(int ncid, int varid, size_t n, float v[])
+{
+    ncu_field f;
+    char varname[NC_MAX_NAME];
+    void* vv;
+    double t0;
 
-    if (ncw_att_exists(ncid, varid, "scale_factor")) {
-        float scale_factor;
+    ncw_check_varsize(ncid, varid, n);
+    memset(&f, 0, sizeof(ncu_field));
+    ncw_inq_varname(ncid, varid, varname);
+    f.fname = ncw_get_path(ncid);
+    f.varname = varname;
+    f.ncid = ncid;
+    f.varid = varid;
+    ncw_inq_vartype(ncid, varid, &f.vartype);
+    f.typesize = ncw_sizeof(f.vartype);
+    if (f.typesize != 1 && f.typesize != 2 && f.typesize != 4 && f.typesize != 8)
+        quit("\"%s\": %s: can not handle variables of type %s", f.fname, varname, ncw_nctype2str(f.vartype));
+    ncu_field_getatts(&f);
+
+    vv = (f.vartype == NC_FLOAT) ? (void*) v : malloc(n * f.typesize);
+    ncw_get_var(ncid, varid, vv);
+    t0 = prof_start();
+    ncu_decode(&f, n, vv, v);
+    prof_stop(PROF_DECODE, t0, n * f.typesize);
+    if (vv != v)
+        free(vv);
+    free(f.fname);
+}
 
-        ncw_check_attlen(ncid, varid, "scale_factor", 1);
-        ncw_get_att_float(ncid, varid, "scale_factor", &scale_factor);
-        for (i = 0; i < n; ++i)
-            v[i] *= scale_factor;
-    }
+/** Writes layers k, ..., k + nlayer - 1 of the field. Note that the values
+ ** in `v' get modified (packed).
+ */
+void ncu_field_writea(ncu_field* f, int k, int nlayer, float* v)
+{
+    size_t start[4], count[4];
+    size_t i, n;
+    double t0;
 
-    if (ncw_att_exists(ncid, varid, "add_offset")) {
-        float add_offset;
+    n = ncu_field_getslab(f, k, nlayer, 1, "ncu_field_writea()", start, count);
+    if (!f->cacheset)
+        ncu_field_sizecache(f, k, nlayer, 1);
 
-        ncw_check_attlen(ncid, varid, "add_offset", 1);
-        ncw_get_att_float(ncid, varid, "add_offset", &add_offset);
+    t0 = prof_start();
+
+    if (f->hasoffset)
+        for (i = 0; i < n; ++i)
+            v[i] -= f->add_offset;
+    if (f->hasscale)
         for (i = 0; i < n; ++i)
-            v[i] += add_offset;
+            v[i] /= f->scale_factor;
+
+    if (f->hasmin)
+        for (i = 0; i < n; ++i)
+            if (v[i] < f->valid_min_f)
+                v[i] = f->valid_min_f;
+    if (f->hasmax)
+        for (i = 0; i < n; ++i)
+            if (v[i] > f->valid_max_f)
+                v[i] = f->valid_max_f;
+    if (f->hasrange) {
+        for (i = 0; i < n; ++i)
+            if (v[i] < f->valid_range_f[0])
+                v[i] = f->valid_range_f[0];
+            else if (v[i] > f->valid_range_f[1])
+                v[i] = f->valid_range_f[1];
     }
+    /*
+     * This section does not always work as intended. E.g. for "int" dst
+     * variable type _FillValue = -2147483647 is converted to -2.14748365e8f
+     * and then in nc_put_vara_float() to -2147483648. Removing the code
+     * below makes in that case no difference because NaNf is also converted
+     * to -2147483648 in nc_put_vara_float().
+     *
+     * Yet sometimes the section below turns useful, e.g. in cases when src
+     * and dst have the same data type but different fill values.
+     */
+    if (f->hasfill)
+        for (i = 0; i < n; ++i)
+            if (isnan(v[i]))
+                v[i] = f->fill_f;
+    if (f->hasmissing)
+        for (i = 0; i < n; ++i)
+            if (isnan(v[i]))
+                v[i] = f->missing_f;
+    prof_stop(PROF_DECODE, t0, n * sizeof(float));
 
-    ncw_close(ncid);
+    ncw_put_vara_float(f->ncid, f->varid, start, count, v);
 }
 
-/** Writes one horizontal field (layer) for a variable to a NetCDF file.
+/** Reads layer k of the field.
  */
-void ncu_writefield(char fname[], char varname[], int k, int ni, int nj, int nk, float* v)
+void ncu_field_read(ncu_field* f, int k, float* v)
 {
-    int ncid;
-    int varid;
-    int ndims;
-    size_t dimlen[4];
-    size_t start[4], count[4];
-    size_t i, n;
-    int hasrecorddim;
+    ncu_field_reada(f, k, 1, v);
+}
 
-    ncw_open(fname, NC_WRITE, &ncid);
-    ncw_inq_varid(ncid, varname, &varid);
-    ncw_inq_vardims(ncid, varid, 4, &ndims, dimlen);
-    hasrecorddim = ncw_var_hasunlimdim(ncid, varid);
+/** Writes layer k of the field. Note that the values in `v' get modified
+ ** (packed).
+ */
+void ncu_field_write(ncu_field* f, int k, float* v)
+{
+    ncu_field_writea(f, k, 1, v);
+}
 
-    if (ndims == 4) {
-        if (nj == 0)
-            quit("ncu_writefield(): \"%s\": %s: expected positive \"j\" dimension for a 4-dimensional variable\n", fname, varname);
-        if (!hasrecorddim && dimlen[0] != 1)
-            quit("ncu_writefield(): \"%s\": %s: for a 4-dimensional variable expected the first dimension to be either unlimited or of length 1\n", fname, varname);
-        start[0] = (dimlen[0] == 0) ? 0 : dimlen[0] - 1;
-        if (dimlen[1] != nk)
-            quit("ncu_writefield(): \"%s\": vertical dimension of variable \"%s\" (nk = %d) does not match grid dimension (nk = %d)", fname, varname, dimlen[1], nk);
-        start[1] = k;
-        start[2] = 0;
-        start[3] = 0;
-        count[0] = 1;
-        count[1] = 1;
-        count[2] = dimlen[2];
-        count[3] = dimlen[3];
-        if ((ni >= 0 && nj >= 0) && (dimlen[3] != ni || dimlen[2] != nj))
-            quit("ncu_writefield(): \"%s\": horizontal dimensions of variable \"%s\" (ni = %d, nj = %d) do not match grid dimensions (ni = %d, nj = %d)", fname, varname, dimlen[3], dimlen[2], ni, nj);
-    } else if (ndims == 3) {
-        if (nj > 0) {
-            if (!hasrecorddim) {
-                if (nk >= 0 && dimlen[0] != nk && !(dimlen[0] == 1 && (k == 0 || k == nk - 1)))
-                    quit("ncu_writefield(): \"%s\": vertical dimension of variable \"%s\" (nk = %d) does not match grid dimension (nk = %d)", fname, varname, dimlen[0], nk);
-                start[0] = k;
-                start[1] = 0;
-                start[2] = 0;
-                count[0] = 1;
-                count[1] = dimlen[1];
-                count[2] = dimlen[2];
-            } else {
-                /*
-                 * 2D variable, ignore k
-                 */
-                start[0] = (dimlen[0] == 0) ? 0 : dimlen[0] - 1;
-                start[1] = 0;
-                start[2] = 0;
-                count[0] = 1;
-                count[1] = dimlen[1];
-                count[2] = dimlen[2];
-            }
-            if ((ni >= 0 && nj >= 0) && (dimlen[2] != ni || dimlen[1] != nj))
-                quit("ncu_writefield(): \"%s\": horizontal dimensions of variable \"%s\" (ni = %d, nj = %d) do not match grid dimensions (ni = %d, nj = %d)", fname, varname, dimlen[2], dimlen[1], ni, nj);
-        } else {
-            if (!hasrecorddim && dimlen[0] != 1)
-                quit("ncu_writefield(): \"%s\": %s: for a 3-dimensional variable on unstructured horizontal grid expected the first dimension to be either unlimited or of length 1\n", fname, varname);
-            start[0] = (dimlen[0] == 0) ? 0 : dimlen[0] - 1;
-            if (nk >= 0 && dimlen[1] != nk) {
-                if (dimlen[1] != 1)
-                    quit("ncu_writefield(): \"%s\": vertical dimension of variable \"%s\" (nk = %d) does not match grid dimension (nk = %d)", fname, varname, dimlen[1], nk);
-                else
-                    k = 0;      /* ignore k */
-            }
-            if (ni >= 0 && dimlen[2] != ni)
-                quit("ncu_writefield(): \"%s\": horizontal dimension of variable \"%s\" (ni = %d) does not match grid dimension (ni = %d)", fname, varname, dimlen[2], ni);
-            start[1] = k;
-            start[2] = 0;
-            count[0] = 1;
-            count[1] = 1;
-            count[2] = dimlen[2];
-        }
-    } else if (ndims == 2) {
-        if (nj > 0) {
-            if (hasrecorddim)
-                quit("ncu_writefield(): \"%s\": can not write a layer to a 1D variable \"%s\"", fname, varname);
-            /*
-             * ignore k
-             */
-            start[0] = 0;
-            start[1] = 0;
-            count[0] = dimlen[0];
-            count[1] = dimlen[1];
-            if (dimlen[1] != ni || dimlen[0] != nj)
-                quit("ncu_writefield(): \"%s\": horizontal dimensions of variable \"%s\" (ni = %d, nj = %d) do not match grid dimensions (ni = %d, nj = %d)", fname, varname, dimlen[1], dimlen[0], ni, nj);
-        } else {
-            if (!hasrecorddim) {
-                if (dimlen[0] != nk && !(dimlen[0] == 1 && (k == 0 || k == nk - 1)))
-                    quit("ncu_writefield(): \"%s\": vertical dimension of variable \"%s\" (nk = %d) does not match grid dimension (nk = %d)", fname, varname, dimlen[0], nk);
-                start[0] = k;
-                start[1] = 0;
-                count[0] = 1;
-                count[1] = dimlen[1];
-            } else {
-                /*
-                 * ignore k in this case
-                 */
-                start[0] = (dimlen[0] == 0) ? 0 : dimlen[0] - 1;
-                start[1] = 0;
-                count[0] = 1;
-                count[1] = dimlen[1];
-            }
-            if (ni >= 0 && dimlen[1] != ni)
-                quit("ncu_writefield(): \"%s\": horizontal dimension of variable \"%s\" (ni = %d) does not match grid dimension (ni = %d)", fname, varname, dimlen[1], ni);
-        }
-    } else if (ndims == 1) {
-        if (nj > 0) {
-            quit("ncu_writefield(): %s: can not write 2D field for \"%s\": # of dimensions = %d", fname, varname, ndims);
-        } else {
-            if (hasrecorddim)
-                quit("ncu_writefield(): %s: can not write layer to a 0D variable \"%s\"", fname, varname);
-            /*
-             * ignore k in this case
-             */
-            start[0] = 0;
-            count[0] = dimlen[0];
-        }
-    } else
-        quit("ncu_writefield(): \"%s\": can not write 2D field for \"%s\": # of dimensions = %d", fname, varname, ndims);
+/*
+ * Ensemble of fields: the same variable in a number of files. The files are
+ * kept open; the variable is attached in each of them and validated against
+ * the first member once per variable, after which layers of all members are
+ * read into a single contiguous block [member][layer][j][i].
+ */
+struct ncu_ensemble {
+    int n;
+    int* ncids;
+    ncu_field** fields;         /* [n]; NULL before ncu_ensemble_setvar() */
+    int pipeline;
+
+    /*
+     * scratch buffers for reading values in the native type
+     */
+    size_t nvv;
+    void* vv[2];
+};
+
+/** Opens files of an ensemble.
+ * @param n - number of members
+ * @param fnames - member file names [n]
+ * @param pipeline - flag: read the next member while decoding the current
+ *                   one (requires OpenMP; reading is done by one thread only)
+ * @return - ensemble descriptor
+ */
+ncu_ensemble* ncu_ensemble_open(int n, char* fnames[], int pipeline)
+{
+    ncu_ensemble* e = calloc(1, sizeof(ncu_ensemble));
+    int j;
+
+    if (n < 1)
+        quit("ncu_ensemble_open(): no members");
+    e->n = n;
+    e->ncids = malloc(n * sizeof(int));
+    for (j = 0; j < n; ++j)
+        ncw_open(fnames[j], NC_NOWRITE, &e->ncids[j]);
+    e->fields = calloc(n, sizeof(ncu_field*));
+    e->pipeline = pipeline;
+
+    return e;
+}
 
-    n = 1;
-    for (i = 0; i < ndims; ++i)
-        n *= count[i];
+/**
+ */
+static void ncu_ensemble_freefields(ncu_ensemble* e)
+{
+    int j;
 
-    if (ncw_att_exists(ncid, varid, "add_offset")) {
-        float add_offset;
+    for (j = 0; j < e->n; ++j) {
+        if (e->fields[j] != NULL)
+            ncu_field_close(e->fields[j]);
+        e->fields[j] = NULL;
+    }
+}
 
-        ncw_get_att_float(ncid, varid, "add_offset", &add_offset);
-        for (i = 0; i < n; ++i)
-            v[i] -= add_offset;
+/**
+ */
+void ncu_ensemble_close(ncu_ensemble* e)
+{
+    int j;
+
+    ncu_ensemble_freefields(e);
+    for (j = 0; j < e->n; ++j)
+        ncw_close(e->ncids[j]);
+    free(e->ncids);
+    free(e->fields);
+    if (e->vv[0] != NULL) {
+        free(e->vv[0]);
+        free(e->vv[1]);
     }
+    free(e);
+}
 
-    if (ncw_att_exists(ncid, varid, "scale_factor")) {
-        float scale_factor;
+/**
+ */
+int ncu_ensemble_getsize(ncu_ensemble* e)
+{
+    return e->n;
+}
 
-        ncw_get_att_float(ncid, varid, "scale_factor", &scale_factor);
-        for (i = 0; i < n; ++i)
-            v[i] /= scale_factor;
+/** Sets the variable to be read. Dimensions are checked against ni, nj, nk
+ ** (as in ncu_field_attach()) for the first member; type and dimensions of the
+ ** variable in the other members are checked against the first member. The
+ ** attributes are read for each member, as packing can differ between
+ ** files. Does nothing if the variable is already set.
+ */
+void ncu_ensemble_setvar(ncu_ensemble* e, char varname[], int ni, int nj, int nk)
+{
+    ncu_field* f0;
+    int j, i;
+
+    if (e->fields[0] != NULL && strcmp(e->fields[0]->varname, varname) == 0)
+        return;
+
+    ncu_ensemble_freefields(e);
+    for (j = 0; j < e->n; ++j)
+        e->fields[j] = ncu_field_attach(e->ncids[j], varname, ni, nj, nk);
+    f0 = e->fields[0];
+    for (j = 1; j < e->n; ++j) {
+        ncu_field* f = e->fields[j];
+
+        if (f->vartype != f0->vartype)
+            quit("\"%s\": %s: type %s differs from type %s in \"%s\"", f->fname, varname, ncw_nctype2str(f->vartype), ncw_nctype2str(f0->vartype), f0->fname);
+        if (f->ndims != f0->ndims)
+            quit("\"%s\": %s: number of dimensions (%d) differs from that in \"%s\" (%d)", f->fname, varname, f->ndims, f0->fname, f0->ndims);
+        for (i = 0; i < f->ndims; ++i)
+            if (f->dimlen[i] != f0->dimlen[i])
+                quit("\"%s\": %s: dimension %d is of length %zu while in \"%s\" it is of length %zu", f->fname, varname, i, f->dimlen[i], f0->fname, f0->dimlen[i]);
     }
+}
 
-    {
-        float attval[2];
+/** Sets the record to be read for all members (see ncu_field_setrecord()).
+ */
+void ncu_ensemble_setrecord(ncu_ensemble* e, int r)
+{
+    int j;
 
-        if (ncw_att_exists2(ncid, varid, "valid_min")) {
-            ncw_check_attlen(ncid, varid, "valid_min", 1);
-            ncw_get_att_float(ncid, varid, "valid_min", attval);
-            for (i = 0; i < n; ++i)
-                if (v[i] < attval[0])
-                    v[i] = attval[0];
-        }
-        if (ncw_att_exists2(ncid, varid, "valid_max")) {
-            ncw_check_attlen(ncid, varid, "valid_max", 1);
-            ncw_get_att_float(ncid, varid, "valid_max", attval);
-            for (i = 0; i < n; ++i)
-                if (v[i] > attval[0])
-                    v[i] = attval[0];
-        }
-        if (ncw_att_exists2(ncid, varid, "valid_range")) {
-            ncw_check_attlen(ncid, varid, "valid_range", 2);
-            ncw_get_att_float(ncid, varid, "valid_range", attval);
-            for (i = 0; i < n; ++i)
-                if (v[i] < attval[0])
-                    v[i] = attval[0];
-                else if (v[i] > attval[1])
-                    v[i] = attval[1];
-        }
-        /*
-         * This section does not always work as intended. E.g. for "int" dst
-         * variable type _FillValue = -2147483647 is converted to -2.14748365e8f
-         * and then in nc_put_vara_float() to -2147483648. Removing the code
-         * below makes in that case no difference because NaNf is also converted
-         * to -2147483648 in nc_put_vara_float().
-         *
-         * Yet sometimes the section below turns useful, e.g. in cases when src
-         * and dst have the same data type but different fill values.
-         */
-        {
-            int nofill = 0;
+    if (e->fields[0] == NULL)
+        quit("ncu_ensemble_setrecord(): no variable set");
+    for (j = 0; j < e->n; ++j)
+        ncu_field_setrecord(e->fields[j], r);
+}
 
-            if (ncw_att_exists2(ncid, varid, "_FillValue")) {
-                ncw_check_attlen(ncid, varid, "_FillValue", 1);
-                ncw_get_att_float(ncid, varid, "_FillValue", attval);
-            } else
-                ncw_inq_var_fill(ncid, varid, &nofill, attval);
-            if (!nofill)
-                for (i = 0; i < n; ++i)
-                    if (isnan(v[i]))
-                        v[i] = attval[0];
-        }
-        if (ncw_att_exists2(ncid, varid, "missing_value")) {
-            ncw_check_attlen(ncid, varid, "missing_value", 1);
-            ncw_get_att_float(ncid, varid, "missing_value", attval);
-            for (i = 0; i < n; ++i)
-                if (isnan(v[i]))
-                    v[i] = attval[0];
+/** Reads layers k, ..., k + nlayer - 1 of the variable from all members.
+ ** The hyperslab is calculated once for the ensemble. With `pipeline' member
+ ** j + 1 is read while member j is decoded.
+ * @param e - ensemble descriptor
+ * @param k - first layer
+ * @param nlayer - number of layers
+ * @param v - output, [member][nlayer][j][i]
+ * @return - number of elements read for each member
+ */
+size_t ncu_ensemble_reada(ncu_ensemble* e, int k, int nlayer, float* v)
+{
+    ncu_field* f0 = e->fields[0];
+    size_t start[4], count[4];
+    size_t n;
+    int j;
+
+    if (f0 == NULL)
+        quit("ncu_ensemble_reada(): no variable set");
+    n = ncu_field_getslab(f0, k, nlayer, 0, "ncu_ensemble_reada()", start, count);
+    if (f0->vartype != NC_FLOAT && e->nvv < n) {
+        e->vv[0] = realloc(e->vv[0], n * f0->typesize);
+        e->vv[1] = realloc(e->vv[1], n * f0->typesize);
+        e->nvv = n;
+    }
+
+    for (j = -1; j < e->n; ++j) {
+#if defined(_OPENMP)
+#pragma omp parallel sections num_threads(2) if(e->pipeline)
+#endif
+        {
+#if defined(_OPENMP)
+#pragma omp section
+#endif
+            if (j + 1 < e->n) {
+                ncu_field* f = e->fields[j + 1];
+
+                if (!f->cacheset)
+                    ncu_field_sizecache(f, k, nlayer, 0);
+                ncw_get_vara(f->ncid, f->varid, start, count, (f->vartype == NC_FLOAT) ? (void*) &v[(j + 1) * n] : e->vv[(j + 1) % 2]);
+            }
+#if defined(_OPENMP)
+#pragma omp section
+#endif
+            if (j >= 0) {
+                ncu_field* f = e->fields[j];
+                double t0 = prof_start();
+
+                ncu_decode(f, n, (f->vartype == NC_FLOAT) ? (void*) &v[j * n] : e->vv[j % 2], &v[j * n]);
+                prof_stop(PROF_DECODE, t0, n * f->typesize);
+            }
         }
     }
 
-    ncw_put_vara_float(ncid, varid, start, count, v);
-    ncw_close(ncid);
+    return n;
+}
+
+/** Reads one horizontal field (layer) for a variable from a NetCDF file.
+ ** Verifies that the field dimensions are ni x nj.
+ */
+void ncu_readfield(char fname[], char varname[], int k, int ni, int nj, int nk, float* v)
+{
+    ncu_field* f = ncu_field_open(fname, varname, NC_NOWRITE, ni, nj, nk);
+
+    ncu_field_read(f, k, v);
+    ncu_field_close(f);
+}
+
+/** Writes one horizontal field (layer) for a variable to a NetCDF file.
+ */
+void ncu_writefield(char fname[], char varname[], int k, int ni, int nj, int nk, float* v)
+{
+    ncu_field* f = ncu_field_open(fname, varname, NC_WRITE, ni, nj, nk);
+
+    ncu_field_write(f, k, v);
+    ncu_field_close(f);
 }
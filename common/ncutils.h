@@ -24,12 +24,42 @@ typedef void (*ncu_quit_fn) (char* format, ...);
 void ncu_set_quitfn(ncu_quit_fn quit_fn);
 
 int ncu_getnfields(char fname[], char varname[]);
+int ncu_inq_nfields(int ncid, int varid);
 
 /*
  * generic read procedures
  */
 void ncu_readvarfloat(int ncid, int varid, size_t n, float v[]);
 
+/*
+ * field r/w procedures using an open file
+ */
+typedef struct ncu_field ncu_field;
+
+ncu_field* ncu_field_open(char fname[], char varname[], int mode, int ni, int nj, int nk);
+ncu_field* ncu_field_attach(int ncid, char varname[], int ni, int nj, int nk);
+void ncu_field_close(ncu_field* f);
+int ncu_field_getncid(ncu_field* f);
+int ncu_field_getvarid(ncu_field* f);
+void ncu_field_setrecord(ncu_field* f, int r);
+void ncu_field_setcache(ncu_field* f, int nlayer);
+void ncu_field_read(ncu_field* f, int k, float* v);
+void ncu_field_write(ncu_field* f, int k, float* v);
+void ncu_field_reada(ncu_field* f, int k, int nlayer, float* v);
+void ncu_field_writea(ncu_field* f, int k, int nlayer, float* v);
+
+/*
+ * ensemble read procedures (the same variable in a number of files)
+ */
+typedef struct ncu_ensemble ncu_ensemble;
+
+ncu_ensemble* ncu_ensemble_open(int n, char* fnames[], int pipeline);
+void ncu_ensemble_close(ncu_ensemble* e);
+int ncu_ensemble_getsize(ncu_ensemble* e);
+void ncu_ensemble_setvar(ncu_ensemble* e, char varname[], int ni, int nj, int nk);
+void ncu_ensemble_setrecord(ncu_ensemble* e, int r);
+size_t ncu_ensemble_reada(ncu_ensemble* e, int k, int nlayer, float* v);
+
 /*
  * model r/w procedures
  */
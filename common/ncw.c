@@ -31,9 +31,13 @@
 #include <float.h>
 #include <math.h>
 #include <errno.h>
+#if defined(NCW_FILTERS)
+#include <netcdf_filter.h>
+#endif
 #include "ncw.h"
+#include "profile.h"
 
-const char ncw_version[] = "2.31.4";
+const char ncw_version[] = "2.32.0";
 
 /*
  * A flag -- whether ncw_copy_vardef() (re-)defines chunking by layers.
@@ -43,6 +47,14 @@ const char ncw_version[] = "2.31.4";
  */
 int ncw_chunkbylayers = 1;
 
+/*
+ * Output policy -- compression, chunking and chunk cache settings applied to
+ * the output variables by ncw_def_var_outpolicy() and ncw_def_outpolicy().
+ * Negative (or zero) values leave the corresponding settings as they are. Can
+ * be set from a string by ncw_set_outpolicy().
+ */
+ncw_policy ncw_outpolicy = { -1, -1, 0, 0, 0, 0 };
+
 /* This macro is substituted in error messages instead of the name of a
  * variable in cases when the name could not be found by the variable id.
  */
@@ -102,6 +114,42 @@ static void _ncw_inq_varname(int ncid, int varid, char varname[])
         quit("\"%s\": nc_inq_varname(): failed for varid = %d: %s", ncw_get_path(ncid), varid, nc_strerror(status));
 }
 
+/* Accumulates profiling statistics for reading or writing of a variable
+ * (whole if `count' is NULL). `typesize' = 0 stands for the external type.
+ */
+static void ncw_prof_io(int category, double t0, int ncid, int varid, const size_t count[], size_t typesize)
+{
+    size_t n = 1;
+    int ndims, i;
+
+    if (!prof_enabled)
+        return;
+
+    if (nc_inq_varndims(ncid, varid, &ndims) != NC_NOERR)
+        ndims = 0;
+    if (count != NULL) {
+        for (i = 0; i < ndims; ++i)
+            n *= count[i];
+    } else {
+        int dimids[NC_MAX_VAR_DIMS];
+
+        nc_inq_vardimid(ncid, varid, dimids);
+        for (i = 0; i < ndims; ++i) {
+            size_t len = 0;
+
+            nc_inq_dimlen(ncid, dimids[i], &len);
+            n *= len;
+        }
+    }
+    if (typesize == 0) {
+        nc_type type;
+
+        if (nc_inq_vartype(ncid, varid, &type) != NC_NOERR || nc_inq_type(ncid, type, NULL, &typesize) != NC_NOERR)
+            typesize = 0;
+    }
+    prof_stop(category, t0, n * typesize);
+}
+
 /* Prints array of integers to a string. E.g., {1,2,5} will be printed as
  * "(1,2,5)".
  */
@@ -295,32 +343,40 @@ static struct nctype2str {
 
 void ncw_create(const char fname[], int mode, int* ncid)
 {
+    double t0 = prof_start();
     int status = nc_create(fname, mode, ncid);
 
+    prof_stop(PROF_OPEN, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": nc_create(): failed: %s", fname, nc_strerror(status));
 }
 
 void ncw_open(const char fname[], int mode, int* ncid)
 {
+    double t0 = prof_start();
     int status = nc_open(fname, mode, ncid);
 
+    prof_stop(PROF_OPEN, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": nc_open(): failed: %s", fname, nc_strerror(status));
 }
 
 void ncw_redef(int ncid)
 {
+    double t0 = prof_start();
     int status = nc_redef(ncid);
 
+    prof_stop(PROF_OPEN, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": ncredef(): failed: %s", ncw_get_path(ncid), nc_strerror(status));
 }
 
 void ncw_enddef(int ncid)
 {
+    double t0 = prof_start();
     int status = nc_enddef(ncid);
 
+    prof_stop(PROF_OPEN, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": ncenddef(): failed: %s", ncw_get_path(ncid), nc_strerror(status));
 }
@@ -328,10 +384,13 @@ void ncw_enddef(int ncid)
 void ncw_sync(int ncid)
 {
     int status;
+    double t0;
 
     nc_enddef(ncid);
 
+    t0 = prof_start();
     status = ncsync(ncid);
+    prof_stop(PROF_OPEN, t0, 0);
 
     if (status != NC_NOERR)
         quit("\"%s\": ncsync(): failed: %s", ncw_get_path(ncid), nc_strerror(status));
@@ -339,96 +398,120 @@ void ncw_sync(int ncid)
 
 void ncw_close(int ncid)
 {
+    double t0 = prof_start();
     int status = nc_close(ncid);
 
+    prof_stop(PROF_OPEN, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": nc_close(): failed: %s", ncw_get_path(ncid), nc_strerror(status));
 }
 
 void ncw_inq(int ncid, int* ndims, int* nvars, int* natts, int* unlimdimid)
 {
+    double t0 = prof_start();
     int status = nc_inq(ncid, ndims, nvars, natts, unlimdimid);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": nc_inq(): failed: %s", ncw_get_path(ncid), nc_strerror(status));
 }
 
 void ncw_inq_ndims(int ncid, int* ndims)
 {
+    double t0 = prof_start();
     int status = nc_inq_ndims(ncid, ndims);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": nc_inq_ndims(): failed: %s", ncw_get_path(ncid), nc_strerror(status));
 }
 
 void ncw_inq_nvars(int ncid, int* nvars)
 {
+    double t0 = prof_start();
     int status = nc_inq_nvars(ncid, nvars);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": nc_inq_nvars(): failed: %s", ncw_get_path(ncid), nc_strerror(status));
 }
 
 void ncw_inq_natts(int ncid, int* natts)
 {
+    double t0 = prof_start();
     int status = nc_inq_natts(ncid, natts);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": nc_inq_natts(): failed: %s", ncw_get_path(ncid), nc_strerror(status));
 }
 
 void ncw_inq_unlimdim(int ncid, int* unlimdimid)
 {
+    double t0 = prof_start();
     int status = nc_inq_unlimdim(ncid, unlimdimid);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": nc_inq_unlimdim(): failed: %s", ncw_get_path(ncid), nc_strerror(status));
 }
 
 void ncw_inq_format(int ncid, int* format)
 {
+    double t0 = prof_start();
     int status = nc_inq_format(ncid, format);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": nc_inq_format(): failed: %s", ncw_get_path(ncid), nc_strerror(status));
 }
 
 void ncw_def_dim(int ncid, const char dimname[], size_t len, int* dimid)
 {
+    double t0 = prof_start();
     int status = nc_def_dim(ncid, dimname, len, dimid);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": nc_def_dim(): failed for dimname = \"%s\", dimlen = %zu: %s", ncw_get_path(ncid), dimname, len, nc_strerror(status));
 }
 
 void ncw_inq_dimid(int ncid, const char dimname[], int* dimid)
 {
+    double t0 = prof_start();
     int status = nc_inq_dimid(ncid, dimname, dimid);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": nc_inq_dimid(): failed for dimname = \"%s\": %s", ncw_get_path(ncid), dimname, nc_strerror(status));
 }
 
 void ncw_inq_dim(int ncid, int dimid, char dimname[], size_t* len)
 {
+    double t0 = prof_start();
     int status = nc_inq_dim(ncid, dimid, dimname, len);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": nc_inq_dim(): failed for dimid = %d: %s", ncw_get_path(ncid), dimid, nc_strerror(status));
 }
 
 void ncw_inq_dimname(int ncid, int dimid, char dimname[])
 {
+    double t0 = prof_start();
     int status = nc_inq_dimname(ncid, dimid, dimname);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": nc_inq_dimname(): failed for dimid = %d: %s", ncw_get_path(ncid), dimid, nc_strerror(status));
 }
 
 void ncw_inq_dimlen(int ncid, int dimid, size_t* len)
 {
+    double t0 = prof_start();
     int status = nc_inq_dimlen(ncid, dimid, len);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char dimname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -451,16 +534,20 @@ void ncw_rename_dim(int ncid, const char oldname[], const char newname[])
 
 void ncw_def_var(int ncid, const char varname[], nc_type xtype, int ndims, const int dimids[], int* varid)
 {
+    double t0 = prof_start();
     int status = nc_def_var(ncid, varname, xtype, ndims, dimids, varid);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": nc_def_var(): failed for varname = \"%s\", vartype = %s, ndims = %d, dimids = %s: %s", ncw_get_path(ncid), varname, ncw_nctype2str(xtype), ndims, uint2str(ndims, (const unsigned int*) dimids), nc_strerror(status));
 }
 
 void ncw_def_var_deflate(int ncid, int varid, int shuffle, int deflate, int deflate_level)
 {
+    double t0 = prof_start();
     int status = nc_def_var_deflate(ncid, varid, shuffle, deflate, deflate_level);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = "STR_UNKNOWN";
 
@@ -471,8 +558,10 @@ void ncw_def_var_deflate(int ncid, int varid, int shuffle, int deflate, int defl
 
 void ncw_def_var_fill(int ncid, int varid, int nofill, void* fillvalue)
 {
+    double t0 = prof_start();
     int status = nc_def_var_fill(ncid, varid, nofill, fillvalue);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = "STR_UNKNOWN";
 
@@ -483,16 +572,20 @@ void ncw_def_var_fill(int ncid, int varid, int nofill, void* fillvalue)
 
 void ncw_inq_varid(int ncid, const char varname[], int* varid)
 {
+    double t0 = prof_start();
     int status = nc_inq_varid(ncid, varname, varid);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": nc_inq_varid(): failed for varname = \"%s\": %s", ncw_get_path(ncid), varname, nc_strerror(status));
 }
 
 void ncw_inq_var(int ncid, int varid, char varname[], nc_type* xtype, int* ndims, int dimids[], int* natts)
 {
+    double t0 = prof_start();
     int status = nc_inq_var(ncid, varid, varname, xtype, ndims, dimids, natts);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname2[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -503,16 +596,20 @@ void ncw_inq_var(int ncid, int varid, char varname[], nc_type* xtype, int* ndims
 
 void ncw_inq_varname(int ncid, int varid, char varname[])
 {
+    double t0 = prof_start();
     int status = nc_inq_varname(ncid, varid, varname);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR)
         quit("\"%s\": nc_inq_varname(): failed for varid = %d: %s", ncw_get_path(ncid), varid, nc_strerror(status));
 }
 
 void ncw_inq_vartype(int ncid, int varid, nc_type* xtype)
 {
+    double t0 = prof_start();
     int status = nc_inq_vartype(ncid, varid, xtype);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -523,8 +620,10 @@ void ncw_inq_vartype(int ncid, int varid, nc_type* xtype)
 
 void ncw_inq_varndims(int ncid, int varid, int* ndims)
 {
+    double t0 = prof_start();
     int status = nc_inq_varndims(ncid, varid, ndims);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = "STR_UNKNOWN";
 
@@ -535,8 +634,10 @@ void ncw_inq_varndims(int ncid, int varid, int* ndims)
 
 void ncw_inq_vardimid(int ncid, int varid, int dimids[])
 {
+    double t0 = prof_start();
     int status = nc_inq_vardimid(ncid, varid, dimids);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -547,8 +648,10 @@ void ncw_inq_vardimid(int ncid, int varid, int dimids[])
 
 void ncw_inq_varnatts(int ncid, int varid, int* natts)
 {
+    double t0 = prof_start();
     int status = nc_inq_varnatts(ncid, varid, natts);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = "STR_UNKNOWN";
 
@@ -575,8 +678,10 @@ void ncw_inq_varsize(int ncid, int varid, size_t* size)
 
 void ncw_inq_var_deflate(int ncid, int varid, int* shuffle, int* deflate, int* deflate_level)
 {
+    double t0 = prof_start();
     int status = nc_inq_var_deflate(ncid, varid, shuffle, deflate, deflate_level);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -587,8 +692,10 @@ void ncw_inq_var_deflate(int ncid, int varid, int* shuffle, int* deflate, int* d
 
 void ncw_inq_var_fill(int ncid, int varid, int* nofill, void* fillvalue)
 {
+    double t0 = prof_start();
     int status = nc_inq_var_fill(ncid, varid, nofill, fillvalue);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -597,6 +704,48 @@ void ncw_inq_var_fill(int ncid, int varid, int* nofill, void* fillvalue)
     }
 }
 
+void ncw_inq_var_chunking(int ncid, int varid, int* storage, size_t chunksizes[])
+{
+    double t0 = prof_start();
+    int status = nc_inq_var_chunking(ncid, varid, storage, chunksizes);
+
+    prof_stop(PROF_META, t0, 0);
+    if (status != NC_NOERR) {
+        char varname[NC_MAX_NAME] = STR_UNKNOWN;
+
+        ncw_inq_varname(ncid, varid, varname);
+        quit("\"%s\": nc_inq_var_chunking(): failed for varid = %d (varname = \"%s\"): %s", ncw_get_path(ncid), varid, varname, nc_strerror(status));
+    }
+}
+
+void ncw_set_var_chunk_cache(int ncid, int varid, size_t size, size_t nelems, float preemption)
+{
+    double t0 = prof_start();
+    int status = nc_set_var_chunk_cache(ncid, varid, size, nelems, preemption);
+
+    prof_stop(PROF_META, t0, 0);
+    if (status != NC_NOERR) {
+        char varname[NC_MAX_NAME] = STR_UNKNOWN;
+
+        ncw_inq_varname(ncid, varid, varname);
+        quit("\"%s\": nc_set_var_chunk_cache(): failed for varid = %d (varname = \"%s\", size = %zu): %s", ncw_get_path(ncid), varid, varname, size, nc_strerror(status));
+    }
+}
+
+void ncw_def_var_chunking(int ncid, int varid, int storage, const size_t chunksizes[])
+{
+    double t0 = prof_start();
+    int status = nc_def_var_chunking(ncid, varid, storage, chunksizes);
+
+    prof_stop(PROF_META, t0, 0);
+    if (status != NC_NOERR) {
+        char varname[NC_MAX_NAME] = STR_UNKNOWN;
+
+        ncw_inq_varname(ncid, varid, varname);
+        quit("\"%s\": nc_def_var_chunking(): failed for varid = %d (varname = \"%s\"): %s", ncw_get_path(ncid), varid, varname, nc_strerror(status));
+    }
+}
+
 void ncw_rename_var(int ncid, const char oldname[], const char newname[])
 {
     int varid;
@@ -611,8 +760,10 @@ void ncw_rename_var(int ncid, const char oldname[], const char newname[])
 
 void ncw_put_var(int ncid, int varid, const void* v)
 {
+    double t0 = prof_start();
     int status = nc_put_var(ncid, varid, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, NULL, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -623,8 +774,10 @@ void ncw_put_var(int ncid, int varid, const void* v)
 
 void ncw_put_var_text(int ncid, int varid, const char v[])
 {
+    double t0 = prof_start();
     int status = nc_put_var_text(ncid, varid, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -635,8 +788,10 @@ void ncw_put_var_text(int ncid, int varid, const char v[])
 
 void ncw_put_var_schar(int ncid, int varid, const signed char v[])
 {
+    double t0 = prof_start();
     int status = nc_put_var_schar(ncid, varid, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -647,8 +802,10 @@ void ncw_put_var_schar(int ncid, int varid, const signed char v[])
 
 void ncw_put_var_uchar(int ncid, int varid, const unsigned char v[])
 {
+    double t0 = prof_start();
     int status = nc_put_var_uchar(ncid, varid, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -659,8 +816,10 @@ void ncw_put_var_uchar(int ncid, int varid, const unsigned char v[])
 
 void ncw_put_var_short(int ncid, int varid, const short v[])
 {
+    double t0 = prof_start();
     int status = nc_put_var_short(ncid, varid, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -671,8 +830,10 @@ void ncw_put_var_short(int ncid, int varid, const short v[])
 
 void ncw_put_var_ushort(int ncid, int varid, const unsigned short v[])
 {
+    double t0 = prof_start();
     int status = nc_put_var_ushort(ncid, varid, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -683,8 +844,10 @@ void ncw_put_var_ushort(int ncid, int varid, const unsigned short v[])
 
 void ncw_put_var_int(int ncid, int varid, const int v[])
 {
+    double t0 = prof_start();
     int status = nc_put_var_int(ncid, varid, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -695,8 +858,10 @@ void ncw_put_var_int(int ncid, int varid, const int v[])
 
 void ncw_put_var_uint(int ncid, int varid, const unsigned int v[])
 {
+    double t0 = prof_start();
     int status = nc_put_var_uint(ncid, varid, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -707,8 +872,10 @@ void ncw_put_var_uint(int ncid, int varid, const unsigned int v[])
 
 void ncw_put_var_long(int ncid, int varid, const long v[])
 {
+    double t0 = prof_start();
     int status = nc_put_var_long(ncid, varid, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -719,8 +886,10 @@ void ncw_put_var_long(int ncid, int varid, const long v[])
 
 void ncw_put_var_float(int ncid, int varid, const float v[])
 {
+    double t0 = prof_start();
     int status = nc_put_var_float(ncid, varid, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -731,8 +900,10 @@ void ncw_put_var_float(int ncid, int varid, const float v[])
 
 void ncw_put_var_double(int ncid, int varid, const double v[])
 {
+    double t0 = prof_start();
     int status = nc_put_var_double(ncid, varid, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -743,8 +914,10 @@ void ncw_put_var_double(int ncid, int varid, const double v[])
 
 void ncw_get_var(int ncid, int varid, void* v)
 {
+    double t0 = prof_start();
     int status = nc_get_var(ncid, varid, v);
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, NULL, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -755,8 +928,10 @@ void ncw_get_var(int ncid, int varid, void* v)
 
 void ncw_get_var_text(int ncid, int varid, char v[])
 {
+    double t0 = prof_start();
     int status = nc_get_var_text(ncid, varid, v);
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -767,8 +942,10 @@ void ncw_get_var_text(int ncid, int varid, char v[])
 
 void ncw_get_var_schar(int ncid, int varid, signed char v[])
 {
+    double t0 = prof_start();
     int status = nc_get_var_schar(ncid, varid, v);
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -779,8 +956,10 @@ void ncw_get_var_schar(int ncid, int varid, signed char v[])
 
 void ncw_get_var_uchar(int ncid, int varid, unsigned char v[])
 {
+    double t0 = prof_start();
     int status = nc_get_var_uchar(ncid, varid, v);
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -791,8 +970,10 @@ void ncw_get_var_uchar(int ncid, int varid, unsigned char v[])
 
 void ncw_get_var_short(int ncid, int varid, short int v[])
 {
+    double t0 = prof_start();
     int status = nc_get_var_short(ncid, varid, v);
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -803,8 +984,10 @@ void ncw_get_var_short(int ncid, int varid, short int v[])
 
 void ncw_get_var_ushort(int ncid, int varid, unsigned short int v[])
 {
+    double t0 = prof_start();
     int status = nc_get_var_ushort(ncid, varid, v);
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -815,8 +998,10 @@ void ncw_get_var_ushort(int ncid, int varid, unsigned short int v[])
 
 void ncw_get_var_int(int ncid, int varid, int v[])
 {
+    double t0 = prof_start();
     int status = nc_get_var_int(ncid, varid, v);
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -827,8 +1012,10 @@ void ncw_get_var_int(int ncid, int varid, int v[])
 
 void ncw_get_var_uint(int ncid, int varid, unsigned int v[])
 {
+    double t0 = prof_start();
     int status = nc_get_var_uint(ncid, varid, v);
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -839,8 +1026,10 @@ void ncw_get_var_uint(int ncid, int varid, unsigned int v[])
 
 void ncw_get_var_float(int ncid, int varid, float v[])
 {
+    double t0 = prof_start();
     int status = nc_get_var_float(ncid, varid, v);
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -851,9 +1040,11 @@ void ncw_get_var_float(int ncid, int varid, float v[])
 
 void ncw_get_var_float_fixerange(int ncid, int varid, float v[])
 {
+    double t0 = prof_start();
     int status = nc_get_var_float(ncid, varid, v);
     nc_type type;
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status == NC_NOERR)
         return;
 
@@ -883,8 +1074,10 @@ void ncw_get_var_float_fixerange(int ncid, int varid, float v[])
 
 void ncw_get_var_double(int ncid, int varid, double v[])
 {
+    double t0 = prof_start();
     int status = nc_get_var_double(ncid, varid, v);
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, NULL, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -895,8 +1088,10 @@ void ncw_get_var_double(int ncid, int varid, double v[])
 
 void ncw_get_var1_double(int ncid, int varid, const size_t len[], double* in)
 {
+    double t0 = prof_start();
     int status = nc_get_var1_double(ncid, varid, len, in);
 
+    prof_stop(PROF_READ, t0, sizeof(double));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -907,8 +1102,10 @@ void ncw_get_var1_double(int ncid, int varid, const size_t len[], double* in)
 
 void ncw_put_vara(int ncid, int varid, const size_t start[], const size_t count[], void* v)
 {
+    double t0 = prof_start();
     int status = nc_put_vara(ncid, varid, start, count, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, count, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -919,8 +1116,10 @@ void ncw_put_vara(int ncid, int varid, const size_t start[], const size_t count[
 
 void ncw_put_vara_text(int ncid, int varid, const size_t start[], const size_t count[], const char v[])
 {
+    double t0 = prof_start();
     int status = nc_put_vara_text(ncid, varid, start, count, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, count, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
         int ndims = 0;
@@ -933,8 +1132,10 @@ void ncw_put_vara_text(int ncid, int varid, const size_t start[], const size_t c
 
 void ncw_put_vara_short(int ncid, int varid, const size_t start[], const size_t count[], const short int v[])
 {
+    double t0 = prof_start();
     int status = nc_put_vara_short(ncid, varid, start, count, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, count, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
         int ndims = 0;
@@ -947,8 +1148,10 @@ void ncw_put_vara_short(int ncid, int varid, const size_t start[], const size_t
 
 void ncw_put_vara_ushort(int ncid, int varid, const size_t start[], const size_t count[], const unsigned short int v[])
 {
+    double t0 = prof_start();
     int status = nc_put_vara_ushort(ncid, varid, start, count, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, count, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
         int ndims = 0;
@@ -961,8 +1164,10 @@ void ncw_put_vara_ushort(int ncid, int varid, const size_t start[], const size_t
 
 void ncw_put_vara_int(int ncid, int varid, const size_t start[], const size_t count[], const int v[])
 {
+    double t0 = prof_start();
     int status = nc_put_vara_int(ncid, varid, start, count, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, count, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
         int ndims = 0;
@@ -975,8 +1180,10 @@ void ncw_put_vara_int(int ncid, int varid, const size_t start[], const size_t co
 
 void ncw_put_vara_uint(int ncid, int varid, const size_t start[], const size_t count[], const unsigned int v[])
 {
+    double t0 = prof_start();
     int status = nc_put_vara_uint(ncid, varid, start, count, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, count, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
         int ndims = 0;
@@ -989,8 +1196,10 @@ void ncw_put_vara_uint(int ncid, int varid, const size_t start[], const size_t c
 
 void ncw_put_vara_float(int ncid, int varid, const size_t start[], const size_t count[], const float v[])
 {
+    double t0 = prof_start();
     int status = nc_put_vara_float(ncid, varid, start, count, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, count, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
         int ndims = 0;
@@ -1003,8 +1212,10 @@ void ncw_put_vara_float(int ncid, int varid, const size_t start[], const size_t
 
 void ncw_put_vara_double(int ncid, int varid, const size_t start[], const size_t count[], const double v[])
 {
+    double t0 = prof_start();
     int status = nc_put_vara_double(ncid, varid, start, count, v);
 
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, count, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
         int ndims = 0;
@@ -1017,8 +1228,10 @@ void ncw_put_vara_double(int ncid, int varid, const size_t start[], const size_t
 
 void ncw_get_vara(int ncid, int varid, const size_t start[], const size_t count[], void* v)
 {
+    double t0 = prof_start();
     int status = nc_get_vara(ncid, varid, start, count, v);
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, count, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1029,8 +1242,10 @@ void ncw_get_vara(int ncid, int varid, const size_t start[], const size_t count[
 
 void ncw_get_vara_text(int ncid, int varid, const size_t start[], const size_t count[], char v[])
 {
+    double t0 = prof_start();
     int status = nc_get_vara_text(ncid, varid, start, count, v);
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, count, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1041,8 +1256,10 @@ void ncw_get_vara_text(int ncid, int varid, const size_t start[], const size_t c
 
 void ncw_get_vara_short(int ncid, int varid, const size_t start[], const size_t count[], short int v[])
 {
+    double t0 = prof_start();
     int status = nc_get_vara_short(ncid, varid, start, count, v);
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, count, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1053,8 +1270,10 @@ void ncw_get_vara_short(int ncid, int varid, const size_t start[], const size_t
 
 void ncw_get_vara_int(int ncid, int varid, const size_t start[], const size_t count[], int v[])
 {
+    double t0 = prof_start();
     int status = nc_get_vara_int(ncid, varid, start, count, v);
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, count, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1065,8 +1284,10 @@ void ncw_get_vara_int(int ncid, int varid, const size_t start[], const size_t co
 
 void ncw_get_vara_float(int ncid, int varid, const size_t start[], const size_t count[], float v[])
 {
+    double t0 = prof_start();
     int status = nc_get_vara_float(ncid, varid, start, count, v);
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, count, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1077,9 +1298,11 @@ void ncw_get_vara_float(int ncid, int varid, const size_t start[], const size_t
 
 void ncw_get_vara_float_fixerange(int ncid, int varid, const size_t start[], const size_t count[], float v[])
 {
+    double t0 = prof_start();
     int status = nc_get_vara_float(ncid, varid, start, count, v);
     nc_type type;
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, count, sizeof(v[0]));
     if (status == NC_NOERR)
         return;
 
@@ -1115,8 +1338,10 @@ void ncw_get_vara_float_fixerange(int ncid, int varid, const size_t start[], con
 
 void ncw_get_vara_double(int ncid, int varid, const size_t start[], const size_t count[], double v[])
 {
+    double t0 = prof_start();
     int status = nc_get_vara_double(ncid, varid, start, count, v);
 
+    ncw_prof_io(PROF_READ, t0, ncid, varid, count, sizeof(v[0]));
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1127,8 +1352,10 @@ void ncw_get_vara_double(int ncid, int varid, const size_t start[], const size_t
 
 void ncw_put_att_text(int ncid, int varid, const char attname[], const char v[])
 {
+    double t0 = prof_start();
     int status = nc_put_att_text(ncid, varid, attname, strlen(v), v);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1139,8 +1366,10 @@ void ncw_put_att_text(int ncid, int varid, const char attname[], const char v[])
 
 void ncw_put_att_uchar(int ncid, int varid, const char attname[], size_t len, const unsigned char v[])
 {
+    double t0 = prof_start();
     int status = nc_put_att_uchar(ncid, varid, attname, NC_UBYTE, len, v);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1151,8 +1380,10 @@ void ncw_put_att_uchar(int ncid, int varid, const char attname[], size_t len, co
 
 void ncw_put_att_short(int ncid, int varid, const char attname[], size_t len, const short int v[])
 {
+    double t0 = prof_start();
     int status = nc_put_att_short(ncid, varid, attname, NC_SHORT, len, v);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1163,8 +1394,10 @@ void ncw_put_att_short(int ncid, int varid, const char attname[], size_t len, co
 
 void ncw_put_att_ushort(int ncid, int varid, const char attname[], size_t len, const unsigned short int v[])
 {
+    double t0 = prof_start();
     int status = nc_put_att_ushort(ncid, varid, attname, NC_USHORT, len, v);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1175,8 +1408,10 @@ void ncw_put_att_ushort(int ncid, int varid, const char attname[], size_t len, c
 
 void ncw_put_att_int(int ncid, int varid, const char attname[], size_t len, const int v[])
 {
+    double t0 = prof_start();
     int status = nc_put_att_int(ncid, varid, attname, NC_INT, len, v);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1187,8 +1422,10 @@ void ncw_put_att_int(int ncid, int varid, const char attname[], size_t len, cons
 
 void ncw_put_att_long(int ncid, int varid, const char attname[], size_t len, const long int v[])
 {
+    double t0 = prof_start();
     int status = nc_put_att_long(ncid, varid, attname, NC_INT, len, v);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1199,8 +1436,10 @@ void ncw_put_att_long(int ncid, int varid, const char attname[], size_t len, con
 
 void ncw_put_att_float(int ncid, int varid, const char attname[], size_t len, const float v[])
 {
+    double t0 = prof_start();
     int status = nc_put_att_float(ncid, varid, attname, NC_FLOAT, len, v);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = "STR_UNKNOWN";
 
@@ -1224,8 +1463,10 @@ void ncw_put_att_float(int ncid, int varid, const char attname[], size_t len, co
 
 void ncw_put_att_double(int ncid, int varid, const char attname[], size_t len, const double v[])
 {
+    double t0 = prof_start();
     int status = nc_put_att_double(ncid, varid, attname, NC_DOUBLE, len, v);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1249,8 +1490,10 @@ void ncw_put_att_double(int ncid, int varid, const char attname[], size_t len, c
 
 void ncw_inq_attname(int ncid, int varid, int attrid, char attname[])
 {
+    double t0 = prof_start();
     int status = nc_inq_attname(ncid, varid, attrid, attname);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1261,8 +1504,10 @@ void ncw_inq_attname(int ncid, int varid, int attrid, char attname[])
 
 void ncw_inq_att(int ncid, int varid, const char attname[], nc_type* xtype, size_t* len)
 {
+    double t0 = prof_start();
     int status = nc_inq_att(ncid, varid, attname, xtype, len);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1273,8 +1518,10 @@ void ncw_inq_att(int ncid, int varid, const char attname[], nc_type* xtype, size
 
 void ncw_inq_attlen(int ncid, int varid, const char attname[], size_t* len)
 {
+    double t0 = prof_start();
     int status = nc_inq_attlen(ncid, varid, attname, len);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1285,8 +1532,10 @@ void ncw_inq_attlen(int ncid, int varid, const char attname[], size_t* len)
 
 void ncw_inq_atttype(int ncid, int varid, const char attname[], nc_type* xtype)
 {
+    double t0 = prof_start();
     int status = nc_inq_atttype(ncid, varid, attname, xtype);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1297,8 +1546,10 @@ void ncw_inq_atttype(int ncid, int varid, const char attname[], nc_type* xtype)
 
 void ncw_copy_att(int ncid_src, int varid_src, const char attname[], int ncid_dst, int varid_dst)
 {
+    double t0 = prof_start();
     int status = nc_copy_att(ncid_src, varid_src, attname, ncid_dst, varid_dst);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname_src[NC_MAX_NAME] = STR_UNKNOWN;
         char varname_dst[NC_MAX_NAME] = STR_UNKNOWN;
@@ -1322,8 +1573,10 @@ void ncw_rename_att(int ncid, int varid, const char oldname[], const char newnam
 
 void ncw_del_att(int ncid, int varid, const char attname[])
 {
+    double t0 = prof_start();
     int status = nc_del_att(ncid, varid, attname);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1334,8 +1587,10 @@ void ncw_del_att(int ncid, int varid, const char attname[])
 
 void ncw_get_att(int ncid, int varid, const char attname[], void* v)
 {
+    double t0 = prof_start();
     int status = nc_get_att(ncid, varid, attname, v);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1363,8 +1618,10 @@ void ncw_get_att_text(int ncid, int varid, const char attname[], char v[])
 
 void ncw_get_att_schar(int ncid, int varid, const char attname[], signed char v[])
 {
+    double t0 = prof_start();
     int status = nc_get_att_schar(ncid, varid, attname, v);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1375,8 +1632,10 @@ void ncw_get_att_schar(int ncid, int varid, const char attname[], signed char v[
 
 void ncw_get_att_short(int ncid, int varid, const char attname[], short int v[])
 {
+    double t0 = prof_start();
     int status = nc_get_att_short(ncid, varid, attname, v);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1387,8 +1646,10 @@ void ncw_get_att_short(int ncid, int varid, const char attname[], short int v[])
 
 void ncw_get_att_int(int ncid, int varid, const char attname[], int v[])
 {
+    double t0 = prof_start();
     int status = nc_get_att_int(ncid, varid, attname, v);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1399,8 +1660,10 @@ void ncw_get_att_int(int ncid, int varid, const char attname[], int v[])
 
 void ncw_get_att_uint(int ncid, int varid, const char attname[], unsigned int v[])
 {
+    double t0 = prof_start();
     int status = nc_get_att_uint(ncid, varid, attname, v);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1411,8 +1674,10 @@ void ncw_get_att_uint(int ncid, int varid, const char attname[], unsigned int v[
 
 void ncw_get_att_float(int ncid, int varid, const char attname[], float v[])
 {
+    double t0 = prof_start();
     int status = nc_get_att_float(ncid, varid, attname, v);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1423,8 +1688,10 @@ void ncw_get_att_float(int ncid, int varid, const char attname[], float v[])
 
 void ncw_get_att_double(int ncid, int varid, const char attname[], double v[])
 {
+    double t0 = prof_start();
     int status = nc_get_att_double(ncid, varid, attname, v);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -1757,8 +2024,10 @@ void ncw_def_deflate(int ncid, int shuffle, int deflate, int deflate_level)
 
     ncw_inq_nvars(ncid, &nv);
     for (vid = 0; vid < nv; ++vid) {
+        double t0 = prof_start();
         int status = nc_def_var_deflate(ncid, vid, shuffle, deflate, deflate_level);
 
+        prof_stop(PROF_META, t0, 0);
         if (status != NC_NOERR) {
             char varname[NC_MAX_NAME] = "STR_UNKNOWN";
 
@@ -1768,6 +2037,186 @@ void ncw_def_deflate(int ncid, int shuffle, int deflate, int deflate_level)
     }
 }
 
+/** Sets the output policy from a string of comma-separated entries
+ * "deflate=<level>", "shuffle=<0|1>", "chunk=<layers|N>", "cache=<MB>",
+ * "filter=<zstd|bzip2>[:<level>]". "chunk=layers" chunks variables with 2 or
+ * more dimensions by single layers, "chunk=N" -- by N layers.
+ * HDF5 filters are only available if compiled with -DNCW_FILTERS.
+ *
+ * @param spec Policy string
+ */
+void ncw_set_outpolicy(const char spec[])
+{
+    char* buf = strdup(spec);
+    char* token;
+
+    for (token = strtok(buf, ","); token != NULL; token = strtok(NULL, ",")) {
+        char* value = strchr(token, '=');
+        char* end = NULL;
+
+        if (value == NULL)
+            quit("ncw_set_outpolicy(): \"%s\": expected <key>=<value>", token);
+        *value = 0;
+        value++;
+        if (strcmp(token, "deflate") == 0) {
+            long level = strtol(value, &end, 10);
+
+            if (end == value || *end != 0 || level < 0 || level > 9)
+                quit("ncw_set_outpolicy(): deflate = \"%s\": expected deflation level 0 to 9", value);
+            ncw_outpolicy.deflate_level = (int) level;
+        } else if (strcmp(token, "shuffle") == 0) {
+            if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0)
+                quit("ncw_set_outpolicy(): shuffle = \"%s\": expected 0 or 1", value);
+            ncw_outpolicy.shuffle = (value[0] == '1');
+        } else if (strcmp(token, "chunk") == 0) {
+            if (strcmp(value, "layers") == 0)
+                ncw_outpolicy.chunklayers = 1;
+            else {
+                long nlayer = strtol(value, &end, 10);
+
+                if (end == value || *end != 0 || nlayer < 1)
+                    quit("ncw_set_outpolicy(): chunk = \"%s\": expected \"layers\" or number of layers per chunk", value);
+                ncw_outpolicy.chunklayers = (size_t) nlayer;
+            }
+        } else if (strcmp(token, "cache") == 0) {
+            double size = strtod(value, &end);
+
+            if (end == value || *end != 0 || size <= 0.0)
+                quit("ncw_set_outpolicy(): cache = \"%s\": expected positive size in MB", value);
+            ncw_outpolicy.cachesize = (size_t) (size * 1048576.0);
+        } else if (strcmp(token, "filter") == 0) {
+            char* level = strchr(value, ':');
+
+            if (level != NULL) {
+                long l;
+
+                *level = 0;
+                level++;
+                l = strtol(level, &end, 10);
+                if (end == level || *end != 0 || l < 0)
+                    quit("ncw_set_outpolicy(): filter = \"%s:%s\": could not convert \"%s\" to filter level", value, level, level);
+                ncw_outpolicy.filterlevel = (unsigned int) l;
+            }
+            if (strcmp(value, "zstd") == 0) {
+                ncw_outpolicy.filterid = NCW_FILTER_ZSTD;
+                if (level == NULL)
+                    ncw_outpolicy.filterlevel = 1;
+            } else if (strcmp(value, "bzip2") == 0) {
+                ncw_outpolicy.filterid = NCW_FILTER_BZIP2;
+                if (level == NULL)
+                    ncw_outpolicy.filterlevel = 9;
+            } else
+                quit("ncw_set_outpolicy(): filter = \"%s\": expected \"zstd\" or \"bzip2\"", value);
+#if !defined(NCW_FILTERS)
+            quit("ncw_set_outpolicy(): filter = \"%s\": compiled without HDF5 filter support (-DNCW_FILTERS)", value);
+#endif
+        } else
+            quit("ncw_set_outpolicy(): unknown key \"%s\"", token);
+    }
+    free(buf);
+}
+
+/** Applies the output policy to a variable. The file must be in define mode
+ * and the variable must not have been written to yet. Does nothing for
+ * CLASSIC and 64BIT_OFFSET formats.
+ *
+ * @param ncid NetCDF file id
+ * @param varid Variable id
+ */
+void ncw_def_var_outpolicy(int ncid, int varid)
+{
+    ncw_policy* p = &ncw_outpolicy;
+    int format, ndims;
+
+    ncw_inq_format(ncid, &format);
+    if (format == NC_FORMAT_CLASSIC || format == NC_FORMAT_64BIT_OFFSET)
+        return;
+    ncw_inq_varndims(ncid, varid, &ndims);
+    if (ndims == 0)
+        return;
+
+    if (p->chunklayers > 0 && ndims >= 2) {
+        size_t dimlen[NC_MAX_DIMS];
+        size_t chunksize[NC_MAX_DIMS];
+        int i;
+
+        ncw_inq_vardims(ncid, varid, NC_MAX_DIMS, &ndims, dimlen);
+        /*
+         * (skip variables with horizontal dimensions of zero length)
+         */
+        if (dimlen[ndims - 1] > 0 && dimlen[ndims - 2] > 0) {
+            size_t cachesize, cachesize_needed, nelems;
+            float preemption;
+            nc_type type;
+
+            chunksize[ndims - 1] = dimlen[ndims - 1];
+            chunksize[ndims - 2] = dimlen[ndims - 2];
+            for (i = ndims - 3; i >= 0; i--)
+                chunksize[i] = 1;
+            if (ndims >= 3)
+                chunksize[ndims - 3] = (dimlen[ndims - 3] > 0 && dimlen[ndims - 3] < p->chunklayers) ? dimlen[ndims - 3] : p->chunklayers;
+            ncw_def_var_chunking(ncid, varid, NC_CHUNKED, chunksize);
+
+            ncw_inq_vartype(ncid, varid, &type);
+            cachesize_needed = ncw_sizeof(type);
+            for (i = 0; i < ndims; ++i)
+                cachesize_needed *= chunksize[i];
+            nc_get_chunk_cache(&cachesize, &nelems, &preemption);
+            if (cachesize < cachesize_needed)
+                ncw_set_var_chunk_cache(ncid, varid, cachesize_needed, nelems, preemption);
+        }
+    }
+    if (p->deflate_level >= 0 || p->shuffle >= 0) {
+        int shuffle, deflate, deflate_level;
+
+        ncw_inq_var_deflate(ncid, varid, &shuffle, &deflate, &deflate_level);
+        if (p->shuffle >= 0)
+            shuffle = p->shuffle;
+        if (p->deflate_level >= 0) {
+            deflate = (p->deflate_level > 0);
+            deflate_level = p->deflate_level;
+        }
+        ncw_def_var_deflate(ncid, varid, shuffle, deflate, deflate_level);
+    }
+#if defined(NCW_FILTERS)
+    if (p->filterid != 0) {
+        double t0 = prof_start();
+        int status = nc_inq_filter_avail(ncid, p->filterid);
+
+        prof_stop(PROF_META, t0, 0);
+        if (status == NC_NOERR)
+            status = nc_def_var_filter(ncid, varid, p->filterid, 1, &p->filterlevel);
+        if (status != NC_NOERR) {
+            char varname[NC_MAX_NAME] = STR_UNKNOWN;
+
+            _ncw_inq_varname(ncid, varid, varname);
+            quit("\"%s\": nc_def_var_filter(): failed for varid = %d (varname = \"%s\"), filter id = %u (check HDF5_PLUGIN_PATH): %s", ncw_get_path(ncid), varid, varname, p->filterid, nc_strerror(status));
+        }
+    }
+#endif
+    if (p->cachesize > 0) {
+        size_t cachesize, nelems;
+        float preemption;
+
+        nc_get_chunk_cache(&cachesize, &nelems, &preemption);
+        ncw_set_var_chunk_cache(ncid, varid, p->cachesize, nelems, preemption);
+    }
+}
+
+/** Applies the output policy to all variables in a file.
+ *
+ * @param ncid NetCDF file id
+ */
+void ncw_def_outpolicy(int ncid)
+{
+    int nv = -1;
+    int vid;
+
+    ncw_inq_nvars(ncid, &nv);
+    for (vid = 0; vid < nv; ++vid)
+        ncw_def_var_outpolicy(ncid, vid);
+}
+
 /** Gets the id for the first dimension found to be present in a NetCDF file
  * out of two dimensions specified by names. Useful for handling both new and
  * old data formats.
@@ -2163,6 +2612,7 @@ void ncw_get_var_double_record(int ncid, int varid, int r, double v[])
     size_t start[NC_MAX_VAR_DIMS];
     int i;
     int status;
+    double t0;
 
     ncw_inq_vardims(ncid, varid, NC_MAX_DIMS, &ndims, dimlen);
     start[0] = r;               /* this record */
@@ -2170,7 +2620,9 @@ void ncw_get_var_double_record(int ncid, int varid, int r, double v[])
     for (i = 1; i < ndims; ++i)
         start[i] = 0;
 
+    t0 = prof_start();
     status = nc_get_vara_double(ncid, varid, start, dimlen, v);
+    ncw_prof_io(PROF_READ, t0, ncid, varid, dimlen, sizeof(v[0]));
 
     if (status != 0) {
         char varname[NC_MAX_NAME] = "STR_UNKNOWN";
@@ -2193,6 +2645,7 @@ void ncw_get_var_float_record(int ncid, int varid, int r, float v[])
     size_t start[NC_MAX_VAR_DIMS];
     int i;
     int status;
+    double t0;
 
     ncw_inq_vardims(ncid, varid, NC_MAX_DIMS, &ndims, dimlen);
     start[0] = r;               /* this record */
@@ -2200,7 +2653,9 @@ void ncw_get_var_float_record(int ncid, int varid, int r, float v[])
     for (i = 1; i < ndims; ++i)
         start[i] = 0;
 
+    t0 = prof_start();
     status = nc_get_vara_float(ncid, varid, start, dimlen, v);
+    ncw_prof_io(PROF_READ, t0, ncid, varid, dimlen, sizeof(v[0]));
 
     if (status != 0) {
         char varname[NC_MAX_NAME] = "STR_UNKNOWN";
@@ -2223,6 +2678,7 @@ void ncw_get_var_int_record(int ncid, int varid, int r, int v[])
     size_t start[NC_MAX_VAR_DIMS];
     int i;
     int status;
+    double t0;
 
     ncw_inq_vardims(ncid, varid, NC_MAX_DIMS, &ndims, dimlen);
     start[0] = r;               /* this record */
@@ -2230,7 +2686,9 @@ void ncw_get_var_int_record(int ncid, int varid, int r, int v[])
     for (i = 1; i < ndims; ++i)
         start[i] = 0;
 
+    t0 = prof_start();
     status = nc_get_vara_int(ncid, varid, start, dimlen, v);
+    ncw_prof_io(PROF_READ, t0, ncid, varid, dimlen, sizeof(v[0]));
 
     if (status != 0) {
         char varname[NC_MAX_NAME] = "STR_UNKNOWN";
@@ -2253,6 +2711,7 @@ void ncw_put_var_double_record(int ncid, int varid, int r, double v[])
     size_t start[NC_MAX_VAR_DIMS];
     int i;
     int status;
+    double t0;
 
     ncw_inq_vardims(ncid, varid, NC_MAX_DIMS, &ndims, dimlen);
     start[0] = r;               /* this record */
@@ -2260,7 +2719,9 @@ void ncw_put_var_double_record(int ncid, int varid, int r, double v[])
     for (i = 1; i < ndims; ++i)
         start[i] = 0;
 
+    t0 = prof_start();
     status = nc_put_vara_double(ncid, varid, start, dimlen, v);
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, dimlen, sizeof(v[0]));
 
     if (status != 0) {
         char varname[NC_MAX_NAME] = "STR_UNKNOWN";
@@ -2283,6 +2744,7 @@ void ncw_put_var_float_record(int ncid, int varid, int r, float v[])
     size_t start[NC_MAX_VAR_DIMS];
     int i;
     int status;
+    double t0;
 
     ncw_inq_vardims(ncid, varid, NC_MAX_DIMS, &ndims, dimlen);
     start[0] = r;               /* this record */
@@ -2290,7 +2752,9 @@ void ncw_put_var_float_record(int ncid, int varid, int r, float v[])
     for (i = 1; i < ndims; ++i)
         start[i] = 0;
 
+    t0 = prof_start();
     status = nc_put_vara_float(ncid, varid, start, dimlen, v);
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, dimlen, sizeof(v[0]));
 
     if (status != 0) {
         char varname[NC_MAX_NAME] = "STR_UNKNOWN";
@@ -2313,6 +2777,7 @@ void ncw_put_var_int_record(int ncid, int varid, int r, int v[])
     size_t start[NC_MAX_VAR_DIMS];
     int i;
     int status;
+    double t0;
 
     ncw_inq_vardims(ncid, varid, NC_MAX_DIMS, &ndims, dimlen);
     start[0] = r;               /* this record */
@@ -2320,7 +2785,9 @@ void ncw_put_var_int_record(int ncid, int varid, int r, int v[])
     for (i = 1; i < ndims; ++i)
         start[i] = 0;
 
+    t0 = prof_start();
     status = nc_put_vara_int(ncid, varid, start, dimlen, v);
+    ncw_prof_io(PROF_WRITE, t0, ncid, varid, dimlen, sizeof(v[0]));
 
     if (status != 0) {
         char varname[NC_MAX_NAME] = "STR_UNKNOWN";
@@ -2336,8 +2803,10 @@ void ncw_check_attlen(int ncid, int varid, const char attname[], size_t att_len)
 {
     nc_type type;
     size_t len;
+    double t0 = prof_start();
     int status = nc_inq_att(ncid, varid, attname, &type, &len);
 
+    prof_stop(PROF_META, t0, 0);
     if (status != NC_NOERR) {
         char varname[NC_MAX_NAME] = STR_UNKNOWN;
 
@@ -29,6 +29,22 @@
 extern const char ncw_version[];
 extern int ncw_chunkbylayers;
 
+/* Output policy, see ncw_set_outpolicy().
+ */
+#define NCW_FILTER_BZIP2 307
+#define NCW_FILTER_ZSTD 32015
+
+typedef struct {
+    int deflate_level;          /* -1 = as is */
+    int shuffle;                /* -1 = as is */
+    size_t chunklayers;         /* layers per chunk; 0 = as is */
+    size_t cachesize;           /* chunk cache size in bytes; 0 = as is */
+    unsigned int filterid;      /* HDF5 filter; 0 = none */
+    unsigned int filterlevel;
+} ncw_policy;
+
+extern ncw_policy ncw_outpolicy;
+
 /* It is possible to set the quit procedure. By default, the internal procedure
  * is used.
  */
@@ -70,6 +86,9 @@ void ncw_inq_varnatts(int ncid, int varid, int* natts);
 void ncw_inq_varsize(int ncid, int varid, size_t* size);
 void ncw_inq_var_deflate(int ncid, int varid, int* shuffle, int* deflate, int* deflate_level);
 void ncw_inq_var_fill(int ncid, int varid, int* nofill, void* fillvalue);
+void ncw_inq_var_chunking(int ncid, int varid, int* storage, size_t chunksizes[]);
+void ncw_set_var_chunk_cache(int ncid, int varid, size_t size, size_t nelems, float preemption);
+void ncw_def_var_chunking(int ncid, int varid, int storage, const size_t chunksizes[]);
 void ncw_rename_var(int ncid, const char oldname[], const char newname[]);
 void ncw_put_var(int ncid, int varid, const void* v);
 void ncw_put_var_text(int ncid, int varid, const char v[]);
@@ -150,6 +169,9 @@ void ncw_inq_dimid2(int ncid, const char dimname1[], const char dimname2[], int*
 void ncw_get_att_int2(int ncid, int varid, const char attname1[], const char attname2[], int v[]);
 
 void ncw_def_deflate(int ncid, int shuffle, int deflate, int deflate_level);
+void ncw_set_outpolicy(const char spec[]);
+void ncw_def_var_outpolicy(int ncid, int varid);
+void ncw_def_outpolicy(int ncid);
 
 void ncw_find_timevarid(int ncid, int* varid);
 void ncw_find_vars(int ncid, int ndims, const int dims[], const char attr[], const void* attval, int* nvars, int** vids);
@@ -0,0 +1,162 @@
+/******************************************************************************
+ *
+ * File:        profile.c
+ *
+ * Created:     10/2026
+ *
+ * Author:      Pavel Sakov
+ *
+ * Description: Lightweight profiling. Wall time, number of calls and bytes are
+ *              accumulated by category between prof_start() and prof_stop();
+ *              the summary is printed by prof_report(). Does nothing unless
+ *              enabled by prof_enable(). The counters can be updated from
+ *              several threads; when run with MPI, prof_report() aggregates
+ *              them across the processes.
+ *
+ * Revisions:
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(MPI)
+#include <mpi.h>
+#endif
+#include "profile.h"
+
+int prof_enabled = 0;
+
+static double prof_t0 = 0.0;
+static double prof_time[PROF_N];
+static double prof_ncall[PROF_N];
+static double prof_nbytes[PROF_N];
+
+static const char* prof_names[PROF_N] = {
+    "open/close",
+    "metadata",
+    "read",
+    "write",
+    "decode",
+    "compute",
+    "triangulation"
+};
+
+/** Gets wall clock time in seconds (from an arbitrary origin).
+ */
+double prof_walltime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1.0e-9;
+}
+
+/** Enables profiling and resets the counters.
+ */
+void prof_enable(void)
+{
+    int i;
+
+    for (i = 0; i < PROF_N; ++i) {
+        prof_time[i] = 0.0;
+        prof_ncall[i] = 0.0;
+        prof_nbytes[i] = 0.0;
+    }
+    prof_enabled = 1;
+    prof_t0 = prof_walltime();
+}
+
+/** Starts timing of an operation.
+ * @return - start time (0 if profiling is disabled)
+ */
+double prof_start(void)
+{
+    return (prof_enabled) ? prof_walltime() : 0.0;
+}
+
+/** Stops timing of an operation and adds it to the counters.
+ * @param category - one of PROF_*
+ * @param t0 - start time returned by prof_start()
+ * @param nbytes - number of bytes processed (0 if not applicable)
+ */
+void prof_stop(int category, double t0, size_t nbytes)
+{
+    double dt;
+
+    if (!prof_enabled || t0 == 0.0)
+        return;
+
+    dt = prof_walltime() - t0;
+#if defined(_OPENMP)
+#pragma omp atomic
+#endif
+    prof_time[category] += dt;
+#if defined(_OPENMP)
+#pragma omp atomic
+#endif
+    prof_ncall[category] += 1.0;
+#if defined(_OPENMP)
+#pragma omp atomic
+#endif
+    prof_nbytes[category] += (double) nbytes;
+}
+
+/** Prints the summary. Operations running concurrently (e.g. I/O overlapped
+ ** with computations) are counted in full, so that the sum of the times can
+ ** exceed the elapsed time. With MPI the counters are summed over the
+ ** processes and should be reported by all of them.
+ */
+void prof_report(void)
+{
+    double time[PROF_N], ncall[PROF_N], nbytes[PROF_N];
+    double elapsed, sum;
+    int nprocesses = 1;
+    int i;
+
+    if (!prof_enabled)
+        return;
+
+    elapsed = prof_walltime() - prof_t0;
+    for (i = 0; i < PROF_N; ++i) {
+        time[i] = prof_time[i];
+        ncall[i] = prof_ncall[i];
+        nbytes[i] = prof_nbytes[i];
+    }
+#if defined(MPI)
+    {
+        int initialised = 0, finalised = 0, rank = 0;
+
+        MPI_Initialized(&initialised);
+        MPI_Finalized(&finalised);
+        if (initialised && !finalised) {
+            MPI_Comm_size(MPI_COMM_WORLD, &nprocesses);
+            MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+            MPI_Reduce(prof_time, time, PROF_N, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+            MPI_Reduce(prof_ncall, ncall, PROF_N, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+            MPI_Reduce(prof_nbytes, nbytes, PROF_N, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+            if (rank != 0)
+                return;
+        }
+    }
+#endif
+
+    if (nprocesses > 1)
+        printf("  profile (summed over %d processes):\n", nprocesses);
+    else
+        printf("  profile:\n");
+    printf("    %-14s %10s %10s %6s %10s %10s\n", "category", "calls", "time (s)", "%", "MB", "MB/s");
+    for (i = 0, sum = 0.0; i < PROF_N; ++i) {
+        if (ncall[i] == 0.0)
+            continue;
+        sum += time[i];
+        printf("    %-14s %10.0f %10.3f %6.1f", prof_names[i], ncall[i], time[i], (elapsed > 0.0) ? time[i] / elapsed / nprocesses * 100.0 : 0.0);
+        if (nbytes[i] > 0.0)
+            printf(" %10.1f %10.1f", nbytes[i] / 1.0e6, (time[i] > 0.0) ? nbytes[i] / 1.0e6 / time[i] : 0.0);
+        printf("\n");
+    }
+    printf("    %-14s %10s %10.3f\n", "total", "", sum);
+    printf("    %-14s %10s %10.3f\n", "elapsed", "", elapsed);
+    fflush(stdout);
+}
@@ -0,0 +1,36 @@
+/******************************************************************************
+ *
+ * File:        profile.h
+ *
+ * Created:     10/2026
+ *
+ * Author:      Pavel Sakov
+ *
+ * Description: Lightweight profiling -- accumulates wall time, number of calls
+ *              and bytes by category.
+ *
+ * Revisions:
+ *
+ *****************************************************************************/
+
+#if !defined(_PROFILE_H)
+
+#define PROF_OPEN 0             /* open, create, close, (end)def */
+#define PROF_META 1             /* metadata queries and definitions */
+#define PROF_READ 2             /* nc_get_var*() */
+#define PROF_WRITE 3            /* nc_put_var*() */
+#define PROF_DECODE 4           /* fill/missing values, scaling */
+#define PROF_COMPUTE 5
+#define PROF_TRIANGULATE 6
+#define PROF_N 7
+
+extern int prof_enabled;
+
+double prof_walltime(void);
+void prof_enable(void);
+double prof_start(void);
+void prof_stop(int category, double t0, size_t nbytes);
+void prof_report(void);
+
+#define _PROFILE_H
+#endif
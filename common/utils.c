@@ -8,12 +8,14 @@
 #include <limits.h>
 #include <float.h>
 #include <errno.h>
+#include <sys/resource.h>
 #include <assert.h>
 #if defined(MPI)
 #include <mpi.h>
 #endif
 #include "ncw.h"
 #include "ncutils.h"
+#include "profile.h"
 #include "utils.h"
 
 #define BASEYEAR 1970
@@ -112,6 +114,25 @@ void print_time(const char offset[])
     printf("%s%d-%02d-%02d %02d:%02d:%02d\n", offset, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
 }
 
+/** Gets wall clock time in seconds (from an arbitrary origin).
+ */
+double get_walltime(void)
+{
+    return prof_walltime();
+}
+
+/** Gets peak resident set size of the process (in bytes).
+ */
+size_t get_peakrss(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+
+    return (size_t) usage.ru_maxrss * 1024;
+}
+
 /**
  */
 char* get_command(int argc, char* argv[])
@@ -8,6 +8,8 @@ int str2int(char* token, int* value);
 void print_command(int argc, char* argv[]);
 char* get_command(int argc, char* argv[]);
 void print_time(const char offset[]);
+double get_walltime(void);
+size_t get_peakrss(void);
 int file_exists(char* fname);
 void file_rename(char oldname[], char newname[]);
 void* alloc2d(size_t nj, size_t ni, size_t unitsize);
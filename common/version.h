@@ -1 +1 @@
-#define VERSION "0.13"
+#define VERSION "0.43"